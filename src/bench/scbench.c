@@ -0,0 +1,486 @@
+///         @file  scbench.c
+///        @brief  SmartCache end-to-end benchmark
+///       @author  François Cerbelle (Fanfan), francois@cerbelle.net
+///    @copyright  Copyright (c) 2017, François Cerbelle
+///
+/// Drives scache.getvalue over pipelined connections to measure the module
+/// itself, instead of process startup like the former shell loops did. Keys
+/// are drawn from a Zipf distribution, each request is either a hit (a query
+/// from the warmed key set) or a miss (the same query made unique with a
+/// comment), and the throughput and latency percentiles are reported for the
+/// hit-only, miss-only and mixed workloads.
+///
+/// Example :
+///     scbench -C cache1 -c 50 -P 16 -n 200000 -k 10000 -s 0.99 -r 0.9
+///             -q 'select * from customer where id=%k'
+///
+///  @internal
+///      Compiler  gcc
+///  Organization  Cerbelle.net
+///       Company  Home
+///
+///  This source code is released for free distribution under the terms of the
+///  GNU General Public License as published by the Free Software Foundation.
+///
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+typedef enum { WORKLOAD_HIT, WORKLOAD_MISS, WORKLOAD_MIXED } BenchWorkload;
+
+const char* BenchWorkloadNames[] = { "hit", "miss", "mixed" };
+
+typedef struct BenchConfig_s {
+    const char* host;
+    const char* port;
+    const char* cachename;
+    const char* querytpl;   // Query template, %k is replaced by the key number
+    uint32_t connections;
+    uint32_t pipeline;
+    uint64_t requests;
+    uint32_t keys;
+    double zipf;            // Zipf exponent, 0 for a uniform distribution
+    double hitratio;        // Share of hits in the mixed workload
+    int warm;
+} BenchConfig;
+
+// One pipelined connection to Redis
+typedef struct BenchConn_s {
+    int fd;
+    char* rbuf;
+    size_t rlen;
+    size_t rcap;
+    char* wbuf;
+    size_t wlen;
+    size_t wpos;
+    size_t wcap;
+    uint64_t* sent;         // Ring of the in-flight requests send timestamps
+    uint32_t head;
+    uint32_t inflight;
+} BenchConn;
+
+// Results of one workload run
+typedef struct BenchStats_s {
+    uint64_t completed;
+    uint64_t errors;
+    uint32_t* latencies;    // Microseconds
+    uint64_t elapsed;       // Microseconds
+} BenchStats;
+
+uint64_t benchRngState = 0x9E3779B97F4A7C15ULL;
+uint64_t benchNonce = 0;
+double* benchZipfCdf = NULL;
+
+uint64_t benchUsTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+// xorshift64* pseudo random generator
+uint64_t benchRand() {
+    benchRngState ^= benchRngState >> 12;
+    benchRngState ^= benchRngState << 25;
+    benchRngState ^= benchRngState >> 27;
+    return benchRngState * 2685821657736338717ULL;
+}
+
+double benchRandDouble() {
+    return (benchRand() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Precomputes the cumulative distribution of the Zipf law over the keys
+void benchZipfInit(uint32_t keys, double exponent) {
+    benchZipfCdf = malloc(sizeof(double)*keys);
+    double sum = 0;
+    for (uint32_t i = 0; i < keys; i++) {
+        sum += 1.0 / pow(i+1, exponent);
+        benchZipfCdf[i] = sum;
+    }
+    for (uint32_t i = 0; i < keys; i++)
+        benchZipfCdf[i] /= sum;
+}
+
+// Draws a key number, the smallest numbers being the most popular
+uint32_t benchZipfNext(uint32_t keys) {
+    double u = benchRandDouble();
+    uint32_t lo = 0, hi = keys-1;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi-lo)/2;
+        if (benchZipfCdf[mid] < u) lo = mid+1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+void *benchAlloc(size_t size) {
+    void *ptr = malloc(size);
+    if (NULL == ptr) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+void benchReserve(char** buf, size_t* cap, size_t needed) {
+    if (needed <= *cap) return;
+    while (*cap < needed) *cap = (*cap) ? (*cap)*2 : 16384;
+    *buf = realloc(*buf, *cap);
+    if (NULL == *buf) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+}
+
+void benchAppend(BenchConn* conn, const char* data, size_t len) {
+    benchReserve(&conn->wbuf, &conn->wcap, conn->wlen+len);
+    memcpy(conn->wbuf+conn->wlen, data, len);
+    conn->wlen += len;
+}
+
+void benchAppendBulk(BenchConn* conn, const char* data, size_t len) {
+    char hdr[32];
+    int hlen = snprintf(hdr, sizeof(hdr), "$%zu\r\n", len);
+    benchAppend(conn, hdr, hlen);
+    benchAppend(conn, data, len);
+    benchAppend(conn, "\r\n", 2);
+}
+
+// Expands the query template for a key, eventually made unique to force a miss
+size_t benchBuildQuery(const BenchConfig* cfg, uint32_t key, int miss, char** query, size_t* cap) {
+    size_t len = 0;
+    const char* p = cfg->querytpl;
+    char num[32];
+    while (*p) {
+        if (('%' == p[0])&&('k' == p[1])) {
+            int nlen = snprintf(num, sizeof(num), "%u", key);
+            benchReserve(query, cap, len+nlen+1);
+            memcpy(*query+len, num, nlen);
+            len += nlen;
+            p += 2;
+        } else {
+            benchReserve(query, cap, len+2);
+            (*query)[len++] = *p++;
+        }
+    }
+    if (miss) {
+        int nlen = snprintf(num, sizeof(num), " /*%llu*/", (unsigned long long)benchNonce++);
+        benchReserve(query, cap, len+nlen+1);
+        memcpy(*query+len, num, nlen);
+        len += nlen;
+    }
+    (*query)[len] = 0;
+    return len;
+}
+
+// Queues one scache.getvalue request on a connection
+void benchSend(const BenchConfig* cfg, BenchConn* conn, const char* query, size_t len) {
+    benchAppend(conn, "*3\r\n", 4);
+    benchAppendBulk(conn, "scache.getvalue", 15);
+    benchAppendBulk(conn, cfg->cachename, strlen(cfg->cachename));
+    benchAppendBulk(conn, query, len);
+    conn->sent[(conn->head + conn->inflight) % cfg->pipeline] = benchUsTime();
+    conn->inflight++;
+}
+
+// Skips one complete RESP reply. Returns its length, 0 if incomplete or -1 on
+// protocol error. *error is set when the reply is an error.
+long benchParseReply(const char* buf, size_t len, int* error) {
+    const char* eol = memchr(buf, '\r', len);
+    if ((NULL == eol)||((size_t)(eol-buf)+2 > len)) return 0;
+    size_t pos = eol-buf+2;
+    long long n;
+
+    switch (buf[0]) {
+        case '-':
+            *error = 1;
+            return pos;
+        case '+':
+        case ':':
+            return pos;
+        case '$':
+            n = strtoll(buf+1, NULL, 10);
+            if (n < 0) return pos;
+            if (pos+n+2 > len) return 0;
+            return pos+n+2;
+        case '*':
+            n = strtoll(buf+1, NULL, 10);
+            for (long long i = 0; i < n; i++) {
+                long sub = benchParseReply(buf+pos, len-pos, error);
+                if (sub <= 0) return sub;
+                pos += sub;
+            }
+            return pos;
+        default:
+            return -1;
+    }
+}
+
+int benchConnect(const BenchConfig* cfg, BenchConn* conn) {
+    struct addrinfo hints, *res, *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(cfg->host, cfg->port, &hints, &res)) return -1;
+
+    conn->fd = -1;
+    for (ai = res; ai; ai = ai->ai_next) {
+        conn->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (conn->fd < 0) continue;
+        if (0 == connect(conn->fd, ai->ai_addr, ai->ai_addrlen)) break;
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    freeaddrinfo(res);
+    if (conn->fd < 0) return -1;
+
+    int yes = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+    conn->sent = benchAlloc(sizeof(uint64_t)*cfg->pipeline);
+    return 0;
+}
+
+// Runs requests over all the connections until all of them are answered.
+// When keys is not NULL, it is the list of keys to request (warming),
+// otherwise keys are drawn according to the workload.
+void benchRun(const BenchConfig* cfg, BenchConn* conns, BenchWorkload workload,
+        const uint32_t* keys, uint64_t requests, BenchStats* stats) {
+    struct pollfd* pfds = benchAlloc(sizeof(struct pollfd)*cfg->connections);
+    char* query = NULL;
+    size_t querycap = 0;
+    uint64_t issued = 0;
+
+    memset(stats, 0, sizeof(BenchStats));
+    stats->latencies = benchAlloc(sizeof(uint32_t)*(requests ? requests : 1));
+    uint64_t start = benchUsTime();
+
+    while (stats->completed < requests) {
+        for (uint32_t c = 0; c < cfg->connections; c++) {
+            BenchConn* conn = &conns[c];
+            while ((conn->inflight < cfg->pipeline)&&(issued < requests)) {
+                uint32_t key;
+                int miss;
+                if (keys) {
+                    key = keys[issued];
+                    miss = 0;
+                } else {
+                    key = benchZipfNext(cfg->keys);
+                    miss = (WORKLOAD_MISS == workload)||
+                        ((WORKLOAD_MIXED == workload)&&(benchRandDouble() >= cfg->hitratio));
+                }
+                size_t len = benchBuildQuery(cfg, key, miss, &query, &querycap);
+                benchSend(cfg, conn, query, len);
+                issued++;
+            }
+            pfds[c].fd = conn->fd;
+            pfds[c].events = POLLIN | ((conn->wpos < conn->wlen) ? POLLOUT : 0);
+            pfds[c].revents = 0;
+        }
+
+        if (poll(pfds, cfg->connections, 1000) < 0) {
+            if (EINTR == errno) continue;
+            perror("poll");
+            exit(1);
+        }
+
+        for (uint32_t c = 0; c < cfg->connections; c++) {
+            BenchConn* conn = &conns[c];
+            if (pfds[c].revents & POLLOUT) {
+                ssize_t nw = write(conn->fd, conn->wbuf+conn->wpos, conn->wlen-conn->wpos);
+                if (nw > 0) conn->wpos += nw;
+                if (conn->wpos == conn->wlen) conn->wpos = conn->wlen = 0;
+            }
+            if (pfds[c].revents & (POLLIN|POLLERR|POLLHUP)) {
+                benchReserve(&conn->rbuf, &conn->rcap, conn->rlen+16384);
+                ssize_t nr = read(conn->fd, conn->rbuf+conn->rlen, conn->rcap-conn->rlen);
+                if (0 == nr) {
+                    fprintf(stderr, "Connection closed by server\n");
+                    exit(1);
+                }
+                if (nr < 0) {
+                    if ((EAGAIN == errno)||(EINTR == errno)) continue;
+                    perror("read");
+                    exit(1);
+                }
+                conn->rlen += nr;
+
+                // Consume all the complete replies
+                size_t pos = 0;
+                uint64_t now = benchUsTime();
+                while (conn->inflight) {
+                    int error = 0;
+                    long used = benchParseReply(conn->rbuf+pos, conn->rlen-pos, &error);
+                    if (used < 0) {
+                        fprintf(stderr, "Protocol error\n");
+                        exit(1);
+                    }
+                    if (0 == used) break;
+                    pos += used;
+                    stats->latencies[stats->completed++] = now - conn->sent[conn->head];
+                    stats->errors += error;
+                    conn->head = (conn->head+1) % cfg->pipeline;
+                    conn->inflight--;
+                }
+                memmove(conn->rbuf, conn->rbuf+pos, conn->rlen-pos);
+                conn->rlen -= pos;
+            }
+        }
+    }
+    stats->elapsed = benchUsTime() - start;
+    free(query);
+    free(pfds);
+}
+
+int benchCompareLatency(const void* a, const void* b) {
+    uint32_t la = *(const uint32_t*)a;
+    uint32_t lb = *(const uint32_t*)b;
+    return (la > lb) - (la < lb);
+}
+
+uint32_t benchPercentile(const BenchStats* stats, double percentile) {
+    uint64_t rank = (uint64_t)(stats->completed * percentile / 100.0);
+    if (rank >= stats->completed) rank = stats->completed-1;
+    return stats->latencies[rank];
+}
+
+void benchReport(BenchWorkload workload, BenchStats* stats) {
+    if (0 == stats->completed) return;
+    qsort(stats->latencies, stats->completed, sizeof(uint32_t), benchCompareLatency);
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < stats->completed; i++)
+        total += stats->latencies[i];
+
+    printf("== %s ==\n", BenchWorkloadNames[workload]);
+    printf("requests: %llu  errors: %llu  time: %.3f s  throughput: %.0f ops/s\n",
+            (unsigned long long)stats->completed, (unsigned long long)stats->errors,
+            stats->elapsed/1e6, stats->completed*1e6/(stats->elapsed ? stats->elapsed : 1));
+    printf("latency (us): avg %llu  p50 %u  p90 %u  p99 %u  p99.9 %u  max %u\n",
+            (unsigned long long)(total/stats->completed),
+            benchPercentile(stats, 50), benchPercentile(stats, 90),
+            benchPercentile(stats, 99), benchPercentile(stats, 99.9),
+            stats->latencies[stats->completed-1]);
+}
+
+// Builds a query generating a resultset of the given shape, with a recursive
+// CTE (MySQL 8 and SQLite). The first column is the row number plus the key.
+char* benchShapeQuery(const char* shape) {
+    unsigned int rows, cols, width;
+    if ((3 != sscanf(shape, "%u:%u:%u", &rows, &cols, &width))||(0 == rows)||(0 == cols)) {
+        fprintf(stderr, "Invalid shape %s, expected rows:cols:width\n", shape);
+        exit(1);
+    }
+    size_t cap = 256 + cols*(width+32);
+    char* query = benchAlloc(cap);
+    size_t len = snprintf(query, cap,
+            "WITH RECURSIVE seq(n) AS (SELECT 1 UNION ALL SELECT n+1 FROM seq WHERE n<%u) "
+            "SELECT n+%%k AS id", rows);
+    for (unsigned int c = 1; c < cols; c++) {
+        len += snprintf(query+len, cap-len, ", '");
+        memset(query+len, 'x', width);
+        len += width;
+        len += snprintf(query+len, cap-len, "' AS c%u", c);
+    }
+    snprintf(query+len, cap-len, " FROM seq");
+    return query;
+}
+
+void benchUsage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -h <host>       Redis host (default 127.0.0.1)\n"
+            "  -p <port>       Redis port (default 6379)\n"
+            "  -C <cache>      Cache name (default cache1)\n"
+            "  -c <conns>      Concurrent connections (default 50)\n"
+            "  -P <depth>      Pipeline depth per connection (default 1)\n"
+            "  -n <requests>   Requests per workload (default 100000)\n"
+            "  -k <keys>       Number of distinct keys (default 1000)\n"
+            "  -s <exponent>   Zipf exponent, 0 for uniform (default 0.99)\n"
+            "  -r <ratio>      Hit ratio of the mixed workload (default 0.9)\n"
+            "  -q <template>   Query template, %%k is replaced by the key\n"
+            "                  (default 'select * from customer where id=%%k')\n"
+            "  -S <r:c:w>      Generated resultset shape instead of -q :\n"
+            "                  rows, columns and column width\n"
+            "  -w <workload>   hit, miss, mixed or all (default all)\n"
+            "  -N              Do not warm the keys before hit and mixed runs\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    BenchConfig cfg = {
+        "127.0.0.1", "6379", "cache1", "select * from customer where id=%k",
+        50, 1, 100000, 1000, 0.99, 0.9, 1
+    };
+    const char* workloads = "all";
+    int opt;
+
+    while (-1 != (opt = getopt(argc, argv, "h:p:C:c:P:n:k:s:r:q:S:w:N"))) {
+        switch (opt) {
+            case 'h': cfg.host = optarg; break;
+            case 'p': cfg.port = optarg; break;
+            case 'C': cfg.cachename = optarg; break;
+            case 'c': cfg.connections = atoi(optarg); break;
+            case 'P': cfg.pipeline = atoi(optarg); break;
+            case 'n': cfg.requests = strtoull(optarg, NULL, 10); break;
+            case 'k': cfg.keys = atoi(optarg); break;
+            case 's': cfg.zipf = atof(optarg); break;
+            case 'r': cfg.hitratio = atof(optarg); break;
+            case 'q': cfg.querytpl = optarg; break;
+            case 'S': cfg.querytpl = benchShapeQuery(optarg); break;
+            case 'w': workloads = optarg; break;
+            case 'N': cfg.warm = 0; break;
+            default: benchUsage(argv[0]);
+        }
+    }
+    if ((0 == cfg.connections)||(0 == cfg.pipeline)||(0 == cfg.keys)||
+            (cfg.hitratio < 0)||(cfg.hitratio > 1))
+        benchUsage(argv[0]);
+
+    benchRngState ^= (uint64_t)time(NULL);
+    benchNonce = (uint64_t)time(NULL) << 20;
+    benchZipfInit(cfg.keys, cfg.zipf);
+
+    BenchConn* conns = calloc(cfg.connections, sizeof(BenchConn));
+    for (uint32_t c = 0; c < cfg.connections; c++) {
+        if (benchConnect(&cfg, &conns[c])) {
+            fprintf(stderr, "Cannot connect to %s:%s\n", cfg.host, cfg.port);
+            return 1;
+        }
+    }
+
+    int all = !strcasecmp(workloads, "all");
+    BenchStats stats;
+    if ((cfg.warm)&&((all)||(strcasecmp(workloads, "miss")))) {
+        // Populate all the keys, so that the hits are actual hits
+        uint32_t* keys = benchAlloc(sizeof(uint32_t)*cfg.keys);
+        for (uint32_t k = 0; k < cfg.keys; k++) keys[k] = k;
+        benchRun(&cfg, conns, WORKLOAD_HIT, keys, cfg.keys, &stats);
+        printf("warmed %u keys in %.3f s (%llu errors)\n", cfg.keys, stats.elapsed/1e6,
+                (unsigned long long)stats.errors);
+        free(stats.latencies);
+        free(keys);
+    }
+
+    for (int w = WORKLOAD_HIT; w <= WORKLOAD_MIXED; w++) {
+        if ((!all)&&(strcasecmp(workloads, BenchWorkloadNames[w]))) continue;
+        benchRun(&cfg, conns, w, NULL, cfg.requests, &stats);
+        benchReport(w, &stats);
+        free(stats.latencies);
+    }
+    return 0;
+}
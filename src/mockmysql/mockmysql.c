@@ -0,0 +1,712 @@
+///         @file  mockmysql.c
+///        @brief  Mock MySQL server for SmartCache benchmarks
+///       @author  François Cerbelle (Fanfan), francois@cerbelle.net
+///    @copyright  Copyright (c) 2017, François Cerbelle
+///
+/// Speaks enough of the MySQL client/server protocol for mysql_real_connect,
+/// mysql_query, mysql_ping and mysql_store_result : handshake (any user and
+/// password are accepted), COM_QUERY, COM_PING, COM_INIT_DB and COM_QUIT.
+/// Every query returns a synthetic resultset of a configurable shape, after an
+/// injected delay drawn from a configurable distribution. Errors and
+/// connection drops can be injected with a given probability, so that the
+/// miss path of the cache (coalescing, pooling, timeouts, stampedes) can be
+/// benchmarked without a real MySQL server.
+///
+/// The defaults can be overridden per query with a comment such as
+///     select 1 /*mock rows=100 cols=4 width=32 delay=5 error=0 drop=0*/
+///
+/// "KILL QUERY <id>" interrupts the running query of the connection <id>.
+///
+/// Clients connected with CLIENT_MULTI_STATEMENTS can send several
+/// ';'-separated statements in one COM_QUERY, they are executed in sequence
+/// (each one with its own delay) and the first failing one ends the batch,
+/// like MySQL does.
+///
+///  @internal
+///      Compiler  gcc
+///  Organization  Cerbelle.net
+///       Company  Home
+///
+///  This source code is released for free distribution under the terms of the
+///  GNU General Public License as published by the Free Software Foundation.
+///
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+// Protocol constants
+#define CLIENT_LONG_PASSWORD                    0x00000001
+#define CLIENT_FOUND_ROWS                       0x00000002
+#define CLIENT_LONG_FLAG                        0x00000004
+#define CLIENT_CONNECT_WITH_DB                  0x00000008
+#define CLIENT_PROTOCOL_41                      0x00000200
+#define CLIENT_TRANSACTIONS                     0x00002000
+#define CLIENT_SECURE_CONNECTION                0x00008000
+#define CLIENT_MULTI_STATEMENTS                 0x00010000
+#define CLIENT_MULTI_RESULTS                    0x00020000
+#define CLIENT_PLUGIN_AUTH                      0x00080000
+#define CLIENT_PLUGIN_AUTH_LENENC_CLIENT_DATA   0x00200000
+
+#define SERVER_STATUS_AUTOCOMMIT                0x0002
+#define SERVER_MORE_RESULTS_EXISTS              0x0008
+
+#define COM_QUIT        0x01
+#define COM_INIT_DB     0x02
+#define COM_QUERY       0x03
+#define COM_PING        0x0e
+
+#define MYSQL_TYPE_LONGLONG     0x08
+#define MYSQL_TYPE_VAR_STRING   0xfd
+
+#define SERVER_CAPABILITIES (CLIENT_LONG_PASSWORD|CLIENT_FOUND_ROWS|CLIENT_LONG_FLAG| \
+        CLIENT_CONNECT_WITH_DB|CLIENT_PROTOCOL_41|CLIENT_TRANSACTIONS|CLIENT_SECURE_CONNECTION| \
+        CLIENT_MULTI_STATEMENTS|CLIENT_MULTI_RESULTS|CLIENT_PLUGIN_AUTH| \
+        CLIENT_PLUGIN_AUTH_LENENC_CLIENT_DATA)
+
+#define AUTH_PLUGIN "mysql_native_password"
+
+typedef enum { DELAY_CONST, DELAY_UNIFORM, DELAY_EXP, DELAY_PARETO } MockDelayKind;
+
+// Delay distribution, in milliseconds
+typedef struct MockDelay_s {
+    MockDelayKind kind;
+    double a;
+    double b;
+} MockDelay;
+
+// Behaviour of a query, defaults from the command line, eventually overridden
+// by a /*mock ...*/ comment
+typedef struct MockShape_s {
+    unsigned long rows;
+    unsigned int cols;
+    unsigned int width;
+    MockDelay delay;
+    double error;           // Probability to answer an error
+    double drop;            // Probability to close the connection
+} MockShape;
+
+typedef struct MockConn_s {
+    int fd;
+    uint32_t id;
+    uint8_t seq;
+    uint32_t capabilities;
+    uint64_t rng;
+    int busy;               // A query is running
+    int killed;             // The running query has been killed
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct MockConn_s* next;
+} MockConn;
+
+MockShape mockDefaults = { 10, 4, 16, { DELAY_CONST, 0, 0 }, 0, 0 };
+long mockChangePeriod = 0;  // Resultsets content changes every n ms, 0 never
+int mockVerbose = 0;
+
+pthread_mutex_t mockConnsLock = PTHREAD_MUTEX_INITIALIZER;
+MockConn* mockConns = NULL;
+uint32_t mockNextId = 1;
+
+// Growable output buffer
+typedef struct MockBuf_s {
+    unsigned char* data;
+    size_t len;
+    size_t cap;
+} MockBuf;
+
+void mockBufReserve(MockBuf* buf, size_t extra) {
+    if (buf->len+extra <= buf->cap) return;
+    while (buf->len+extra > buf->cap) buf->cap = buf->cap ? buf->cap*2 : 4096;
+    buf->data = realloc(buf->data, buf->cap);
+    if (NULL == buf->data) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+}
+
+void mockBufAppend(MockBuf* buf, const void* data, size_t len) {
+    mockBufReserve(buf, len);
+    memcpy(buf->data+buf->len, data, len);
+    buf->len += len;
+}
+
+void mockBufByte(MockBuf* buf, uint8_t byte) {
+    mockBufAppend(buf, &byte, 1);
+}
+
+void mockBufInt(MockBuf* buf, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        mockBufByte(buf, (value >> (8*i)) & 0xff);
+}
+
+void mockBufLenEncInt(MockBuf* buf, uint64_t value) {
+    if (value < 251) {
+        mockBufByte(buf, value);
+    } else if (value < 0x10000) {
+        mockBufByte(buf, 0xfc);
+        mockBufInt(buf, value, 2);
+    } else if (value < 0x1000000) {
+        mockBufByte(buf, 0xfd);
+        mockBufInt(buf, value, 3);
+    } else {
+        mockBufByte(buf, 0xfe);
+        mockBufInt(buf, value, 8);
+    }
+}
+
+void mockBufLenEncStr(MockBuf* buf, const char* str, size_t len) {
+    mockBufLenEncInt(buf, len);
+    mockBufAppend(buf, str, len);
+}
+
+// Starts a new packet in the buffer, returns its header offset
+size_t mockPacketStart(MockBuf* buf) {
+    size_t offset = buf->len;
+    mockBufInt(buf, 0, 4);
+    return offset;
+}
+
+// Fills the header of the packet started at offset
+void mockPacketEnd(MockConn* conn, MockBuf* buf, size_t offset) {
+    size_t len = buf->len - offset - 4;
+    buf->data[offset] = len & 0xff;
+    buf->data[offset+1] = (len >> 8) & 0xff;
+    buf->data[offset+2] = (len >> 16) & 0xff;
+    buf->data[offset+3] = conn->seq++;
+}
+
+int mockWriteAll(int fd, const unsigned char* data, size_t len) {
+    while (len) {
+        ssize_t nw = write(fd, data, len);
+        if (nw < 0) {
+            if (EINTR == errno) continue;
+            return -1;
+        }
+        data += nw;
+        len -= nw;
+    }
+    return 0;
+}
+
+int mockFlush(MockConn* conn, MockBuf* buf) {
+    int ret = mockWriteAll(conn->fd, buf->data, buf->len);
+    buf->len = 0;
+    return ret;
+}
+
+int mockReadAll(int fd, unsigned char* data, size_t len) {
+    while (len) {
+        ssize_t nr = read(fd, data, len);
+        if (nr <= 0) {
+            if ((nr < 0)&&(EINTR == errno)) continue;
+            return -1;
+        }
+        data += nr;
+        len -= nr;
+    }
+    return 0;
+}
+
+// Reads one client packet, returns its length or -1. *payload has to be freed.
+long mockReadPacket(MockConn* conn, unsigned char** payload) {
+    unsigned char hdr[4];
+    if (mockReadAll(conn->fd, hdr, 4)) return -1;
+    size_t len = hdr[0] | (hdr[1] << 8) | (hdr[2] << 16);
+    conn->seq = hdr[3]+1;
+    *payload = malloc(len+1);
+    if (mockReadAll(conn->fd, *payload, len)) {
+        free(*payload);
+        return -1;
+    }
+    (*payload)[len] = 0;
+    return len;
+}
+
+void mockOk(MockConn* conn, MockBuf* buf, uint16_t status) {
+    size_t p = mockPacketStart(buf);
+    mockBufByte(buf, 0x00);
+    mockBufLenEncInt(buf, 0);       // Affected rows
+    mockBufLenEncInt(buf, 0);       // Last insert id
+    mockBufInt(buf, status, 2);
+    mockBufInt(buf, 0, 2);          // Warnings
+    mockPacketEnd(conn, buf, p);
+}
+
+void mockEof(MockConn* conn, MockBuf* buf, uint16_t status) {
+    size_t p = mockPacketStart(buf);
+    mockBufByte(buf, 0xfe);
+    mockBufInt(buf, 0, 2);          // Warnings
+    mockBufInt(buf, status, 2);
+    mockPacketEnd(conn, buf, p);
+}
+
+void mockErr(MockConn* conn, MockBuf* buf, uint16_t code, const char* state, const char* msg) {
+    size_t p = mockPacketStart(buf);
+    mockBufByte(buf, 0xff);
+    mockBufInt(buf, code, 2);
+    mockBufByte(buf, '#');
+    mockBufAppend(buf, state, 5);
+    mockBufAppend(buf, msg, strlen(msg));
+    mockPacketEnd(conn, buf, p);
+}
+
+uint64_t mockRand(MockConn* conn) {
+    conn->rng ^= conn->rng >> 12;
+    conn->rng ^= conn->rng << 25;
+    conn->rng ^= conn->rng >> 27;
+    return conn->rng * 2685821657736338717ULL;
+}
+
+double mockRandDouble(MockConn* conn) {
+    return (mockRand(conn) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Draws a delay in milliseconds from the distribution
+double mockDelayDraw(MockConn* conn, const MockDelay* delay) {
+    double u = mockRandDouble(conn);
+    switch (delay->kind) {
+        case DELAY_UNIFORM: return delay->a + u*(delay->b - delay->a);
+        case DELAY_EXP: return -delay->a * log(1.0 - u);
+        case DELAY_PARETO: return delay->a / pow(1.0 - u, 1.0/delay->b);
+        default: return delay->a;
+    }
+}
+
+// Parses const:<ms>, uniform:<min>:<max>, exp:<mean> or pareto:<min>:<alpha>
+int mockDelayParse(const char* spec, MockDelay* delay) {
+    delay->a = delay->b = 0;
+    if (!strncmp(spec, "uniform:", 8)) {
+        delay->kind = DELAY_UNIFORM;
+        return (2 == sscanf(spec+8, "%lf:%lf", &delay->a, &delay->b)) ? 0 : -1;
+    } else if (!strncmp(spec, "exp:", 4)) {
+        delay->kind = DELAY_EXP;
+        return (1 == sscanf(spec+4, "%lf", &delay->a)) ? 0 : -1;
+    } else if (!strncmp(spec, "pareto:", 7)) {
+        delay->kind = DELAY_PARETO;
+        return ((2 == sscanf(spec+7, "%lf:%lf", &delay->a, &delay->b))&&(delay->b > 0)) ? 0 : -1;
+    } else {
+        delay->kind = DELAY_CONST;
+        if (!strncmp(spec, "const:", 6)) spec += 6;
+        return (1 == sscanf(spec, "%lf", &delay->a)) ? 0 : -1;
+    }
+}
+
+// Applies the /*mock key=value ...*/ overrides of a query
+void mockShapeParse(const char* query, MockShape* shape) {
+    const char* p = strstr(query, "/*mock");
+    if (NULL == p) return;
+    const char* end = strstr(p, "*/");
+    p += 6;
+    while ((p)&&((NULL == end)||(p < end))) {
+        while (' ' == *p) p++;
+        if (!strncmp(p, "rows=", 5)) shape->rows = strtoul(p+5, NULL, 10);
+        else if (!strncmp(p, "cols=", 5)) shape->cols = strtoul(p+5, NULL, 10);
+        else if (!strncmp(p, "width=", 6)) shape->width = strtoul(p+6, NULL, 10);
+        else if (!strncmp(p, "delay=", 6)) {
+            char spec[64];
+            sscanf(p+6, "%63[^ *]", spec);
+            mockDelayParse(spec, &shape->delay);
+        }
+        else if (!strncmp(p, "error=", 6)) shape->error = atof(p+6);
+        else if (!strncmp(p, "drop=", 5)) shape->drop = atof(p+5);
+        p = strchr(p, ' ');
+    }
+    if (0 == shape->cols) shape->cols = 1;
+}
+
+// Waits for the query delay. Returns -1 if the query has been killed.
+int mockWait(MockConn* conn, double ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    long long ns = deadline.tv_nsec + (long long)(ms*1000000);
+    deadline.tv_sec += ns / 1000000000;
+    deadline.tv_nsec = ns % 1000000000;
+
+    int killed = 0;
+    pthread_mutex_lock(&conn->lock);
+    while ((!conn->killed)&&(ms > 0)&&
+            (ETIMEDOUT != pthread_cond_timedwait(&conn->cond, &conn->lock, &deadline)))
+        ;
+    killed = conn->killed;
+    pthread_mutex_unlock(&conn->lock);
+    return killed ? -1 : 0;
+}
+
+// Interrupts the running query of a connection
+void mockKill(MockConn* conn, MockBuf* buf, uint32_t id) {
+    int found = 0;
+    pthread_mutex_lock(&mockConnsLock);
+    for (MockConn* cur = mockConns; cur; cur = cur->next) {
+        if (cur->id != id) continue;
+        found = 1;
+        pthread_mutex_lock(&cur->lock);
+        if (cur->busy) cur->killed = 1;
+        pthread_cond_signal(&cur->cond);
+        pthread_mutex_unlock(&cur->lock);
+    }
+    pthread_mutex_unlock(&mockConnsLock);
+    if (found) mockOk(conn, buf, SERVER_STATUS_AUTOCOMMIT);
+    else mockErr(conn, buf, 1094, "HY000", "Unknown thread id");
+}
+
+// Sends a synthetic resultset. Returns -1 if the connection has to be dropped,
+// 1 if an error has been sent instead.
+int mockResultset(MockConn* conn, MockBuf* buf, const char* query, uint16_t status) {
+    MockShape shape = mockDefaults;
+    mockShapeParse(query, &shape);
+
+    if (mockRandDouble(conn) < shape.drop) return -1;
+
+    pthread_mutex_lock(&conn->lock);
+    conn->busy = 1;
+    conn->killed = 0;
+    pthread_mutex_unlock(&conn->lock);
+    int killed = mockWait(conn, mockDelayDraw(conn, &shape.delay));
+    pthread_mutex_lock(&conn->lock);
+    conn->busy = 0;
+    conn->killed = 0;
+    pthread_mutex_unlock(&conn->lock);
+
+    if (killed) {
+        mockErr(conn, buf, 1317, "70100", "Query execution was interrupted");
+        return 1;
+    }
+    if (mockRandDouble(conn) < shape.error) {
+        mockErr(conn, buf, 1105, "HY000", "Injected error");
+        return 1;
+    }
+
+    // Content depends on the query text and on the current period
+    uint64_t seed = 14695981039346656037ULL;
+    for (const char* p = query; *p; p++)
+        seed = (seed ^ (unsigned char)*p) * 1099511628211ULL;
+    if (mockChangePeriod) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        seed += (now.tv_sec*1000 + now.tv_nsec/1000000) / mockChangePeriod;
+    }
+
+    size_t p = mockPacketStart(buf);
+    mockBufLenEncInt(buf, shape.cols);
+    mockPacketEnd(conn, buf, p);
+
+    char name[32];
+    for (unsigned int c = 0; c < shape.cols; c++) {
+        int nlen = (0 == c) ? snprintf(name, sizeof(name), "id") : snprintf(name, sizeof(name), "c%u", c);
+        p = mockPacketStart(buf);
+        mockBufLenEncStr(buf, "def", 3);        // Catalog
+        mockBufLenEncStr(buf, "mock", 4);       // Schema
+        mockBufLenEncStr(buf, "t", 1);          // Table
+        mockBufLenEncStr(buf, "t", 1);          // Original table
+        mockBufLenEncStr(buf, name, nlen);
+        mockBufLenEncStr(buf, name, nlen);
+        mockBufLenEncInt(buf, 0x0c);
+        mockBufInt(buf, 0x21, 2);               // utf8_general_ci
+        mockBufInt(buf, (0 == c) ? 20 : shape.width, 4);
+        mockBufByte(buf, (0 == c) ? MYSQL_TYPE_LONGLONG : MYSQL_TYPE_VAR_STRING);
+        mockBufInt(buf, 0, 2);                  // Flags
+        mockBufByte(buf, 0);                    // Decimals
+        mockBufInt(buf, 0, 2);                  // Filler
+        mockPacketEnd(conn, buf, p);
+    }
+    mockEof(conn, buf, SERVER_STATUS_AUTOCOMMIT);
+
+    char* value = malloc(shape.width+1);
+    for (unsigned long r = 0; r < shape.rows; r++) {
+        p = mockPacketStart(buf);
+        int nlen = snprintf(name, sizeof(name), "%lu", r+1);
+        mockBufLenEncStr(buf, name, nlen);
+        for (unsigned int c = 1; c < shape.cols; c++) {
+            uint64_t h = (seed + r*31 + c) * 2685821657736338717ULL;
+            for (unsigned int i = 0; i < shape.width; i++) {
+                value[i] = 'a' + (h % 26);
+                h = h*6364136223846793005ULL + 1442695040888963407ULL;
+            }
+            mockBufLenEncStr(buf, value, shape.width);
+        }
+        mockPacketEnd(conn, buf, p);
+        if (buf->len > 65536) mockFlush(conn, buf);
+    }
+    free(value);
+    mockEof(conn, buf, status);
+    return 0;
+}
+
+// Executes one statement. Returns -1 if the connection has to be dropped, 1
+// if an error has been sent.
+int mockStatement(MockConn* conn, MockBuf* buf, const char* query, uint16_t status) {
+    while (' ' == *query) query++;
+    if (!strncasecmp(query, "kill query ", 11)) {
+        mockKill(conn, buf, strtoul(query+11, NULL, 10));
+        return 0;
+    }
+    if ((!strncasecmp(query, "set ", 4))||(!strncasecmp(query, "use ", 4))) {
+        mockOk(conn, buf, status);
+        return 0;
+    }
+    return mockResultset(conn, buf, query, status);
+}
+
+// Returns the end of the statement starting at query : the first ';' outside
+// quotes and comments, or the end of the string
+char* mockStatementEnd(char* query) {
+    char quote = 0;
+    char* p = query;
+    for (; *p; p++) {
+        if (quote) {
+            if ('\\' == *p) { if (p[1]) p++; }
+            else if (*p == quote) quote = 0;
+        } else if (('\'' == *p)||('"' == *p)||('`' == *p)) {
+            quote = *p;
+        } else if (('/' == *p)&&('*' == p[1])) {
+            char* end = strstr(p+2, "*/");
+            if (NULL == end) return p+strlen(p);
+            p = end+1;
+        } else if (';' == *p) {
+            break;
+        }
+    }
+    return p;
+}
+
+// Handles a COM_QUERY. Returns -1 if the connection has to be dropped.
+int mockQuery(MockConn* conn, MockBuf* buf, char* query) {
+    if (mockVerbose) fprintf(stderr, "[%u] %s\n", conn->id, query);
+    if (!(conn->capabilities & CLIENT_MULTI_STATEMENTS))
+        return (mockStatement(conn, buf, query, SERVER_STATUS_AUTOCOMMIT) < 0) ? -1 : 0;
+
+    // One resultset per statement, all but the last one flagged with
+    // SERVER_MORE_RESULTS_EXISTS. An error ends the batch.
+    while (1) {
+        char* end = mockStatementEnd(query);
+        char* next = end;
+        if (';' == *next) next++;
+        while ((' ' == *next)||('\n' == *next)||('\t' == *next)||('\r' == *next)) next++;
+        int last = (0 == *next);
+        *end = 0;
+        int rc = mockStatement(conn, buf, query,
+                SERVER_STATUS_AUTOCOMMIT | (last ? 0 : SERVER_MORE_RESULTS_EXISTS));
+        if (rc < 0) return -1;
+        if ((rc > 0)||(last)) return 0;
+        query = next;
+    }
+}
+
+// Sends the initial handshake and accepts any credentials
+int mockHandshake(MockConn* conn, MockBuf* buf) {
+    unsigned char scramble[20];
+    for (int i = 0; i < 20; i++) scramble[i] = 'A' + (mockRand(conn) % 26);
+
+    conn->seq = 0;
+    size_t p = mockPacketStart(buf);
+    mockBufByte(buf, 10);                               // Protocol version
+    mockBufAppend(buf, "5.7.99-scache-mock", 19);
+    mockBufInt(buf, conn->id, 4);
+    mockBufAppend(buf, scramble, 8);
+    mockBufByte(buf, 0);
+    mockBufInt(buf, SERVER_CAPABILITIES & 0xffff, 2);
+    mockBufByte(buf, 0x21);                             // utf8_general_ci
+    mockBufInt(buf, SERVER_STATUS_AUTOCOMMIT, 2);
+    mockBufInt(buf, SERVER_CAPABILITIES >> 16, 2);
+    mockBufByte(buf, 21);                               // Auth data length
+    mockBufInt(buf, 0, 10);                             // Reserved
+    mockBufAppend(buf, scramble+8, 12);
+    mockBufByte(buf, 0);
+    mockBufAppend(buf, AUTH_PLUGIN, strlen(AUTH_PLUGIN)+1);
+    mockPacketEnd(conn, buf, p);
+    if (mockFlush(conn, buf)) return -1;
+
+    unsigned char* pkt;
+    long len = mockReadPacket(conn, &pkt);
+    if (len < 32) {
+        if (len >= 0) free(pkt);
+        return -1;
+    }
+    conn->capabilities = pkt[0] | (pkt[1] << 8) | (pkt[2] << 16) | ((uint32_t)pkt[3] << 24);
+
+    // Skip the user name, auth response and database to find the plugin name
+    size_t pos = 32;
+    pos += strnlen((char*)pkt+pos, len-pos) + 1;
+    if ((size_t)len > pos) {
+        if (conn->capabilities & CLIENT_PLUGIN_AUTH_LENENC_CLIENT_DATA)
+            pos += 1 + pkt[pos];
+        else if (conn->capabilities & CLIENT_SECURE_CONNECTION)
+            pos += 1 + pkt[pos];
+        else
+            pos += strnlen((char*)pkt+pos, len-pos) + 1;
+    }
+    if ((conn->capabilities & CLIENT_CONNECT_WITH_DB)&&((size_t)len > pos))
+        pos += strnlen((char*)pkt+pos, len-pos) + 1;
+    int switchauth = (conn->capabilities & CLIENT_PLUGIN_AUTH)&&((size_t)len > pos)&&
+        (strncmp((char*)pkt+pos, AUTH_PLUGIN, len-pos));
+    free(pkt);
+
+    if (switchauth) {
+        // The client used another plugin, ask for mysql_native_password
+        p = mockPacketStart(buf);
+        mockBufByte(buf, 0xfe);
+        mockBufAppend(buf, AUTH_PLUGIN, strlen(AUTH_PLUGIN)+1);
+        mockBufAppend(buf, scramble, 20);
+        mockBufByte(buf, 0);
+        mockPacketEnd(conn, buf, p);
+        if (mockFlush(conn, buf)) return -1;
+        if (mockReadPacket(conn, &pkt) < 0) return -1;
+        free(pkt);
+    }
+
+    mockOk(conn, buf, SERVER_STATUS_AUTOCOMMIT);
+    return mockFlush(conn, buf);
+}
+
+void mockUnregister(MockConn* conn) {
+    pthread_mutex_lock(&mockConnsLock);
+    MockConn** cur = &mockConns;
+    while (*cur != conn) cur = &(*cur)->next;
+    *cur = conn->next;
+    pthread_mutex_unlock(&mockConnsLock);
+}
+
+void* mockConnThread(void* arg) {
+    MockConn* conn = arg;
+    MockBuf buf = { NULL, 0, 0 };
+
+    if (0 == mockHandshake(conn, &buf)) {
+        unsigned char* pkt;
+        long len;
+        while ((len = mockReadPacket(conn, &pkt)) > 0) {
+            int drop = 0;
+            switch (pkt[0]) {
+                case COM_QUIT:
+                    drop = 1;
+                    break;
+                case COM_PING:
+                case COM_INIT_DB:
+                    mockOk(conn, &buf, SERVER_STATUS_AUTOCOMMIT);
+                    break;
+                case COM_QUERY:
+                    drop = mockQuery(conn, &buf, (char*)pkt+1);
+                    break;
+                default:
+                    mockErr(conn, &buf, 1047, "08S01", "Unknown command");
+            }
+            free(pkt);
+            if ((drop)||(mockFlush(conn, &buf))) break;
+        }
+    }
+
+    mockUnregister(conn);
+    close(conn->fd);
+    pthread_mutex_destroy(&conn->lock);
+    pthread_cond_destroy(&conn->cond);
+    free(buf.data);
+    free(conn);
+    return NULL;
+}
+
+void mockUsage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -b <addr>       Bind address (default 127.0.0.1)\n"
+            "  -p <port>       Listening port (default 3307)\n"
+            "  -r <rows>       Rows per resultset (default 10)\n"
+            "  -c <cols>       Columns per resultset (default 4)\n"
+            "  -w <width>      Width of the string columns (default 16)\n"
+            "  -d <delay>      Query delay distribution in ms (default const:0) :\n"
+            "                  const:<ms>, uniform:<min>:<max>, exp:<mean> or\n"
+            "                  pareto:<min>:<alpha>\n"
+            "  -e <ratio>      Probability to answer an error (default 0)\n"
+            "  -x <ratio>      Probability to drop the connection (default 0)\n"
+            "  -V <ms>         Change the resultsets content every <ms> (default never)\n"
+            "  -v              Log the queries\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    const char* bindaddr = "127.0.0.1";
+    const char* port = "3307";
+    int opt;
+
+    while (-1 != (opt = getopt(argc, argv, "b:p:r:c:w:d:e:x:V:v"))) {
+        switch (opt) {
+            case 'b': bindaddr = optarg; break;
+            case 'p': port = optarg; break;
+            case 'r': mockDefaults.rows = strtoul(optarg, NULL, 10); break;
+            case 'c': mockDefaults.cols = strtoul(optarg, NULL, 10); break;
+            case 'w': mockDefaults.width = strtoul(optarg, NULL, 10); break;
+            case 'd': if (mockDelayParse(optarg, &mockDefaults.delay)) mockUsage(argv[0]); break;
+            case 'e': mockDefaults.error = atof(optarg); break;
+            case 'x': mockDefaults.drop = atof(optarg); break;
+            case 'V': mockChangePeriod = atol(optarg); break;
+            case 'v': mockVerbose = 1; break;
+            default: mockUsage(argv[0]);
+        }
+    }
+    if (0 == mockDefaults.cols) mockUsage(argv[0]);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(bindaddr, port, &hints, &res)) {
+        fprintf(stderr, "Cannot resolve %s:%s\n", bindaddr, port);
+        return 1;
+    }
+    int lfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    int yes = 1;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if ((lfd < 0)||(bind(lfd, res->ai_addr, res->ai_addrlen))||(listen(lfd, 511))) {
+        perror("listen");
+        return 1;
+    }
+    freeaddrinfo(res);
+    fprintf(stderr, "Mock MySQL server listening on %s:%s\n", bindaddr, port);
+
+    while (1) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+            if (EINTR == errno) continue;
+            perror("accept");
+            return 1;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+        MockConn* conn = calloc(1, sizeof(MockConn));
+        conn->fd = fd;
+        pthread_mutex_init(&conn->lock, NULL);
+        pthread_cond_init(&conn->cond, NULL);
+        pthread_mutex_lock(&mockConnsLock);
+        conn->id = mockNextId++;
+        conn->next = mockConns;
+        mockConns = conn;
+        pthread_mutex_unlock(&mockConnsLock);
+        conn->rng = (0x9E3779B97F4A7C15ULL * conn->id) ^ (uint64_t)time(NULL);
+
+        pthread_t tid;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&tid, &attr, mockConnThread, conn)) {
+            mockUnregister(conn);
+            close(fd);
+            free(conn);
+        }
+        pthread_attr_destroy(&attr);
+    }
+    return 0;
+}
@@ -4,21 +4,8 @@
 ///       @author  François Cerbelle (Fanfan), francois@cerbelle.net
 ///    @copyright  Copyright (c) 2017, François Cerbelle
 ///
-/// @todo Refactor SCacheGetMeta_RedisCommand and SCacheGetValue_RedisCommand
-/// @todo Store values in internal data structure
-/// @todo TTL management : Create a regular redis key with TTL for value expiration,
-/// subscribe to notifications in a background thread to delete values from internal
-/// structure
-/// @todo TTL management : Create a sorted set with TTL converted in absolute timestamp
-/// as scores to achive a lazy expiration on values (check at read, and eventually
-/// background thread checking periodically)
-/// @todo Store connection details in Hash for persistence and replication, but keep
-/// connection handler in an internal data structure per shard
 /// @todo Return resultsets as complex values { {Metas} {Record1Values, Record2Values, Record3Values} }
-/// @todo DB abstraction layer with dynamically loadable modules (dl)
-/// @todo Cluster awareness (CE/EE)
 /// @todo Add Log entries for DEBUG, INFO, NOTICE levels
-/// @todo: use a connection pool
 ///
 /// @todo 
 /// @bug 
@@ -43,29 +30,4139 @@
 ///  GNU General Public License as published by the Free Software Foundation.
 ///
 
+#define _GNU_SOURCE
 #define REDISMODULE_EXPERIMENTAL_API
 #include "../redismodule.h"
-#include <mysql/mysql.h>
+#include "scbackend.h"
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
 #include <pthread.h>
+#include <dlfcn.h>
+#include <limits.h>
+
+// Placement of the resultset keys of a cache in cluster mode
+typedef enum {
+    SCACHE_LAYOUT_SPREAD = 0,   // Each query in its own slot, across all shards
+    SCACHE_LAYOUT_HASHTAG       // The whole cache in the slot of its name
+} SCacheLayout;
+
+// Miss routing between the primary and the read replicas of a cache
+typedef enum {
+    SCACHE_ROUTING_LEASTCONN = 0,   // Fewest batches in flight
+    SCACHE_ROUTING_EWMA             // Lowest latency average, times load
+} SCacheRouting;
+
+// A database server of a cache : the primary, or one of its read replicas.
+// Protected by the cache lock.
+typedef struct SCacheNode_s {
+    char* host;
+    uint16_t port;
+    void** idle;                // Connections not in use
+    uint16_t nidle;
+    uint16_t opened;            // Connections open or being opened, poolsize at most
+    uint32_t outstanding;       // Batches in flight
+    uint64_t ewma;              // Moving average of the round trip time (µs)
+    uint32_t failures;          // Consecutive connection failures
+    long long ejected;          // Not routed until then (ms) once ejected
+    long long ejectdelay;       // Next ejection duration (ms)
+    uint64_t hedges;            // Hedged batches sent to the node
+} SCacheNode;
+
+#define SCACHE_HEDGE_SAMPLES 256    // Batch latencies the hedge delay is computed on
+#define SCACHE_HEDGE_BURST 10       // Hedges the budget can accumulate
+
+// A generation of the resultsets of a cache, shared by the cache and its
+// entries. Flushing or deleting the cache ends it, its entries are then misses
+// and swept. The entries may be freed by the lazyfree thread.
+typedef struct SCacheGeneration_s {
+    uint64_t id;
+    int live;                   // Main thread only
+    uint32_t refcount;          // Atomic
+} SCacheGeneration;
 
 typedef struct CacheDetails_s {
     char* cachename;
     uint16_t ttl;
+    uint16_t ttlmin;            // Adaptive TTL bounds, equal to ttl when fixed
+    uint16_t ttlmax;
     char* dbhost;
     uint16_t dbport;
     char* dbname;
     char* dbuser;
     char* dbpass;
-    MYSQL* dbhandle;
+    const SCacheBackend* backend;
+    void* dbhandle;             // Control connection, set under lock
+    uint16_t poolsize;          // Connections per node
+    char* replicas;             // host:port,... read replicas, NULL if none
+    SCacheRouting routing;
+    uint16_t nnodes;            // The primary first, then the replicas
+    SCacheNode* nodes;
+    uint16_t nfetchers;         // poolsize per node
+    uint8_t hedge;              // Latency percentile delaying the hedges, 0 if none
+    uint8_t hedgebudget;        // Hedges per 100 batches at most
+    uint64_t hedgedelay;        // Current hedge delay (µs), 0 until computed
+    uint32_t hedgetokens;       // Hedge budget, 100 per hedge
+    uint64_t latencies[SCACHE_HEDGE_SAMPLES];  // Last batch latencies (µs)
+    uint64_t nlatencies;
+    struct SCacheFlight_s* flights; // Batches in flight which may be hedged
+    uint32_t maxpending;        // Misses queued or in flight at most, 0 for unlimited
+    uint32_t pending;           // Misses queued or in flight
+    uint16_t stale;             // Seconds an expired resultset is served when its miss is shed
+    uint16_t breaker;           // Consecutive failed batches opening the circuit, 0 if none
+    uint32_t failures;          // Consecutive failed batches
+    long long breakeropen;      // Circuit open until then (ms), 0 when closed
+    int probing;                // Half open circuit, a probe miss is in flight
+    uint32_t timeout;           // Misses deadline (ms), 0 if none
+    uint16_t grace;             // Seconds an expired resultset is served while it is refilled
+    uint8_t refresh;            // Percent of the TTL before expiration a hit refills, 0 if none
+    int subsume;                // Misses answered from the cached supersets of their query
+    char* incremental;          // Column growing with the rows, refilled beyond its watermark, NULL if none
+    char* rowkey;               // Column identifying the rows replaced by the incremental refills, NULL if none
+    RedisModuleDict* supersets; // Superset queries by table, main thread only
+    struct SCacheMirror_s* mirrors; // Mirrored tables, main thread only
+    pthread_t* fetchers;
+    pthread_mutex_t lock;       // Protects the fetch queue
+    pthread_cond_t wakeup;
+    struct FetchJob_s* queuehead;
+    struct FetchJob_s* queuetail;
+    uint32_t queued;            // Number of jobs in the fetch queue
+    uint16_t batchsize;         // Maximum misses per multi-statement round trip
+    uint32_t batchwait;         // Microseconds to wait for a batch to fill
+    int persist;                // Resultsets saved in RDB
+    uint64_t generation;        // Of its resultsets, the older ones are flushed
+    SCacheGeneration* current;  // Of the generation id, NULL once dropped
+    SCacheLayout layout;
+    uint16_t slot;              // Slot of the cache name, for hashtag caches
+    int stopping;
+    int refcount;               // Main thread only
     struct CacheDetails_s* next;
 } CacheDetails;
 
+
 CacheDetails* CacheList = NULL;
+uint64_t Generation = 0;        // Last generation given to a cache, main thread only
+RedisModuleDict* Generations = NULL; // Live generations by id, to load the RDB entries
+uint16_t DefaultPoolSize = 4;   // Connections per cache without POOLSIZE
+uint16_t DefaultBatchSize = 1;  // Misses per round trip without BATCHSIZE
+uint32_t DefaultBatchWait = 0;  // Batch fill wait (µs) without BATCHWAIT
+uint32_t ConnectTimeout = 1000; // Database connection timeout (ms)
+#define SCACHE_MAX_BATCH 256
+#define SCACHE_RECONNECT_DELAY 1000 // Milliseconds between reconnection attempts
+#define SCACHE_MAX_NODES 16         // Primary and replicas
+#define SCACHE_EJECT_FAILURES 3     // Consecutive failures ejecting a node
+#define SCACHE_EJECT_MAX 30000      // Maximum ejection duration (ms)
+#define SCACHE_BREAKER_DELAY 1000   // Open circuit duration before a probe (ms)
+#define SCACHE_TIMEOUT_ERROR "TIMEOUT the database did not answer in time"
+#define SCACHE_DELETED_ERROR "ERR the cache was deleted"
+
+// Starts a live generation. Main thread only.
+SCacheGeneration* SCacheGenerationNew(uint64_t id) {
+    SCacheGeneration* generation = RedisModule_Calloc(1, sizeof(SCacheGeneration));
+    generation->id = id;
+    generation->live = 1;
+    generation->refcount = 1;
+    if (NULL == Generations)
+        Generations = RedisModule_CreateDict(NULL);
+    RedisModule_DictReplaceC(Generations, &generation->id, sizeof(generation->id), generation);
+    return generation;
+}
+
+SCacheGeneration* SCacheGenerationRetain(SCacheGeneration* generation) {
+    if (generation) __atomic_add_fetch(&generation->refcount, 1, __ATOMIC_RELAXED);
+    return generation;
+}
+
+void SCacheGenerationRelease(SCacheGeneration* generation) {
+    if ((generation)&&(0 == __atomic_sub_fetch(&generation->refcount, 1, __ATOMIC_ACQ_REL)))
+        RedisModule_Free(generation);
+}
+
+// Ends a generation and releases the reference of its cache. Main thread only.
+void SCacheGenerationEnd(SCacheGeneration* generation) {
+    if (NULL == generation) return;
+    generation->live = 0;
+    RedisModule_DictDelC(Generations, &generation->id, sizeof(generation->id), NULL);
+    SCacheGenerationRelease(generation);
+}
+
+// Database backends, loaded on demand from BackendDir/scbackend_<name>.so
+typedef struct BackendDetails_s {
+    char* name;
+    void* dlhandle;
+    const SCacheBackend* backend;
+    struct BackendDetails_s* next;
+} BackendDetails;
+
+BackendDetails* BackendList = NULL;
+char* BackendDir = NULL;
+
+// Returns a backend by name, loading it if needed. Fills err on failure.
+// Has to be called from the main thread.
+const SCacheBackend* SCacheBackendGet(const char* name, char* err, size_t errlen) {
+    BackendDetails* cur = BackendList;
+    while ((cur)&&(strcmp(name,cur->name)))
+        cur=cur->next;
+    if (cur) return cur->backend;
+
+    // Backend names are file name parts, not paths
+    if ((strchr(name,'/'))||(strchr(name,'.'))) {
+        snprintf(err, errlen, "ERR invalid backend name");
+        return NULL;
+    }
+
+    size_t pathlen = strlen(BackendDir)+strlen(name)+32;
+    char* path = RedisModule_Alloc(pathlen);
+    snprintf(path, pathlen, "%s/scbackend_%s.so", BackendDir, name);
+    void* dlhandle = dlopen(path, RTLD_NOW|RTLD_LOCAL);
+    RedisModule_Free(path);
+    if (NULL == dlhandle) {
+        snprintf(err, errlen, "ERR cannot load backend: %s", dlerror());
+        return NULL;
+    }
+
+    SCacheBackendEntryFunc entry;
+    *(void**)&entry = dlsym(dlhandle, SCACHE_BACKEND_ENTRY);
+    const SCacheBackend* backend = entry ? entry() : NULL;
+    if ((NULL == backend)||(SCACHE_BACKEND_APIVER != backend->apiver)||(backend->init())) {
+        snprintf(err, errlen, "ERR incompatible or failing backend %s", name);
+        dlclose(dlhandle);
+        return NULL;
+    }
+
+    cur = RedisModule_Alloc(sizeof(BackendDetails));
+    cur->name = RedisModule_Strdup(name);
+    cur->dlhandle = dlhandle;
+    cur->backend = backend;
+    cur->next = BackendList;
+    BackendList = cur;
+    return backend;
+}
+
+// Returns a monotonic timestamp in microseconds, used to measure DB time
+uint64_t SCacheUsTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+// Per-fingerprint statistics, kept in a bounded table (see scache.slowlog)
+typedef struct SlowlogEntry_s {
+    uint64_t fingerprint;
+    char* cachename;
+    char* query;            // Normalized query text
+    uint64_t calls;
+    uint64_t misses;
+    uint64_t dbtime;        // Cumulative DB time in microseconds
+    uint64_t maxdbtime;     // Max DB time of a single fill in microseconds
+    uint64_t rows;
+    uint64_t bytes;
+} SlowlogEntry;
+
+RedisModuleDict* SlowlogDict = NULL;
+uint32_t SlowlogMaxLen = 128;
+uint64_t SlowlogEvictions = 0;
+#define SCACHE_SLOWLOG_STACK 512    // Queries normalized on the stack up to this length
+#define SCACHE_SLOWLOG_SAMPLES 5    // Entries sampled to pick an eviction victim
+
+// Normalizes a query into its fingerprint text : literals (numbers and quoted
+// strings) are replaced by '?', whitespaces are collapsed and keywords are
+// lowercased. dst has to be at least len+1 bytes long. Returns the length.
+size_t SCacheNormalizeQuery(const char* query, size_t len, char* dst) {
+    size_t i=0, j=0;
+    int space=0;
+    while (i<len) {
+        char c=query[i];
+        if (isspace((unsigned char)c)) {
+            space=1;
+            i++;
+            continue;
+        }
+        if ((space)&&(j>0)) dst[j++]=' ';
+        space=0;
+        if (('\'' == c)||('"' == c)) {
+            // Quoted string literal, with backslash or doubled quote escaping
+            i++;
+            while (i<len) {
+                if (('\\' == query[i])&&(i+1<len)) {
+                    i+=2;
+                } else if (c == query[i]) {
+                    if ((i+1<len)&&(c == query[i+1])) {
+                        i+=2;
+                    } else {
+                        i++;
+                        break;
+                    }
+                } else
+                    i++;
+            }
+            dst[j++]='?';
+        } else if ('`' == c) {
+            // Quoted identifier, kept verbatim
+            dst[j++]=query[i++];
+            while ((i<len)&&('`' != query[i])) dst[j++]=query[i++];
+            if (i<len) dst[j++]=query[i++];
+        } else if ((isdigit((unsigned char)c))&&
+                ((0==j)||!(isalnum((unsigned char)dst[j-1])||('_'==dst[j-1])||('$'==dst[j-1])))) {
+            // Numeric literal (not part of an identifier)
+            while ((i<len)&&(isalnum((unsigned char)query[i])||('.'==query[i]))) i++;
+            dst[j++]='?';
+        } else {
+            dst[j++]=tolower((unsigned char)c);
+            i++;
+        }
+    }
+    // Strip the trailing statement separators
+    while ((j>0)&&((';'==dst[j-1])||(' '==dst[j-1]))) j--;
+    dst[j]=0;
+    return j;
+}
+
+// Computes the 64 bits FNV-1a fingerprint of a cache name and a normalized query
+uint64_t SCacheFingerprint(const char* cachename, const char* normalized, size_t len) {
+    uint64_t h=14695981039346656037ULL;
+    while (*cachename) {
+        h^=(unsigned char)*cachename++;
+        h*=1099511628211ULL;
+    }
+    // Separator between the cache name and the query
+    h*=1099511628211ULL;
+    for (size_t i=0; i<len; i++) {
+        h^=(unsigned char)normalized[i];
+        h*=1099511628211ULL;
+    }
+    return h;
+}
+
+void SCacheSlowlogFreeEntry(SlowlogEntry* entry) {
+    RedisModule_Free(entry->cachename);
+    RedisModule_Free(entry->query);
+    RedisModule_Free(entry);
+}
+
+// Evicts a slowlog entry to make room for a new one : the entry with the
+// lowest cumulative DB time among a few sampled ones, so that the cost does
+// not grow with the table. The fingerprints are hashes, the entries following
+// a scrambled seek key are a random sample.
+void SCacheSlowlogEvict() {
+    uint64_t seek = SlowlogEvictions++ * 0x9E3779B97F4A7C15ULL;
+    SlowlogEntry* victim = NULL;
+    SlowlogEntry* cur;
+    RedisModuleDictIter* iter = RedisModule_DictIteratorStartC(SlowlogDict, ">=", &seek, sizeof(seek));
+    for (int i = 0; i < SCACHE_SLOWLOG_SAMPLES; i++) {
+        if (!RedisModule_DictNextC(iter, NULL, (void**)&cur)) {
+            // Wrap around to the first entry
+            RedisModule_DictIteratorReseekC(iter, "^", NULL, 0);
+            if (!RedisModule_DictNextC(iter, NULL, (void**)&cur))
+                break;
+        }
+        if ((NULL == victim)||(cur->dbtime < victim->dbtime))
+            victim = cur;
+    }
+    RedisModule_DictIteratorStop(iter);
+    if (victim) {
+        RedisModule_DictDelC(SlowlogDict, &victim->fingerprint, sizeof(victim->fingerprint), NULL);
+        SCacheSlowlogFreeEntry(victim);
+    }
+}
+
+// Finds (or creates) the slowlog entry of a normalized query, which is only
+// copied for a new entry. Entries are only created by the misses, once their
+// DB time is known, so that an eviction never picks a fill in flight.
+SlowlogEntry* SCacheSlowlogEntry(const char* cachename, uint64_t fingerprint, const char* normalized, size_t nlen) {
+    int nokey;
+    SlowlogEntry* entry = RedisModule_DictGetC(SlowlogDict, &fingerprint, sizeof(fingerprint), &nokey);
+    if (!nokey)
+        return entry;
+
+    if (RedisModule_DictSize(SlowlogDict) >= SlowlogMaxLen)
+        SCacheSlowlogEvict();
+
+    entry = RedisModule_Calloc(1, sizeof(SlowlogEntry));
+    entry->fingerprint = fingerprint;
+    entry->cachename = RedisModule_Strdup(cachename);
+    entry->query = RedisModule_Alloc(nlen+1);
+    memcpy(entry->query, normalized, nlen+1);
+    RedisModule_DictSetC(SlowlogDict, &entry->fingerprint, sizeof(entry->fingerprint), entry);
+    return entry;
+}
+
+// Finds (or creates) the slowlog entry of a query, normalized on the stack
+SlowlogEntry* SCacheSlowlogGet(const char* cachename, const char* query, size_t len) {
+    char stack[SCACHE_SLOWLOG_STACK];
+    char* normalized = (len < sizeof(stack)) ? stack : RedisModule_Alloc(len+1);
+    size_t nlen = SCacheNormalizeQuery(query, len, normalized);
+    SlowlogEntry* entry = SCacheSlowlogEntry(cachename, SCacheFingerprint(cachename, normalized, nlen),
+            normalized, nlen);
+    if (normalized != stack) RedisModule_Free(normalized);
+    return entry;
+}
+
+// Accounts a cache miss and the cost of the underlying DB fill
+void SCacheSlowlogMiss(const char* cachename, const char* query, size_t len,
+        uint64_t dbtime, uint64_t rows, uint64_t bytes) {
+    if (0 == SlowlogMaxLen) return;
+    SlowlogEntry* entry = SCacheSlowlogGet(cachename, query, len);
+    entry->misses++;
+    // The calls made before the entry existed were not accounted
+    if (entry->calls < entry->misses) entry->calls = entry->misses;
+    entry->dbtime += dbtime;
+    if (dbtime > entry->maxdbtime) entry->maxdbtime = dbtime;
+    entry->rows += rows;
+    entry->bytes += bytes;
+}
+
+// Sorts slowlog entries by descending cumulative DB time
+int SCacheSlowlogCompare(const void* a, const void* b) {
+    const SlowlogEntry* ea = *(const SlowlogEntry**)a;
+    const SlowlogEntry* eb = *(const SlowlogEntry**)b;
+    if (ea->dbtime == eb->dbtime) return 0;
+    return (ea->dbtime < eb->dbtime) ? 1 : -1;
+}
+
+// Uncacheable queries : statements other than reads, locking reads, reads
+// into variables or files, and queries depending on the time, randomness,
+// the session or its variables. They are classified on their normalized
+// text, without literals, and the verdicts are memoized by fingerprint in a
+// small direct-mapped table : a repeated query costs its normalization only.
+// Their misses are fetched and replied, never cached.
+#define SCACHE_VERDICTS 1024        // Memoized verdicts, a power of 2
+
+typedef struct SCacheVerdict_s {
+    uint64_t fingerprint;
+    int known;
+    int uncacheable;
+} SCacheVerdict;
+
+SCacheVerdict Verdicts[SCACHE_VERDICTS];   // Main thread only
+
+// Returns true if a word of a normalized query is in a NULL terminated list
+int SCacheWordIn(const char* word, size_t len, const char** list) {
+    for (int i = 0; list[i]; i++)
+        if ((strlen(list[i]) == len)&&(!memcmp(word, list[i], len)))
+            return 1;
+    return 0;
+}
+
+// Returns true if a normalized query cannot be cached
+int SCacheUncacheable(const char* normalized, size_t len) {
+    static const char* reads[] = {
+        "select", "with", "show", "describe", "desc", "explain", "values", "table", NULL
+    };
+    // Called as functions, or bare for the SQL standard ones
+    static const char* volatiles[] = {
+        "now", "sysdate", "curdate", "curtime", "utc_date", "utc_time", "utc_timestamp",
+        "unix_timestamp", "rand", "random", "randomblob", "uuid", "uuid_short",
+        "connection_id", "last_insert_id", "last_insert_rowid", "changes", "total_changes",
+        "found_rows", "row_count", "user", "session_user", "system_user", "database",
+        "schema", "sleep", "benchmark", "get_lock", "release_lock", "release_all_locks",
+        "is_free_lock", "is_used_lock", "nextval", "lastval", "setval", "load_file", NULL
+    };
+    static const char* bare[] = {
+        "current_timestamp", "current_date", "current_time", "localtime",
+        "localtimestamp", "current_user", "current_role", NULL
+    };
+    const char* p = normalized;
+    const char* end = normalized+len;
+    const char* prev = NULL;            // Previous word
+    size_t prevlen = 0;
+    int first = 1;
+    while (p < end) {
+        char c = *p;
+        // Quoted identifiers are kept verbatim, the literals are gone : a
+        // variable or a separator left are outside of any quotes
+        if ('`' == c) {
+            const char* close = memchr(p+1, '`', end-p-1);
+            p = close ? close+1 : end;
+            continue;
+        }
+        if (('@' == c)||(';' == c))
+            return 1;
+        if ((!isalnum((unsigned char)c))&&('_' != c)&&('$' != c)) {
+            p++;
+            continue;
+        }
+        const char* word = p;
+        while ((p < end)&&((isalnum((unsigned char)*p))||('_' == *p)||('$' == *p)))
+            p++;
+        size_t wordlen = p-word;
+        if (first) {
+            if (!SCacheWordIn(word, wordlen, reads))
+                return 1;
+            first = 0;
+        }
+        const char* next = ((p < end)&&(' ' == *p)) ? p+1 : p;
+        int call = (next < end)&&('(' == *next)&&((word == normalized)||('.' != word[-1]));
+        if (((call)&&(SCacheWordIn(word, wordlen, volatiles)))||(SCacheWordIn(word, wordlen, bare)))
+            return 1;
+        // SELECT ... INTO, FOR UPDATE, FOR SHARE, LOCK IN SHARE MODE
+        if ((4 == wordlen)&&(!memcmp(word, "into", 4)))
+            return 1;
+        if ((prev)&&(3 == prevlen)&&(!memcmp(prev, "for", 3))&&
+                (((6 == wordlen)&&(!memcmp(word, "update", 6)))||((5 == wordlen)&&(!memcmp(word, "share", 5)))))
+            return 1;
+        if ((prev)&&(4 == prevlen)&&(!memcmp(prev, "lock", 4))&&(2 == wordlen)&&(!memcmp(word, "in", 2)))
+            return 1;
+        prev = word;
+        prevlen = wordlen;
+    }
+    return first;
+}
+
+// Accounts a cache call (hit or miss) in the slowlog entry of its query, if
+// it is tracked already, and returns true if the query cannot be cached. The
+// query is normalized once for both.
+int SCacheQueryCall(const char* cachename, const char* query, size_t len) {
+    char stack[SCACHE_SLOWLOG_STACK];
+    char* normalized = (len < sizeof(stack)) ? stack : RedisModule_Alloc(len+1);
+    size_t nlen = SCacheNormalizeQuery(query, len, normalized);
+    uint64_t fingerprint = SCacheFingerprint(cachename, normalized, nlen);
+    if (SlowlogMaxLen) {
+        SlowlogEntry* entry = RedisModule_DictGetC(SlowlogDict, &fingerprint, sizeof(fingerprint), NULL);
+        if (entry) entry->calls++;
+    }
+    SCacheVerdict* verdict = &Verdicts[fingerprint & (SCACHE_VERDICTS-1)];
+    if ((!verdict->known)||(verdict->fingerprint != fingerprint)) {
+        verdict->fingerprint = fingerprint;
+        verdict->uncacheable = SCacheUncacheable(normalized, nlen);
+        verdict->known = 1;
+    }
+    if (normalized != stack) RedisModule_Free(normalized);
+    return verdict->uncacheable;
+}
+
+// Stages of the miss path measured by the sampled tracing (see scache.trace)
+typedef enum {
+    SCACHE_STAGE_LOOKUP = 0,    // Cache lookup
+    SCACHE_STAGE_QUEUE,         // Wait for a fetcher thread
+    SCACHE_STAGE_QUERY,         // Backend query (mysql_query)
+    SCACHE_STAGE_STORE,         // Backend store_result (mysql_store_result)
+    SCACHE_STAGE_ENCODE,        // Row and meta encoding
+    SCACHE_STAGE_UNBLOCK,       // Wait for the main thread to resume the client
+    SCACHE_STAGE_INSERT,        // Insertion in the keyspace
+    SCACHE_STAGE_REPLY,         // Reply generation
+    SCACHE_STAGES
+} SCacheStage;
+
+const char* SCacheStageNames[SCACHE_STAGES] = {
+    "lookup", "queue", "query", "store", "encode", "unblock", "insert", "reply"
+};
+
+// Per stage latency histogram, with power of two microseconds buckets
+#define SCACHE_HIST_BUCKETS 32
+typedef struct StageHistogram_s {
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+    uint64_t buckets[SCACHE_HIST_BUCKETS];
+} StageHistogram;
+
+// Timings of one traced request, in microseconds
+typedef struct SCacheTrace_s {
+    uint64_t start;
+    uint64_t mark;
+    uint64_t stages[SCACHE_STAGES];
+} SCacheTrace;
+
+// Full trace kept in the ring of the last traced requests
+typedef struct TraceRecord_s {
+    char* cachename;
+    char* query;
+    long long timestamp;    // Unix time in milliseconds
+    uint64_t total;
+    uint64_t stages[SCACHE_STAGES];
+} TraceRecord;
+
+uint32_t TraceSampleRate = 0;   // Trace one miss every n, 0 disables tracing
+uint32_t TraceMaxLen = 32;
+uint64_t TraceSampleCounter = 0;
+StageHistogram TraceHistograms[SCACHE_STAGES];
+TraceRecord* TraceRing = NULL;
+uint32_t TraceRingNext = 0;
+
+// Decides if a miss is sampled. Returns the trace to fill or NULL. start is the
+// timestamp taken when the command began.
+SCacheTrace* SCacheTraceStart(SCacheTrace* trace, uint64_t start) {
+    if ((0 == TraceSampleRate)||(0 != (TraceSampleCounter++ % TraceSampleRate)))
+        return NULL;
+    memset(trace, 0, sizeof(SCacheTrace));
+    trace->start = start;
+    trace->mark = start;
+    return trace;
+}
+
+// Accounts the time elapsed since the previous mark to a stage
+void SCacheTraceStage(SCacheTrace* trace, SCacheStage stage) {
+    if (NULL == trace) return;
+    uint64_t now = SCacheUsTime();
+    trace->stages[stage] += now - trace->mark;
+    trace->mark = now;
+}
+
+void SCacheHistogramAdd(StageHistogram* hist, uint64_t value) {
+    unsigned int bucket = 0;
+    while ((bucket < SCACHE_HIST_BUCKETS-1)&&(value >> bucket))
+        bucket++;
+    hist->count++;
+    hist->total += value;
+    if (value > hist->max) hist->max = value;
+    hist->buckets[bucket]++;
+}
+
+// Returns the upper bound of the bucket holding the given percentile
+uint64_t SCacheHistogramPercentile(StageHistogram* hist, double percentile) {
+    if (0 == hist->count) return 0;
+    uint64_t rank = (uint64_t)(hist->count * percentile / 100.0);
+    uint64_t seen = 0;
+    for (unsigned int bucket = 0; bucket < SCACHE_HIST_BUCKETS; bucket++) {
+        seen += hist->buckets[bucket];
+        if (seen > rank)
+            return (bucket == 0) ? 0 : ((uint64_t)1 << bucket) - 1;
+    }
+    return hist->max;
+}
+
+void SCacheTraceFreeRecord(TraceRecord* record) {
+    RedisModule_Free(record->cachename);
+    RedisModule_Free(record->query);
+    record->cachename = NULL;
+    record->query = NULL;
+}
+
+// Feeds the histograms and the ring of last traces with a completed trace
+void SCacheTraceEnd(SCacheTrace* trace, const char* cachename, const char* query, size_t len) {
+    if (NULL == trace) return;
+    for (int stage = 0; stage < SCACHE_STAGES; stage++)
+        SCacheHistogramAdd(&TraceHistograms[stage], trace->stages[stage]);
+    if (0 == TraceMaxLen) return;
+
+    TraceRecord* record = &TraceRing[TraceRingNext];
+    TraceRingNext = (TraceRingNext + 1) % TraceMaxLen;
+    if (record->cachename) SCacheTraceFreeRecord(record);
+    record->cachename = RedisModule_Strdup(cachename);
+    record->query = RedisModule_Alloc(len+1);
+    memcpy(record->query, query, len);
+    record->query[len] = 0;
+    record->timestamp = RedisModule_Milliseconds();
+    record->total = trace->mark - trace->start;
+    memcpy(record->stages, trace->stages, sizeof(record->stages));
+}
+
+// Resultset fetched from the database, encoded the way it is stored in the
+// cache. Built by the fetcher threads, only RedisModule_Alloc is used. It is
+// moved as is in the keyspace, as the value of a SCacheEntryType key.
+typedef struct SCacheBuffer_s {
+    char* ptr;
+    size_t len;
+} SCacheBuffer;
+
+typedef struct SCacheResultset_s {
+    char* error;                // Backend error message, NULL on success
+    uint32_t nmeta;
+    SCacheBuffer* meta;         // name|type
+    uint64_t nrows;
+    SCacheBuffer* rows;         // Pipe-separated column values
+    char* arena;                // Meta then rows, NUL terminated, in reply order
+    int hit;                    // Copied from the cache, nothing to store
+    int persist;                // Saved in RDB with its values
+    int husk;                   // Loaded from RDB without values, a miss
+    long long expire;           // Absolute expiration time, unix milliseconds
+    long long ttl;              // Milliseconds, adapted at each refill
+    long long evict;            // Deleted from the keyspace at this time, unix milliseconds
+    int refreshing;             // A background refill is queued
+    char* watermark;            // Highest value of the INCREMENTAL column, NULL until refilled
+    uint32_t deltas;            // Incremental refills since the last full fill
+    SCacheGeneration* generation; // Of its cache when filled, a miss once it ends
+    uint64_t checksum;          // Of the values, to detect the changes
+    uint64_t dbtime;
+    uint64_t bytes;
+} SCacheResultset;
+
+// Module datatype of the cached resultsets
+RedisModuleType* SCacheEntryType = NULL;
+#define SCACHE_ENTRY_ENCVER 0
+
+typedef enum {
+    SCACHE_REPLY_VALUE = 0,
+    SCACHE_REPLY_META
+} SCacheReplyKind;
+
+// One query of a blocked scache.getvalue/getmeta/mget client
+typedef struct FetchJob_s {
+    struct FetchRequest_s* request;
+    char* query;
+    size_t len;
+    char* merge;                // Query of the entry an incremental refill is merged in, NULL otherwise
+    size_t mergelen;
+    char* watermark;            // Of the entry when the incremental refill was queued
+    int bypass;                 // Uncacheable query, replied without being cached
+    SCacheResultset* result;
+    SCacheTrace tracebuf;
+    SCacheTrace* trace;
+    struct FetchJob_s* next;    // Next job in the cache fetch queue
+} FetchJob;
+
+// Blocked client waiting for its missing resultsets, or cache warming fill
+typedef struct FetchRequest_s {
+    RedisModuleBlockedClient* bc;
+    CacheDetails* cache;
+    SCacheReplyKind kind;
+    int multi;                  // Replies with an array of resultsets (scache.mget)
+    int count;
+    int pending;                // Jobs not fetched yet, protected by cache->lock
+    long long deadline;         // Client timeout (ms), 0 if none
+    int db;                     // Database of a background refill, without bc nor warm
+    uint64_t generation;        // Of the cache when queued, the fills of a flushed one are dropped
+    struct WarmTask_s* warm;    // Warming this fill belongs to, instead of bc
+    struct FetchRequest_s* next;    // Next completed fill of the warming
+    FetchJob jobs[];
+} FetchRequest;
+
+// Cache warming, run by a background thread feeding the fetch queue
+typedef struct WarmTask_s {
+    CacheDetails* cache;
+    RedisModuleBlockedClient* bc;   // NULL when started from the warm file
+    RedisModuleCtx* ctx;        // Thread safe context to insert the fills
+    SCacheBuffer* queries;
+    size_t count;
+    char* driver;               // Driving query producing the parameter sets
+    char* template;             // Query with $1..$9 replaced by the driver columns
+    uint32_t rate;              // Maximum fills per second, 0 for unlimited
+    char* error;
+    uint64_t filled;
+    uint64_t errors;
+    pthread_mutex_t lock;       // Protects outstanding and done
+    pthread_cond_t wakeup;
+    uint32_t outstanding;       // Fills queued and not completed yet
+    FetchRequest* done;         // Completed fills, to insert in the keyspace
+} WarmTask;
+
+// The meta and the rows of a resultset are packed in a single arena, in reply
+// order : a hit walks one contiguous block, a copy or a free is a single
+// allocation whatever the number of rows.
+
+// Returns len more bytes at the end of the arena of a resultset being built,
+// valid until the next call. The buffers are linked by SCacheArenaFinish.
+char* SCacheArenaGrow(SCacheResultset* result, size_t* capacity, size_t* size, size_t len) {
+    if (*size + len > *capacity) {
+        *capacity = (*capacity ? *capacity*2 : 256);
+        if (*capacity < *size + len) *capacity = *size + len;
+        result->arena = RedisModule_Realloc(result->arena, *capacity);
+    }
+    char* p = result->arena + *size;
+    *size += len;
+    return p;
+}
+
+// Points the meta and row buffers in the arena, from their lengths
+void SCacheArenaLink(SCacheResultset* result) {
+    char* p = result->arena;
+    for (uint32_t i = 0; i < result->nmeta; i++) {
+        result->meta[i].ptr = p;
+        p += result->meta[i].len+1;
+    }
+    for (uint64_t i = 0; i < result->nrows; i++) {
+        result->rows[i].ptr = p;
+        p += result->rows[i].len+1;
+    }
+}
+
+// Trims the arena of a built resultset, and links its buffers
+void SCacheArenaFinish(SCacheResultset* result, size_t size) {
+    result->arena = RedisModule_Realloc(result->arena, size ? size : 1);
+    SCacheArenaLink(result);
+}
+
+void SCacheResultsetFree(SCacheResultset* result) {
+    if (NULL == result) return;
+    RedisModule_Free(result->arena);
+    RedisModule_Free(result->meta);
+    RedisModule_Free(result->rows);
+    RedisModule_Free(result->error);
+    RedisModule_Free(result->watermark);
+    SCacheGenerationRelease(result->generation);
+    RedisModule_Free(result);
+}
+
+// Returns a resultset holding the last error of a connection
+SCacheResultset* SCacheResultsetError(const SCacheBackend* backend, void* conn) {
+    SCacheResultset* result = RedisModule_Calloc(1, sizeof(SCacheResultset));
+    const char* error = backend->error(conn);
+    result->error = RedisModule_Strdup(*error ? error : "ERR database error");
+    return result;
+}
+
+// Builds an error resultset from a module error message
+SCacheResultset* SCacheResultsetFailed(const char* error) {
+    SCacheResultset* result = RedisModule_Calloc(1, sizeof(SCacheResultset));
+    result->error = RedisModule_Strdup(error);
+    return result;
+}
+
+// FNV-1a hash of a buffer, chained from a previous hash
+uint64_t SCacheChecksum(uint64_t hash, const char* buf, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)buf[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Fetches and encodes the current resultset of a connection. start is the
+// timestamp the database began to work on it, to measure the DB time.
+SCacheResultset* SCacheResultsetEncode(const SCacheBackend* backend, void* conn,
+        uint64_t start, SCacheTrace* trace) {
+    void* res = backend->store_result(conn);
+    if (NULL == res)
+        return SCacheResultsetError(backend, conn);
+    SCacheResultset* result = RedisModule_Calloc(1, sizeof(SCacheResultset));
+    result->dbtime = SCacheUsTime() - start;
+    result->checksum = 0xcbf29ce484222325ULL;
+    SCacheTraceStage(trace, SCACHE_STAGE_STORE);
+
+    // Encode results meta as name|type
+    size_t size = 0;
+    size_t arenacapacity = 0;
+    unsigned int num_fields = backend->num_fields(res);
+    result->meta = RedisModule_Alloc(sizeof(SCacheBuffer)*(num_fields ? num_fields : 1));
+    for (unsigned int i = 0; i < num_fields; i++) {
+        const SCacheField* field = backend->fetch_field(res, i);
+        size_t namelen = strlen(field->name);
+        size_t typelen = strlen(field->type);
+        SCacheBuffer* meta = &result->meta[result->nmeta++];
+        meta->len = namelen+1+typelen;
+        char* p = SCacheArenaGrow(result, &arenacapacity, &size, meta->len+1);
+        memcpy(p, field->name, namelen);
+        p[namelen] = '|';
+        memcpy(p+namelen+1, field->type, typelen+1);
+        result->checksum = SCacheChecksum(result->checksum, p, meta->len+1);
+    }
+
+    // Encode result values as pipe-separated column values, NULL for SQL NULL
+    const char** row;
+    unsigned long *lengths;
+    uint64_t capacity = 0;
+    while (NULL != (row = backend->fetch_row(res, &lengths))) {
+        if (result->nrows == capacity) {
+            capacity = capacity ? capacity*2 : 16;
+            result->rows = RedisModule_Realloc(result->rows, sizeof(SCacheBuffer)*capacity);
+        }
+        size_t rowlen = 0;
+        for (unsigned int i = 0; i < num_fields; i++) {
+            rowlen += (row[i] ? lengths[i] : 4) + (i ? 1 : 0);
+            result->bytes += lengths[i];
+        }
+        SCacheBuffer* value = &result->rows[result->nrows++];
+        value->len = rowlen;
+        char* start = SCacheArenaGrow(result, &arenacapacity, &size, rowlen+1);
+        char* p = start;
+        for (unsigned int i = 0; i < num_fields; i++) {
+            if (i) *p++ = '|';
+            if (row[i]) {
+                memcpy(p, row[i], lengths[i]);
+                p += lengths[i];
+            } else {
+                memcpy(p, "NULL", 4);
+                p += 4;
+            }
+        }
+        *p = 0;
+        result->checksum = SCacheChecksum(result->checksum, start, value->len+1);
+    }
+    SCacheArenaFinish(result, size);
+    backend->free_result(res);
+    SCacheTraceStage(trace, SCACHE_STAGE_ENCODE);
+    return result;
+}
+
+// Discards the pending resultsets of a multi-statement query, so that the
+// connection is ready for the next query
+void SCacheResultsetDrain(const SCacheBackend* backend, void* conn) {
+    if (NULL == backend->next_result) return;
+    while (0 == backend->next_result(conn)) {
+        void* res = backend->store_result(conn);
+        if (res) backend->free_result(res);
+    }
+}
+
+// Runs a query on a connection and encodes its resultset. Thread safe as long
+// as the connection is only used by the calling thread.
+SCacheResultset* SCacheResultsetFetch(const SCacheBackend* backend, void* conn,
+        const char* query, size_t len, SCacheTrace* trace) {
+    uint64_t start = SCacheUsTime();
+    int state = backend->query(conn, query, len);
+    SCacheTraceStage(trace, SCACHE_STAGE_QUERY);
+    if (0 != state)
+        return SCacheResultsetError(backend, conn);
+    SCacheResultset* result = SCacheResultsetEncode(backend, conn, start, trace);
+    SCacheResultsetDrain(backend, conn);
+    return result;
+}
+
+// Copies a cached resultset, used by scache.mget to keep its hits while
+// waiting for its misses
+SCacheResultset* SCacheResultsetCopy(SCacheResultset* entry) {
+    SCacheResultset* result = RedisModule_Calloc(1, sizeof(SCacheResultset));
+    result->nmeta = entry->nmeta;
+    result->meta = RedisModule_Alloc(sizeof(SCacheBuffer)*(entry->nmeta ? entry->nmeta : 1));
+    if (entry->nmeta)
+        memcpy(result->meta, entry->meta, sizeof(SCacheBuffer)*entry->nmeta);
+    result->nrows = entry->nrows;
+    result->rows = RedisModule_Alloc(sizeof(SCacheBuffer)*(entry->nrows ? entry->nrows : 1));
+    if (entry->nrows)
+        memcpy(result->rows, entry->rows, sizeof(SCacheBuffer)*entry->nrows);
+    size_t size = 0;
+    if (entry->nrows)
+        size = entry->rows[entry->nrows-1].ptr + entry->rows[entry->nrows-1].len+1 - entry->arena;
+    else if (entry->nmeta)
+        size = entry->meta[entry->nmeta-1].ptr + entry->meta[entry->nmeta-1].len+1 - entry->arena;
+    result->arena = RedisModule_Alloc(size ? size : 1);
+    if (size)
+        memcpy(result->arena, entry->arena, size);
+    SCacheArenaLink(result);
+    result->hit = 1;
+    return result;
+}
+
+// In cluster mode, the commands declare the query (spread caches) or the cache
+// name (hashtag caches) as their key, and the resultset key is prefixed with a
+// short hash tag of the same slot, so that it lives on the node the command is
+// routed to and moves with its slot when resharding.
+#define SCACHE_CLUSTER_SLOTS 16384
+int ClusterMode = 0;
+char (*SlotTags)[6] = NULL;     // Shortest hash tag of each slot
+
+// CRC16 (XMODEM) used by Redis Cluster for key slots
+uint16_t SCacheCrc16(const char* buf, size_t len) {
+    uint16_t crc = 0;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= (uint16_t)(unsigned char)buf[i] << 8;
+        for (int j = 0; j < 8; j++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+// Returns the cluster slot of a key, honoring its {hash tag} like Redis does
+uint16_t SCacheKeySlot(const char* key, size_t len) {
+    const char* open = memchr(key, '{', len);
+    if (open) {
+        size_t start = open - key + 1;
+        const char* close = memchr(key+start, '}', len-start);
+        if ((close)&&(close != key+start))
+            return SCacheCrc16(key+start, close-key-start) & (SCACHE_CLUSTER_SLOTS-1);
+    }
+    return SCacheCrc16(key, len) & (SCACHE_CLUSTER_SLOTS-1);
+}
+
+// Finds a hash tag for each slot, trying the alphanumeric strings by length
+void SCacheSlotTagsInit(void) {
+    static const char alphabet[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+    const size_t base = sizeof(alphabet)-1;
+    SlotTags = RedisModule_Calloc(SCACHE_CLUSTER_SLOTS, sizeof(*SlotTags));
+    size_t missing = SCACHE_CLUSTER_SLOTS;
+    for (size_t taglen = 1; (missing)&&(taglen < sizeof(*SlotTags)); taglen++) {
+        size_t combinations = 1;
+        for (size_t i = 0; i < taglen; i++) combinations *= base;
+        for (size_t n = 0; (missing)&&(n < combinations); n++) {
+            char tag[sizeof(*SlotTags)];
+            for (size_t i = 0, v = n; i < taglen; i++, v /= base)
+                tag[i] = alphabet[v % base];
+            uint16_t slot = SCacheCrc16(tag, taglen) & (SCACHE_CLUSTER_SLOTS-1);
+            if (SlotTags[slot][0]) continue;
+            memcpy(SlotTags[slot], tag, taglen);
+            missing--;
+        }
+    }
+}
+
+// Writes a resultset key name cachename::query in buf, with the hash tag of
+// the slot of its declared key in cluster mode. Returns the key length, buf is
+// left untouched if it is larger than size.
+size_t SCacheKeyFormat(char* buf, size_t size, CacheDetails* cache, const char* query, size_t len) {
+    const char* tag = NULL;
+    size_t taglen = 0;
+    if (ClusterMode) {
+        tag = SlotTags[(SCACHE_LAYOUT_HASHTAG == cache->layout) ? cache->slot : SCacheKeySlot(query, len)];
+        taglen = strlen(tag)+2;
+    }
+    size_t namelen = strlen(cache->cachename);
+    size_t keylen = taglen+namelen+2+len;
+    if (keylen > size) return keylen;
+
+    char* p = buf;
+    if (tag) {
+        *p++ = '{';
+        memcpy(p, tag, taglen-2);
+        p += taglen-2;
+        *p++ = '}';
+    }
+    memcpy(p, cache->cachename, namelen);
+    p += namelen;
+    *p++ = ':';
+    *p++ = ':';
+    memcpy(p, query, len);
+    return keylen;
+}
+
+// Builds a resultset key, on the stack unless the query is long, so that the
+// key string is the only allocation
+#define SCACHE_KEY_STACK 512
+RedisModuleString* SCacheKey(RedisModuleCtx *ctx, CacheDetails* cache,
+        const char* query, size_t len) {
+    char stack[SCACHE_KEY_STACK];
+    size_t keylen = SCacheKeyFormat(stack, sizeof(stack), cache, query, len);
+    if (keylen <= sizeof(stack))
+        return RedisModule_CreateString(ctx, stack, keylen);
+    char* heap = RedisModule_Alloc(keylen);
+    SCacheKeyFormat(heap, keylen, cache, query, len);
+    RedisModuleString* key = RedisModule_CreateString(ctx, heap, keylen);
+    RedisModule_Free(heap);
+    return key;
+}
+
+// Opens the resultset key of a query for reading. The key keeps its own
+// reference to its name.
+RedisModuleKey* SCacheOpenEntry(RedisModuleCtx *ctx, CacheDetails* cache, const char* query, size_t len) {
+    RedisModuleString* keyname = SCacheKey(ctx, cache, query, len);
+    RedisModuleKey* key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ);
+    RedisModule_FreeString(ctx, keyname);
+    return key;
+}
+
+// Returns true if a resultset belongs to a cache which was not flushed since
+int SCacheGenerationLive(SCacheResultset* entry) {
+    return (entry->generation)&&(entry->generation->live);
+}
+
+// Returns the cached resultset of an open key, NULL if it is a miss. The
+// expiration is checked at read, the entries are evicted later. A hit in the
+// refresh window of its TTL, or expired for less than the grace delay of its
+// cache, sets refresh once : the caller refills it in the background.
+SCacheResultset* SCacheEntryGet(RedisModuleKey* key, CacheDetails* cache, int* refresh) {
+    *refresh = 0;
+    if (RedisModule_ModuleTypeGetType(key) != SCacheEntryType)
+        return NULL;
+    SCacheResultset* entry = RedisModule_ModuleTypeGetValue(key);
+    if ((entry->husk)||(entry->generation != cache->current))
+        return NULL;
+    long long left = entry->expire - RedisModule_Milliseconds();
+    if ((left <= 0)&&(left + (long long)cache->grace*1000 <= 0))
+        return NULL;
+    if ((!entry->refreshing)&&((left <= 0)||(left*100 < entry->ttl*cache->refresh))) {
+        entry->refreshing = 1;
+        *refresh = 1;
+    }
+    return entry;
+}
+
+// Returns the resultset of a key expired for less than the stale delay of its
+// cache, served when its miss is shed, or NULL
+SCacheResultset* SCacheEntryStale(RedisModuleKey* key, CacheDetails* cache) {
+    if (RedisModule_ModuleTypeGetType(key) != SCacheEntryType)
+        return NULL;
+    SCacheResultset* entry = RedisModule_ModuleTypeGetValue(key);
+    if ((entry->husk)||(entry->generation != cache->current)||
+            (entry->expire + (long long)cache->stale*1000 <= RedisModule_Milliseconds()))
+        return NULL;
+    return entry;
+}
+
+// Returns the TTL (ms) of a fill. The TTL of a query of an adaptive cache is
+// multiplied by 1.5 when its refill finds the same values as the previous
+// fill, and halved when they changed, within the cache bounds : stable
+// queries end up cached for ttlmax, volatile ones for ttlmin.
+long long SCacheAdaptiveTtl(CacheDetails* cache, SCacheResultset* previous, SCacheResultset* result) {
+    long long ttl = (long long)cache->ttl*1000;
+    if ((cache->ttlmin == cache->ttlmax)||(NULL == previous)||(previous->husk)||(0 == previous->ttl))
+        return ttl;
+    if (result->checksum == previous->checksum)
+        ttl = previous->ttl + previous->ttl/2;
+    else
+        ttl = previous->ttl/2;
+    if (ttl < (long long)cache->ttlmin*1000) ttl = (long long)cache->ttlmin*1000;
+    if (ttl > (long long)cache->ttlmax*1000) ttl = (long long)cache->ttlmax*1000;
+    return ttl;
+}
+
+// The entries are evicted by the module, rather than by Redis TTLs, with a
+// hierarchical timing wheel : SCACHE_WHEEL_LEVELS levels of SCACHE_WHEEL_SLOTS
+// slots, SCACHE_WHEEL_TICK each for the first level, SCACHE_WHEEL_SLOTS times
+// longer for each next level. Scheduling and evicting an entry is O(1), the
+// entries of a level are cascaded to the lower ones as their slot comes. The
+// timers are not attached to their entries, which are freed by Redis : an
+// entry refilled, or deleted, meanwhile is left alone when its timer fires.
+// Only used under the GIL.
+#define SCACHE_WHEEL_TICK 100       // Milliseconds per first level slot
+#define SCACHE_WHEEL_BITS 8
+#define SCACHE_WHEEL_SLOTS (1 << SCACHE_WHEEL_BITS)
+#define SCACHE_WHEEL_LEVELS 4
+
+typedef struct SCacheTimer_s {
+    long long evict;            // Unix milliseconds
+    int db;
+    struct SCacheTimer_s* next;
+    size_t len;
+    char keyname[];
+} SCacheTimer;
+
+SCacheTimer* Wheel[SCACHE_WHEEL_LEVELS][SCACHE_WHEEL_SLOTS];
+uint64_t WheelTick = 0;         // Last processed tick
+uint64_t WheelTimers = 0;
+
+// Returns the tick a timer fires at, the first one not before its time
+uint64_t SCacheWheelTick(SCacheTimer* timer) {
+    return (timer->evict + SCACHE_WHEEL_TICK-1)/SCACHE_WHEEL_TICK;
+}
+
+// Links a timer in the slot of the lowest level whose period holds its tick
+void SCacheWheelAdd(SCacheTimer* timer) {
+    uint64_t tick = SCacheWheelTick(timer);
+    if (tick <= WheelTick) tick = WheelTick+1;
+    int level = 0;
+    while ((level < SCACHE_WHEEL_LEVELS-1)&&
+            ((tick >> (SCACHE_WHEEL_BITS*(level+1))) != (WheelTick >> (SCACHE_WHEEL_BITS*(level+1)))))
+        level++;
+    // Beyond the last level, the timer is linked again when its slot comes
+    uint64_t slot = (tick >> (SCACHE_WHEEL_BITS*level)) & (SCACHE_WHEEL_SLOTS-1);
+    timer->next = Wheel[level][slot];
+    Wheel[level][slot] = timer;
+}
+
+// Schedules the eviction of the key of a resultset in the selected database
+void SCacheWheelSchedule(RedisModuleCtx *ctx, RedisModuleString* keyname, long long evict) {
+    size_t len;
+    const char* ptr = RedisModule_StringPtrLen(keyname, &len);
+    SCacheTimer* timer = RedisModule_Alloc(sizeof(SCacheTimer)+len);
+    timer->evict = evict;
+    timer->db = RedisModule_GetSelectedDb(ctx);
+    timer->len = len;
+    memcpy(timer->keyname, ptr, len);
+    if (0 == WheelTick)
+        WheelTick = RedisModule_Milliseconds()/SCACHE_WHEEL_TICK;
+    SCacheWheelAdd(timer);
+    WheelTimers++;
+}
+
+// Evicts the key of a fired timer, if it still holds a resultset due
+void SCacheWheelFire(RedisModuleCtx *ctx, SCacheTimer* timer, long long now) {
+    if (REDISMODULE_OK == RedisModule_SelectDb(ctx, timer->db)) {
+        RedisModuleString* keyname = RedisModule_CreateString(ctx, timer->keyname, timer->len);
+        RedisModuleKey* key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_WRITE);
+        if ((RedisModule_ModuleTypeGetType(key) == SCacheEntryType)&&
+                (((SCacheResultset*)RedisModule_ModuleTypeGetValue(key))->evict <= now))
+            RedisModule_DeleteKey(key);
+        RedisModule_CloseKey(key);
+        RedisModule_FreeString(ctx, keyname);
+    }
+    RedisModule_Free(timer);
+    WheelTimers--;
+}
+
+// Processes the ticks elapsed since the last call : cascades the higher level
+// slots coming, from the highest, then fires the first level slot
+void SCacheWheelAdvance(RedisModuleCtx *ctx) {
+    long long now = RedisModule_Milliseconds();
+    uint64_t target = now/SCACHE_WHEEL_TICK;
+    if ((0 == WheelTick)||(0 == WheelTimers)) {
+        WheelTick = target;
+        return;
+    }
+    int db = RedisModule_GetSelectedDb(ctx);
+    while (WheelTick < target) {
+        WheelTick++;
+        int levels = 0;
+        while ((levels < SCACHE_WHEEL_LEVELS-1)&&
+                (0 == (WheelTick & ((1ULL << (SCACHE_WHEEL_BITS*(levels+1)))-1))))
+            levels++;
+        for (int level = levels; level > 0; level--) {
+            uint64_t slot = (WheelTick >> (SCACHE_WHEEL_BITS*level)) & (SCACHE_WHEEL_SLOTS-1);
+            SCacheTimer* timer = Wheel[level][slot];
+            Wheel[level][slot] = NULL;
+            while (timer) {
+                SCacheTimer* next = timer->next;
+                SCacheWheelAdd(timer);
+                timer = next;
+            }
+        }
+        uint64_t slot = WheelTick & (SCACHE_WHEEL_SLOTS-1);
+        SCacheTimer* timer = Wheel[0][slot];
+        Wheel[0][slot] = NULL;
+        while (timer) {
+            SCacheTimer* next = timer->next;
+            if (SCacheWheelTick(timer) > WheelTick)
+                SCacheWheelAdd(timer);
+            else
+                SCacheWheelFire(ctx, timer, now);
+            timer = next;
+        }
+    }
+    RedisModule_SelectDb(ctx, db);
+}
+
+// Stores a resultset, its expiration set, as the value of an open key and
+// schedules its eviction. The entries of adaptive caches outlive their
+// expiration by ttlmax, as a miss, so that their refill can compare the
+// values, and the entries of caches serving stale or grace resultsets by
+// their stale or grace delay. Returns REDISMODULE_OK once the key owns it.
+int SCacheEntrySet(RedisModuleCtx *ctx, CacheDetails* cache, RedisModuleKey* key,
+        RedisModuleString* keyname, SCacheResultset* result) {
+    result->persist = cache->persist;
+    SCacheGenerationRelease(result->generation);
+    result->generation = SCacheGenerationRetain(cache->current);
+    long long retention = (cache->ttlmin == cache->ttlmax) ? 0 : (long long)cache->ttlmax*1000;
+    if (retention < (long long)cache->stale*1000)
+        retention = (long long)cache->stale*1000;
+    if (retention < (long long)cache->grace*1000)
+        retention = (long long)cache->grace*1000;
+    result->evict = result->expire + retention;
+    if (REDISMODULE_OK != RedisModule_ModuleTypeSetValue(key, SCacheEntryType, result))
+        return REDISMODULE_ERR;
+    SCacheWheelSchedule(ctx, keyname, result->evict);
+    return REDISMODULE_OK;
+}
+
+// Query subsumption : the miss of a query of a SUBSUME cache is answered from
+// the cached resultset of a query of the same table without condition, such
+// as "SELECT * FROM t" or "SELECT a, b FROM t", when the miss is a simple
+// SELECT of this table : a projection of its columns, AND-ed comparisons of a
+// column with a literal, ORDER BY and LIMIT. The filter runs on the cached
+// rows, typed by their meta : the numeric columns compare as numbers, the
+// other ones as binary strings. Anything else, or a value which the encoded
+// rows cannot tell apart (a "NULL" string, a value containing a pipe), is
+// fetched from the database.
+#define SCACHE_SELECT_TERMS 16      // Columns, conditions and sort keys of a subsumed query at most
+#define SCACHE_SUPERSETS 4          // Superset queries remembered per table
+#define SCACHE_NAME_STACK 256       // Longest table name
+#define SCACHE_NUMBER_STACK 64      // Longest number compared
+
+typedef enum {
+    SCACHE_OP_EQ = 0,
+    SCACHE_OP_NE,
+    SCACHE_OP_LT,
+    SCACHE_OP_LE,
+    SCACHE_OP_GT,
+    SCACHE_OP_GE,
+    SCACHE_OP_NULL,             // IS NULL
+    SCACHE_OP_NOTNULL           // IS NOT NULL
+} SCacheOp;
+
+// Identifier, literal or column value, not NUL terminated but the literals
+typedef struct SCacheToken_s {
+    const char* ptr;
+    size_t len;
+} SCacheToken;
+
+typedef struct SCacheCond_s {
+    SCacheToken column;
+    SCacheOp op;
+    SCacheToken value;          // Unquoted literal
+    int quoted;
+    uint32_t index;             // Column of the superset
+    int numeric;
+} SCacheCond;
+
+typedef struct SCacheSort_s {
+    SCacheToken column;
+    int desc;
+    uint32_t index;             // Column of the superset
+    int numeric;
+} SCacheSort;
+
+// Simple SELECT of a single table
+typedef struct SCacheSelect_s {
+    SCacheToken table;
+    int star;                   // SELECT *
+    int ncolumns;
+    SCacheToken columns[SCACHE_SELECT_TERMS];
+    int nconds;
+    SCacheCond conds[SCACHE_SELECT_TERMS];
+    int nsorts;
+    SCacheSort sorts[SCACHE_SELECT_TERMS];
+    long long limit;            // -1 if none
+    long long offset;
+    const char* where;          // End of the WHERE conditions, or of the table without WHERE
+    char* literals;             // Unquoted literals, NULL without WHERE
+} SCacheSelect;
+
+// Cached query without condition, in the superset list of its table, the
+// most recently filled first. Main thread only.
+typedef struct SCacheSuperset_s {
+    char* query;
+    size_t len;
+    int star;
+    struct SCacheSuperset_s* next;
+} SCacheSuperset;
+
+// Returns true if c can be part of an unquoted identifier
+int SCacheIdentChar(char c) {
+    return (isalnum((unsigned char)c))||('_' == c)||('$' == c);
+}
+
+// Skips the spaces of a query being parsed, returns false at its end
+int SCacheSkipSpaces(const char** p, const char* end) {
+    while ((*p < end)&&(isspace((unsigned char)**p)))
+        (*p)++;
+    return *p < end;
+}
+
+// Consumes a keyword, case insensitive
+int SCacheParseKeyword(const char** p, const char* end, const char* keyword) {
+    size_t len = strlen(keyword);
+    if ((!SCacheSkipSpaces(p, end))||((size_t)(end-*p) < len)||(strncasecmp(*p, keyword, len)))
+        return 0;
+    if ((*p+len < end)&&(SCacheIdentChar((*p)[len])))
+        return 0;
+    *p += len;
+    return 1;
+}
+
+// Consumes a punctuation character
+int SCacheParseChar(const char** p, const char* end, char c) {
+    if ((!SCacheSkipSpaces(p, end))||(c != **p))
+        return 0;
+    (*p)++;
+    return 1;
+}
+
+// Consumes an identifier, unquoted or between backquotes, which are not part
+// of the token. A dotted identifier (schema.table) is kept as written.
+int SCacheParseIdent(const char** p, const char* end, SCacheToken* token, int dotted) {
+    if (!SCacheSkipSpaces(p, end))
+        return 0;
+    const char* start = *p;
+    int parts = 0;
+    for (;;) {
+        if ('`' == **p) {
+            const char* close = memchr(*p+1, '`', end-*p-1);
+            if ((NULL == close)||(close == *p+1))
+                return 0;
+            token->ptr = *p+1;
+            token->len = close-*p-1;
+            *p = close+1;
+        } else {
+            const char* q = *p;
+            while ((q < end)&&(SCacheIdentChar(*q)))
+                q++;
+            if ((q == *p)||(isdigit((unsigned char)**p)))
+                return 0;
+            token->ptr = *p;
+            token->len = q-*p;
+            *p = q;
+        }
+        parts++;
+        if ((!dotted)||(*p == end)||('.' != **p))
+            break;
+        (*p)++;
+        if (*p == end)
+            return 0;
+    }
+    if (parts > 1) {
+        token->ptr = start;
+        token->len = *p-start;
+    }
+    return 1;
+}
+
+// Returns true if a whole argument is an identifier, dotted if allowed
+int SCacheIsIdent(const char* name, size_t len, int dotted) {
+    const char* p = name;
+    SCacheToken token;
+    return (SCacheParseIdent(&p, name+len, &token, dotted))&&(p == name+len)&&(!isspace((unsigned char)*name));
+}
+
+// Consumes an unsigned integer
+int SCacheParseInteger(const char** p, const char* end, long long* value) {
+    if ((!SCacheSkipSpaces(p, end))||(!isdigit((unsigned char)**p)))
+        return 0;
+    *value = 0;
+    while ((*p < end)&&(isdigit((unsigned char)**p))) {
+        if (*value > (LLONG_MAX-9)/10)
+            return 0;
+        *value = *value*10 + (**p-'0');
+        (*p)++;
+    }
+    return (*p == end)||(!SCacheIdentChar(**p));
+}
+
+// Consumes a literal : a string between quotes, without backslash escapes as
+// their meaning depends on the SQL mode, or a number. It is copied unquoted
+// and NUL terminated at *dst.
+int SCacheParseLiteral(const char** p, const char* end, char** dst, SCacheToken* token, int* quoted) {
+    if (!SCacheSkipSpaces(p, end))
+        return 0;
+    char* out = *dst;
+    token->ptr = out;
+    *quoted = ('\'' == **p)||('"' == **p);
+    if (*quoted) {
+        char quote = *(*p)++;
+        for (;;) {
+            if ((*p == end)||('\\' == **p))
+                return 0;
+            if (quote == **p) {
+                if ((*p+1 < end)&&(quote == (*p)[1])) {
+                    *out++ = quote;
+                    *p += 2;
+                    continue;
+                }
+                (*p)++;
+                break;
+            }
+            *out++ = *(*p)++;
+        }
+    } else {
+        const char* q = *p;
+        if ((q < end)&&(('-' == *q)||('+' == *q)))
+            q++;
+        const char* digits = q;
+        while ((q < end)&&((isdigit((unsigned char)*q))||('.' == *q)))
+            q++;
+        if (q == digits)
+            return 0;
+        if ((q < end)&&(('e' == *q)||('E' == *q))) {
+            q++;
+            if ((q < end)&&(('-' == *q)||('+' == *q)))
+                q++;
+            while ((q < end)&&(isdigit((unsigned char)*q)))
+                q++;
+        }
+        if ((q < end)&&(SCacheIdentChar(*q)))
+            return 0;
+        memcpy(out, *p, q-*p);
+        out += q-*p;
+        *p = q;
+    }
+    token->len = out-token->ptr;
+    *out++ = 0;
+    *dst = out;
+    return 1;
+}
+
+// Consumes a comparison operator, or IS [NOT] NULL
+int SCacheParseOp(const char** p, const char* end, SCacheOp* op) {
+    if (SCacheParseKeyword(p, end, "is")) {
+        *op = SCacheParseKeyword(p, end, "not") ? SCACHE_OP_NOTNULL : SCACHE_OP_NULL;
+        return SCacheParseKeyword(p, end, "null");
+    }
+    if (!SCacheSkipSpaces(p, end))
+        return 0;
+    static const struct { const char* text; SCacheOp op; } ops[] = {
+        {"<=>", SCACHE_OP_EQ}, {"<=", SCACHE_OP_LE}, {">=", SCACHE_OP_GE}, {"<>", SCACHE_OP_NE},
+        {"!=", SCACHE_OP_NE}, {"=", SCACHE_OP_EQ}, {"<", SCACHE_OP_LT}, {">", SCACHE_OP_GT}
+    };
+    for (size_t i = 0; i < sizeof(ops)/sizeof(ops[0]); i++) {
+        size_t len = strlen(ops[i].text);
+        if (((size_t)(end-*p) >= len)&&(0 == memcmp(*p, ops[i].text, len))) {
+            // The NULL-safe equality is not supported
+            if (3 == len)
+                return 0;
+            *op = ops[i].op;
+            *p += len;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void SCacheSelectFree(SCacheSelect* select) {
+    RedisModule_Free(select->literals);
+    select->literals = NULL;
+}
+
+// Parses the clauses following the table of a simple SELECT, returns 0 on
+// success
+int SCacheSelectParseClauses(const char* p, const char* end, SCacheSelect* select) {
+    if (SCacheParseKeyword(&p, end, "where")) {
+        // Unquoted literals are never longer than in the query, but their NUL
+        select->literals = RedisModule_Alloc(end-p+SCACHE_SELECT_TERMS);
+        char* dst = select->literals;
+        do {
+            if (select->nconds == SCACHE_SELECT_TERMS)
+                return -1;
+            SCacheCond* cond = &select->conds[select->nconds++];
+            if ((!SCacheParseIdent(&p, end, &cond->column, 0))||(!SCacheParseOp(&p, end, &cond->op)))
+                return -1;
+            if ((SCACHE_OP_NULL != cond->op)&&(SCACHE_OP_NOTNULL != cond->op)&&
+                    (!SCacheParseLiteral(&p, end, &dst, &cond->value, &cond->quoted)))
+                return -1;
+        } while (SCacheParseKeyword(&p, end, "and"));
+    }
+    select->where = p;
+
+    if (SCacheParseKeyword(&p, end, "order")) {
+        if (!SCacheParseKeyword(&p, end, "by"))
+            return -1;
+        do {
+            if (select->nsorts == SCACHE_SELECT_TERMS)
+                return -1;
+            SCacheSort* sort = &select->sorts[select->nsorts++];
+            if (!SCacheParseIdent(&p, end, &sort->column, 0))
+                return -1;
+            sort->desc = SCacheParseKeyword(&p, end, "desc");
+            if (!sort->desc)
+                SCacheParseKeyword(&p, end, "asc");
+        } while (SCacheParseChar(&p, end, ','));
+    }
+
+    if (SCacheParseKeyword(&p, end, "limit")) {
+        if (!SCacheParseInteger(&p, end, &select->limit))
+            return -1;
+        if (SCacheParseChar(&p, end, ',')) {
+            select->offset = select->limit;
+            if (!SCacheParseInteger(&p, end, &select->limit))
+                return -1;
+        } else if ((SCacheParseKeyword(&p, end, "offset"))&&
+                (!SCacheParseInteger(&p, end, &select->offset)))
+            return -1;
+    }
+    return SCacheSkipSpaces(&p, end) ? -1 : 0;
+}
+
+// Parses a simple SELECT of a single table :
+// SELECT *|column[, ...] FROM table
+//        [WHERE column op literal|column IS [NOT] NULL [AND ...]]
+//        [ORDER BY column [ASC|DESC][, ...]] [LIMIT [offset,] count [OFFSET offset]]
+// Returns 0 on success, the literals are then freed by SCacheSelectFree.
+int SCacheSelectParse(const char* query, size_t len, SCacheSelect* select) {
+    const char* p = query;
+    const char* end = query+len;
+    select->star = 0;
+    select->ncolumns = 0;
+    select->nconds = 0;
+    select->nsorts = 0;
+    select->limit = -1;
+    select->offset = 0;
+    select->literals = NULL;
+    if (!SCacheParseKeyword(&p, end, "select"))
+        return -1;
+    if (SCacheParseChar(&p, end, '*')) {
+        select->star = 1;
+    } else {
+        do {
+            if ((select->ncolumns == SCACHE_SELECT_TERMS)||
+                    (!SCacheParseIdent(&p, end, &select->columns[select->ncolumns++], 0)))
+                return -1;
+        } while (SCacheParseChar(&p, end, ','));
+    }
+    if ((!SCacheParseKeyword(&p, end, "from"))||(!SCacheParseIdent(&p, end, &select->table, 1)))
+        return -1;
+    if (SCacheSelectParseClauses(p, end, select)) {
+        SCacheSelectFree(select);
+        return -1;
+    }
+    return 0;
+}
+
+// Returns the superset list of a table, created if asked, NULL otherwise
+SCacheSuperset** SCacheSupersetList(CacheDetails* cache, SCacheToken* table, int create) {
+    char name[SCACHE_NAME_STACK];
+    size_t len = 0;
+    for (size_t i = 0; i < table->len; i++) {
+        if ('`' == table->ptr[i])
+            continue;
+        if (len == sizeof(name))
+            return NULL;
+        name[len++] = tolower((unsigned char)table->ptr[i]);
+    }
+    if (NULL == cache->supersets) {
+        if (!create)
+            return NULL;
+        cache->supersets = RedisModule_CreateDict(NULL);
+    }
+    SCacheSuperset** list = RedisModule_DictGetC(cache->supersets, name, len, NULL);
+    if ((NULL == list)&&(create)) {
+        list = RedisModule_Calloc(1, sizeof(SCacheSuperset*));
+        RedisModule_DictSetC(cache->supersets, name, len, list);
+    }
+    return list;
+}
+
+// Remembers a filled query without condition as a superset of the queries
+// of its table
+void SCacheSupersetAdd(CacheDetails* cache, const char* query, size_t len) {
+    SCacheSelect select;
+    if (SCacheSelectParse(query, len, &select))
+        return;
+    int star = select.star;
+    SCacheSuperset** list = NULL;
+    if ((0 == select.nconds)&&(0 == select.nsorts)&&(select.limit < 0))
+        list = SCacheSupersetList(cache, &select.table, 1);
+    SCacheSelectFree(&select);
+    if (NULL == list)
+        return;
+
+    // Moved first if already listed, the least recently filled is dropped
+    int kept = 0;
+    SCacheSuperset** cur = list;
+    while (*cur) {
+        SCacheSuperset* superset = *cur;
+        if (((superset->len == len)&&(0 == memcmp(superset->query, query, len)))||
+                (kept == SCACHE_SUPERSETS-1)) {
+            *cur = superset->next;
+            RedisModule_Free(superset->query);
+            RedisModule_Free(superset);
+        } else {
+            kept++;
+            cur = &superset->next;
+        }
+    }
+    SCacheSuperset* superset = RedisModule_Alloc(sizeof(SCacheSuperset));
+    superset->query = RedisModule_Alloc(len);
+    memcpy(superset->query, query, len);
+    superset->len = len;
+    superset->star = star;
+    superset->next = *list;
+    *list = superset;
+}
+
+void SCacheSupersetsFree(CacheDetails* cache) {
+    if (NULL == cache->supersets)
+        return;
+    SCacheSuperset** list;
+    RedisModuleDictIter* iter = RedisModule_DictIteratorStartC(cache->supersets, "^", NULL, 0);
+    while (RedisModule_DictNextC(iter, NULL, (void**)&list)) {
+        while (*list) {
+            SCacheSuperset* superset = *list;
+            *list = superset->next;
+            RedisModule_Free(superset->query);
+            RedisModule_Free(superset);
+        }
+        RedisModule_Free(list);
+    }
+    RedisModule_DictIteratorStop(iter);
+    RedisModule_FreeDict(NULL, cache->supersets);
+    cache->supersets = NULL;
+}
+
+// Returns the position of a column in the meta of a resultset, -1 if it is
+// missing or ambiguous
+int SCacheMetaColumn(SCacheResultset* entry, SCacheToken* column) {
+    int index = -1;
+    for (uint32_t i = 0; i < entry->nmeta; i++) {
+        const char* bar = memrchr(entry->meta[i].ptr, '|', entry->meta[i].len);
+        if ((NULL == bar)||((size_t)(bar-entry->meta[i].ptr) != column->len)||
+                (strncasecmp(entry->meta[i].ptr, column->ptr, column->len)))
+            continue;
+        if (index >= 0)
+            return -1;
+        index = i;
+    }
+    return index;
+}
+
+// Returns true if a column meta (name|type) is of a numeric type
+int SCacheMetaNumeric(SCacheBuffer* meta) {
+    static const char* numeric[] = {
+        "MYSQL_TYPE_TINY", "MYSQL_TYPE_SHORT", "MYSQL_TYPE_LONG", "MYSQL_TYPE_INT24",
+        "MYSQL_TYPE_LONGLONG", "MYSQL_TYPE_DECIMAL", "MYSQL_TYPE_NEWDECIMAL",
+        "MYSQL_TYPE_FLOAT", "MYSQL_TYPE_DOUBLE", "MYSQL_TYPE_YEAR",
+        "SQLITE_INTEGER", "SQLITE_FLOAT", NULL
+    };
+    const char* bar = memrchr(meta->ptr, '|', meta->len);
+    if (NULL == bar)
+        return 0;
+    for (int i = 0; numeric[i]; i++)
+        if (!strcmp(bar+1, numeric[i]))
+            return 1;
+    return 0;
+}
+
+// Parses a whole number, as an integer if possible. Returns 0 on success.
+int SCacheParseNumber(const char* ptr, size_t len, long long* integer, double* real, int* isinteger) {
+    char buf[SCACHE_NUMBER_STACK];
+    if ((0 == len)||(len >= sizeof(buf)))
+        return -1;
+    for (size_t i = 0; i < len; i++)
+        if ((!isdigit((unsigned char)ptr[i]))&&(!strchr("+-.eE", ptr[i])))
+            return -1;
+    memcpy(buf, ptr, len);
+    buf[len] = 0;
+    char* e;
+    errno = 0;
+    *integer = strtoll(buf, &e, 10);
+    *isinteger = (e == buf+len)&&(0 == errno);
+    if (*isinteger) {
+        *real = (double)*integer;
+        return 0;
+    }
+    *real = strtod(buf, &e);
+    return (e == buf+len) ? 0 : -1;
+}
+
+// Compares two numbers, returns 0 and sets cmp, or -1 if one is not a number
+int SCacheNumberCompare(SCacheToken* a, SCacheToken* b, int* cmp) {
+    long long ia, ib;
+    double ra, rb;
+    int inta, intb;
+    if ((SCacheParseNumber(a->ptr, a->len, &ia, &ra, &inta))||
+            (SCacheParseNumber(b->ptr, b->len, &ib, &rb, &intb)))
+        return -1;
+    if ((inta)&&(intb))
+        *cmp = (ia > ib)-(ia < ib);
+    else
+        *cmp = (ra > rb)-(ra < rb);
+    return 0;
+}
+
+int SCacheBinaryCompare(SCacheToken* a, SCacheToken* b) {
+    int cmp = memcmp(a->ptr, b->ptr, (a->len < b->len) ? a->len : b->len);
+    return cmp ? cmp : (a->len > b->len)-(a->len < b->len);
+}
+
+int SCacheIsNull(SCacheToken* value) {
+    return (4 == value->len)&&(0 == memcmp(value->ptr, "NULL", 4));
+}
+
+// Splits a cached row in its column values. Returns -1 if a value contains a
+// pipe : the row then has more pipes than columns.
+int SCacheRowSplit(SCacheBuffer* row, uint32_t ncolumns, SCacheToken* values) {
+    const char* p = row->ptr;
+    const char* end = row->ptr+row->len;
+    for (uint32_t i = 0; i < ncolumns; i++) {
+        const char* bar = (i+1 < ncolumns) ? memchr(p, '|', end-p) : end;
+        if (NULL == bar)
+            return -1;
+        values[i].ptr = p;
+        values[i].len = bar-p;
+        p = bar+1;
+    }
+    return memchr(values[ncolumns-1].ptr, '|', values[ncolumns-1].len) ? -1 : 0;
+}
+
+// Evaluates a condition on a column value. Returns 1 if it matches, 0 if it
+// does not, -1 if the value cannot be told apart from a NULL.
+int SCacheCondMatch(SCacheCond* cond, SCacheToken* value) {
+    int null = SCacheIsNull(value);
+    if ((null)&&(!cond->numeric))
+        return -1;
+    if (SCACHE_OP_NULL == cond->op)
+        return null;
+    if (SCACHE_OP_NOTNULL == cond->op)
+        return !null;
+    if (null)
+        return 0;
+    int cmp;
+    if (!cond->numeric)
+        cmp = SCacheBinaryCompare(value, &cond->value);
+    else if (SCacheNumberCompare(value, &cond->value, &cmp))
+        return -1;
+    switch (cond->op) {
+        case SCACHE_OP_EQ: return 0 == cmp;
+        case SCACHE_OP_NE: return 0 != cmp;
+        case SCACHE_OP_LT: return cmp < 0;
+        case SCACHE_OP_LE: return cmp <= 0;
+        case SCACHE_OP_GT: return cmp > 0;
+        case SCACHE_OP_GE: return cmp >= 0;
+        default: return -1;
+    }
+}
+
+// Sort keys of the matching rows, compared by SCacheSortCompare
+typedef struct SCacheSortContext_s {
+    SCacheSelect* select;
+    SCacheToken* keys;          // nsorts per matching row
+} SCacheSortContext;
+
+/* qsort_r callback ordering the matching rows like the database : NULLs
+ * first, ties in the superset order. */
+int SCacheSortCompare(const void* a, const void* b, void* arg) {
+    SCacheSortContext* context = arg;
+    uint64_t ra = *(const uint64_t*)a;
+    uint64_t rb = *(const uint64_t*)b;
+    int nsorts = context->select->nsorts;
+    for (int i = 0; i < nsorts; i++) {
+        SCacheSort* sort = &context->select->sorts[i];
+        SCacheToken* ka = &context->keys[ra*nsorts+i];
+        SCacheToken* kb = &context->keys[rb*nsorts+i];
+        int cmp;
+        if (!sort->numeric)
+            cmp = SCacheBinaryCompare(ka, kb);
+        else if ((SCacheIsNull(ka))||(SCacheIsNull(kb)))
+            cmp = SCacheIsNull(kb)-SCacheIsNull(ka);
+        else if (SCacheNumberCompare(ka, kb, &cmp))
+            cmp = 0;
+        if (cmp)
+            return sort->desc ? -cmp : cmp;
+    }
+    return (ra > rb)-(ra < rb);
+}
+
+// Resolves the columns of a query in the meta of a superset, and checks
+// its literals against their types. Returns 0 if the superset covers it.
+int SCacheSubsumeColumns(SCacheResultset* entry, int star, SCacheSelect* select, uint32_t* project) {
+    if ((select->star)&&(!star))
+        return -1;
+    for (int i = 0; i < select->ncolumns; i++) {
+        int index = SCacheMetaColumn(entry, &select->columns[i]);
+        if (index < 0)
+            return -1;
+        project[i] = index;
+    }
+    for (int i = 0; i < select->nconds; i++) {
+        SCacheCond* cond = &select->conds[i];
+        int index = SCacheMetaColumn(entry, &cond->column);
+        if (index < 0)
+            return -1;
+        cond->index = index;
+        cond->numeric = SCacheMetaNumeric(&entry->meta[index]);
+        if ((SCACHE_OP_NULL == cond->op)||(SCACHE_OP_NOTNULL == cond->op))
+            continue;
+        // A number compared with a string column, or a string which is not
+        // a number compared with a numeric one, converts as the database does
+        long long integer;
+        double real;
+        int isinteger;
+        if (cond->numeric ?
+                (0 != SCacheParseNumber(cond->value.ptr, cond->value.len, &integer, &real, &isinteger)) :
+                (!cond->quoted))
+            return -1;
+    }
+    for (int i = 0; i < select->nsorts; i++) {
+        SCacheSort* sort = &select->sorts[i];
+        int index = SCacheMetaColumn(entry, &sort->column);
+        if (index < 0)
+            return -1;
+        sort->index = index;
+        sort->numeric = SCacheMetaNumeric(&entry->meta[index]);
+    }
+    return 0;
+}
+
+// Filters, sorts and projects the rows of a cached superset of a query.
+// Returns the resultset of the query, or NULL if the superset does not cover
+// it or if its rows cannot be filtered the way the database would.
+SCacheResultset* SCacheSubsumeFrom(SCacheResultset* entry, int star, SCacheSelect* select) {
+    uint32_t project[SCACHE_SELECT_TERMS];
+    uint32_t ncolumns = entry->nmeta;
+    if ((0 == ncolumns)||(SCacheSubsumeColumns(entry, star, select, project)))
+        return NULL;
+    int nsorts = select->nsorts;
+    SCacheToken* values = RedisModule_Alloc(sizeof(SCacheToken)*ncolumns);
+    uint64_t* matching = RedisModule_Alloc(sizeof(uint64_t)*(entry->nrows ? entry->nrows : 1));
+    uint64_t* rows = RedisModule_Alloc(sizeof(uint64_t)*(entry->nrows ? entry->nrows : 1));
+    SCacheToken* keys = nsorts ? RedisModule_Alloc(sizeof(SCacheToken)*nsorts*(entry->nrows ? entry->nrows : 1)) : NULL;
+    uint64_t nmatching = 0;
+    int failed = 0;
+
+    // Without ORDER BY, the first rows are as good as the database ones
+    uint64_t wanted = ((0 == nsorts)&&(select->limit >= 0)) ?
+        (uint64_t)select->offset + (uint64_t)select->limit : UINT64_MAX;
+    for (uint64_t r = 0; (r < entry->nrows)&&(nmatching < wanted)&&(!failed); r++) {
+        if (SCacheRowSplit(&entry->rows[r], ncolumns, values)) {
+            failed = 1;
+            break;
+        }
+        int match = 1;
+        for (int i = 0; (i < select->nconds)&&(1 == match); i++)
+            match = SCacheCondMatch(&select->conds[i], &values[select->conds[i].index]);
+        if (match < 0)
+            failed = 1;
+        if (1 != match)
+            continue;
+        for (int i = 0; i < nsorts; i++) {
+            SCacheSort* sort = &select->sorts[i];
+            SCacheToken* key = &values[sort->index];
+            long long integer;
+            double real;
+            int isinteger;
+            if (SCacheIsNull(key) ? !sort->numeric :
+                    ((sort->numeric)&&(SCacheParseNumber(key->ptr, key->len, &integer, &real, &isinteger))))
+                failed = 1;
+            keys[nmatching*nsorts+i] = *key;
+        }
+        matching[nmatching] = nmatching;
+        rows[nmatching++] = r;
+    }
+    if (failed) {
+        RedisModule_Free(values);
+        RedisModule_Free(matching);
+        RedisModule_Free(rows);
+        RedisModule_Free(keys);
+        return NULL;
+    }
+
+    // The positions of the matching rows are sorted, then mapped to the entry rows
+    if (nsorts) {
+        SCacheSortContext context = {select, keys};
+        qsort_r(matching, nmatching, sizeof(uint64_t), SCacheSortCompare, &context);
+    }
+    uint64_t first = ((uint64_t)select->offset < nmatching) ? (uint64_t)select->offset : nmatching;
+    uint64_t count = nmatching-first;
+    if ((select->limit >= 0)&&((uint64_t)select->limit < count))
+        count = select->limit;
+
+    SCacheResultset* result = RedisModule_Calloc(1, sizeof(SCacheResultset));
+    size_t size = 0;
+    size_t arenacapacity = 0;
+    uint32_t nproject = select->star ? ncolumns : (uint32_t)select->ncolumns;
+    result->meta = RedisModule_Alloc(sizeof(SCacheBuffer)*nproject);
+    for (uint32_t i = 0; i < nproject; i++) {
+        SCacheBuffer* meta = &entry->meta[select->star ? i : project[i]];
+        result->meta[result->nmeta++].len = meta->len;
+        memcpy(SCacheArenaGrow(result, &arenacapacity, &size, meta->len+1), meta->ptr, meta->len+1);
+    }
+    result->rows = RedisModule_Alloc(sizeof(SCacheBuffer)*(count ? count : 1));
+    for (uint64_t k = first; k < first+count; k++) {
+        uint64_t r = rows[matching[k]];
+        SCacheRowSplit(&entry->rows[r], ncolumns, values);
+        SCacheBuffer* value = &result->rows[result->nrows++];
+        if (select->star) {
+            value->len = entry->rows[r].len;
+            memcpy(SCacheArenaGrow(result, &arenacapacity, &size, value->len+1), entry->rows[r].ptr, value->len+1);
+        } else {
+            value->len = nproject-1;
+            for (uint32_t i = 0; i < nproject; i++)
+                value->len += values[project[i]].len;
+            char* p = SCacheArenaGrow(result, &arenacapacity, &size, value->len+1);
+            for (uint32_t i = 0; i < nproject; i++) {
+                if (i) *p++ = '|';
+                memcpy(p, values[project[i]].ptr, values[project[i]].len);
+                p += values[project[i]].len;
+            }
+            *p = 0;
+        }
+        result->bytes += value->len;
+    }
+    SCacheArenaFinish(result, size);
+    result->checksum = SCacheChecksum(0xcbf29ce484222325ULL, result->arena, size);
+    RedisModule_Free(values);
+    RedisModule_Free(matching);
+    RedisModule_Free(rows);
+    RedisModule_Free(keys);
+    return result;
+}
+
+// Answers the miss of a query from a cached superset of it, the most
+// recently filled first, and stores the subsumed resultset as the entry of
+// the query, expiring with its superset. Returns the stored resultset, or
+// NULL to fetch the query from the database.
+SCacheResultset* SCacheSubsume(RedisModuleCtx *ctx, CacheDetails* cache, const char* query, size_t len) {
+    if (NULL == cache->supersets)
+        return NULL;
+    SCacheSelect select;
+    if (SCacheSelectParse(query, len, &select))
+        return NULL;
+    SCacheResultset* result = NULL;
+    SCacheSuperset** cur = SCacheSupersetList(cache, &select.table, 0);
+    long long now = RedisModule_Milliseconds();
+    while ((cur)&&(*cur)&&(NULL == result)) {
+        SCacheSuperset* superset = *cur;
+        RedisModuleKey* key = SCacheOpenEntry(ctx, cache, superset->query, superset->len);
+        if (RedisModule_ModuleTypeGetType(key) != SCacheEntryType) {
+            // Evicted : forgotten until filled again
+            *cur = superset->next;
+            RedisModule_Free(superset->query);
+            RedisModule_Free(superset);
+        } else {
+            SCacheResultset* entry = RedisModule_ModuleTypeGetValue(key);
+            if ((!entry->husk)&&(NULL == entry->error)&&(entry->expire > now)&&
+                    (entry->generation == cache->current)&&
+                    (NULL != (result = SCacheSubsumeFrom(entry, superset->star, &select)))) {
+                result->ttl = entry->ttl;
+                result->expire = entry->expire;
+            }
+            cur = &superset->next;
+        }
+        RedisModule_CloseKey(key);
+    }
+    SCacheSelectFree(&select);
+    if (NULL == result)
+        return NULL;
+
+    // Refilled from its superset once expired, never from the database
+    result->refreshing = 1;
+    RedisModuleString *keyname = SCacheKey(ctx, cache, query, len);
+    RedisModuleKey* key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_WRITE);
+    if (REDISMODULE_OK != SCacheEntrySet(ctx, cache, key, keyname, result)) {
+        SCacheResultsetFree(result);
+        result = NULL;
+    }
+    RedisModule_CloseKey(key);
+    RedisModule_FreeString(ctx,keyname);
+    return result;
+}
+
+// Incremental refresh : the background refills of a cache with an INCREMENTAL
+// column only fetch the rows from the highest value of this column in their
+// entry, its watermark, and merge them in the entry. The column grows with the
+// rows : an auto-increment id for append-only tables, or an update time for
+// versioned ones. The rows at the watermark are fetched again, as more of them
+// may have been committed since, and a fetched row replaces the rows of the
+// entry with the same ROWKEY, or with the same values without ROWKEY. The
+// numeric columns compare as numbers, the other ones as binary strings, like
+// DATETIME values. Only the simple SELECTs without LIMIT, ordered by the
+// column if at all, are refilled incrementally, the other ones in full. The
+// deleted rows stay until the next full refill, as well as the rows committed
+// below the watermark, by transactions which took their id earlier.
+#define SCACHE_DELTA_REFILLS 16     // Incremental refills of an entry between two full ones
+
+// Returns the highest value of a column in the rows of a resultset, NULL if
+// it has none, or if the rows cannot be told apart. The NULLs of a numeric
+// column are ignored.
+char* SCacheWatermark(SCacheResultset* result, uint32_t index) {
+    uint32_t ncolumns = result->nmeta;
+    if ((index >= ncolumns)||(0 == result->nrows))
+        return NULL;
+    int numeric = SCacheMetaNumeric(&result->meta[index]);
+    SCacheToken* values = RedisModule_Alloc(sizeof(SCacheToken)*ncolumns);
+    SCacheToken mark = {NULL, 0};
+    int failed = 0;
+    for (uint64_t r = 0; (r < result->nrows)&&(!failed); r++) {
+        if (SCacheRowSplit(&result->rows[r], ncolumns, values)) {
+            failed = 1;
+            break;
+        }
+        SCacheToken* value = &values[index];
+        int cmp = 1;
+        if (SCacheIsNull(value)) {
+            failed = !numeric;
+            cmp = 0;
+        } else if (NULL == mark.ptr)
+            mark = *value;
+        else if (!numeric)
+            cmp = SCacheBinaryCompare(value, &mark);
+        else
+            failed = SCacheNumberCompare(value, &mark, &cmp);
+        if ((!failed)&&(cmp > 0))
+            mark = *value;
+    }
+    RedisModule_Free(values);
+    if ((failed)||(NULL == mark.ptr))
+        return NULL;
+    char* watermark = RedisModule_Alloc(mark.len+1);
+    memcpy(watermark, mark.ptr, mark.len);
+    watermark[mark.len] = 0;
+    return watermark;
+}
+
+// Returns the position of a column of a cache definition in the meta of an
+// entry, -1 if it is missing or ambiguous
+int SCacheDeltaColumn(SCacheResultset* entry, const char* name) {
+    SCacheToken column = {name, strlen(name)};
+    return SCacheMetaColumn(entry, &column);
+}
+
+// Returns the query of the incremental refill of an entry : its query with
+// one more condition on the INCREMENTAL column, or NULL to refill it in full.
+// The watermark of the entry is computed on its first incremental refill.
+char* SCacheDeltaQuery(CacheDetails* cache, SCacheResultset* entry, const char* query, size_t len, size_t* deltalen) {
+    if ((NULL == cache->incremental)||(entry->deltas >= SCACHE_DELTA_REFILLS))
+        return NULL;
+    int index = SCacheDeltaColumn(entry, cache->incremental);
+    if ((index < 0)||((cache->rowkey)&&(SCacheDeltaColumn(entry, cache->rowkey) < 0)))
+        return NULL;
+    SCacheSelect select;
+    if (SCacheSelectParse(query, len, &select))
+        return NULL;
+    size_t collen = strlen(cache->incremental);
+    int eligible = (select.limit < 0)&&((0 == select.nsorts)||((1 == select.nsorts)&&(!select.sorts[0].desc)&&
+                (select.sorts[0].column.len == collen)&&
+                (!strncasecmp(select.sorts[0].column.ptr, cache->incremental, collen))));
+    const char* where = select.where;
+    int nconds = select.nconds;
+    SCacheSelectFree(&select);
+    if (!eligible)
+        return NULL;
+    if (NULL == entry->watermark)
+        entry->watermark = SCacheWatermark(entry, index);
+    if (NULL == entry->watermark)
+        return NULL;
+
+    // The numeric watermarks are numbers, the other ones are quoted, quotes
+    // doubled, unless they contain a backslash escaping differently per SQL mode
+    const char* mark = entry->watermark;
+    size_t marklen = strlen(mark);
+    int numeric = SCacheMetaNumeric(&entry->meta[index]);
+    if ((!numeric)&&(strchr(mark, '\\')))
+        return NULL;
+    size_t head = where-query;
+    while ((head)&&(isspace((unsigned char)query[head-1])))
+        head--;
+    char* delta = RedisModule_Alloc(len+collen+2*marklen+16);
+    char* p = delta;
+    memcpy(p, query, head);
+    p += head;
+    p += sprintf(p, " %s %s >= ", nconds ? "AND" : "WHERE", cache->incremental);
+    if (!numeric)
+        *p++ = '\'';
+    for (size_t i = 0; i < marklen; i++) {
+        if ((!numeric)&&('\'' == mark[i]))
+            *p++ = '\'';
+        *p++ = mark[i];
+    }
+    if (!numeric)
+        *p++ = '\'';
+    if (where < query+len)
+        *p++ = ' ';
+    memcpy(p, where, query+len-where);
+    p += query+len-where;
+    *p = 0;
+    *deltalen = p-delta;
+    return delta;
+}
+
+// Merges the rows of an incremental refill in its entry : the rows of the
+// entry but the ones replaced by a fetched row of the same key, or equal to a
+// fetched row without ROWKEY, then the fetched rows. Returns the merged
+// resultset, or NULL if the refill does not fit the entry.
+SCacheResultset* SCacheDeltaMerge(CacheDetails* cache, SCacheResultset* entry, SCacheResultset* delta) {
+    uint32_t ncolumns = entry->nmeta;
+    if ((0 == ncolumns)||(delta->nmeta != ncolumns))
+        return NULL;
+    // The backends typing their columns from the values return no types
+    // without rows
+    for (uint32_t i = 0; (i < ncolumns)&&(delta->nrows); i++)
+        if ((delta->meta[i].len != entry->meta[i].len)||
+                (memcmp(delta->meta[i].ptr, entry->meta[i].ptr, entry->meta[i].len)))
+            return NULL;
+    int keyindex = cache->rowkey ? SCacheDeltaColumn(entry, cache->rowkey) : -1;
+    if ((cache->rowkey)&&(keyindex < 0))
+        return NULL;
+    int keynumeric = (keyindex >= 0) ? SCacheMetaNumeric(&entry->meta[keyindex]) : 0;
+    char* watermark = NULL;
+    if (delta->nrows) {
+        watermark = SCacheWatermark(delta, SCacheDeltaColumn(entry, cache->incremental));
+        if (NULL == watermark)
+            return NULL;
+    }
+
+    // Open addressing set of the keys of the fetched rows, numbered from 1 :
+    // their ROWKEY, or the whole row without. The NULL keys of a numeric
+    // column replace nothing.
+    SCacheToken* values = RedisModule_Alloc(sizeof(SCacheToken)*ncolumns);
+    SCacheToken* keys = NULL;
+    uint64_t* slots = NULL;
+    uint64_t mask = 0;
+    int failed = 0;
+    if (delta->nrows) {
+        uint64_t nslots = 2;
+        while (nslots < delta->nrows*2)
+            nslots <<= 1;
+        mask = nslots-1;
+        slots = RedisModule_Calloc(nslots, sizeof(uint64_t));
+        keys = RedisModule_Alloc(sizeof(SCacheToken)*delta->nrows);
+        for (uint64_t r = 0; (r < delta->nrows)&&(!failed); r++) {
+            keys[r].ptr = delta->rows[r].ptr;
+            keys[r].len = delta->rows[r].len;
+            if (keyindex >= 0) {
+                failed = SCacheRowSplit(&delta->rows[r], ncolumns, values) ? 1 : 0;
+                keys[r] = values[keyindex];
+                if ((failed)||(SCacheIsNull(&keys[r]))) {
+                    failed |= !keynumeric;
+                    continue;
+                }
+            }
+            uint64_t slot = SCacheChecksum(0xcbf29ce484222325ULL, keys[r].ptr, keys[r].len) & mask;
+            while (slots[slot])
+                slot = (slot+1) & mask;
+            slots[slot] = r+1;
+        }
+    }
+
+    uint64_t* kept = RedisModule_Alloc(sizeof(uint64_t)*(entry->nrows ? entry->nrows : 1));
+    uint64_t nkept = 0;
+    for (uint64_t r = 0; (r < entry->nrows)&&(!failed); r++) {
+        int replaced = 0;
+        if (slots) {
+            SCacheToken row = {entry->rows[r].ptr, entry->rows[r].len};
+            SCacheToken* key = &row;
+            if (keyindex >= 0) {
+                if (SCacheRowSplit(&entry->rows[r], ncolumns, values)) {
+                    failed = 1;
+                    break;
+                }
+                key = &values[keyindex];
+            }
+            if ((keyindex >= 0)&&(SCacheIsNull(key)))
+                failed = !keynumeric;
+            else
+                for (uint64_t slot = SCacheChecksum(0xcbf29ce484222325ULL, key->ptr, key->len) & mask;
+                        (slots[slot])&&(!replaced);
+                        slot = (slot+1) & mask)
+                    replaced = (0 == SCacheBinaryCompare(key, &keys[slots[slot]-1]));
+        }
+        if (!replaced)
+            kept[nkept++] = r;
+    }
+    RedisModule_Free(values);
+    RedisModule_Free(keys);
+    RedisModule_Free(slots);
+    if (failed) {
+        RedisModule_Free(kept);
+        RedisModule_Free(watermark);
+        return NULL;
+    }
+
+    SCacheResultset* result = RedisModule_Calloc(1, sizeof(SCacheResultset));
+    size_t size = 0;
+    size_t arenacapacity = 0;
+    result->meta = RedisModule_Alloc(sizeof(SCacheBuffer)*ncolumns);
+    for (uint32_t i = 0; i < ncolumns; i++) {
+        result->meta[result->nmeta++].len = entry->meta[i].len;
+        memcpy(SCacheArenaGrow(result, &arenacapacity, &size, entry->meta[i].len+1), entry->meta[i].ptr, entry->meta[i].len+1);
+    }
+    uint64_t nrows = nkept+delta->nrows;
+    result->rows = RedisModule_Alloc(sizeof(SCacheBuffer)*(nrows ? nrows : 1));
+    for (uint64_t k = 0; k < nrows; k++) {
+        SCacheBuffer* row = (k < nkept) ? &entry->rows[kept[k]] : &delta->rows[k-nkept];
+        result->rows[result->nrows++].len = row->len;
+        memcpy(SCacheArenaGrow(result, &arenacapacity, &size, row->len+1), row->ptr, row->len+1);
+    }
+    RedisModule_Free(kept);
+    SCacheArenaFinish(result, size);
+    result->checksum = SCacheChecksum(0xcbf29ce484222325ULL, result->arena, size);
+    result->watermark = watermark ? watermark : RedisModule_Strdup(entry->watermark);
+    result->deltas = entry->deltas+1;
+    result->dbtime = delta->dbtime;
+    result->bytes = delta->bytes;
+    return result;
+}
+
+// Turns a completed incremental refill into the refill of its entry : the
+// merged resultset, or an error if the entry changed meanwhile or if the
+// refill does not fit it. The next refill of the entry is then a full one.
+void SCacheDeltaApply(RedisModuleCtx *ctx, CacheDetails* cache, FetchJob* job) {
+    RedisModule_Free(job->query);
+    job->query = job->merge;
+    job->len = job->mergelen;
+    job->merge = NULL;
+    RedisModuleKey* key = SCacheOpenEntry(ctx, cache, job->query, job->len);
+    SCacheResultset* entry = (RedisModule_ModuleTypeGetType(key) == SCacheEntryType) ?
+        RedisModule_ModuleTypeGetValue(key) : NULL;
+    SCacheResultset* merged = NULL;
+    if ((entry)&&(!entry->husk)&&(NULL == job->result->error)&&(entry->watermark)&&
+            (!strcmp(entry->watermark, job->watermark)))
+        merged = SCacheDeltaMerge(cache, entry, job->result);
+    if (merged) {
+        SCacheResultsetFree(job->result);
+        job->result = merged;
+    } else {
+        if (entry)
+            entry->deltas = SCACHE_DELTA_REFILLS;
+        if (NULL == job->result->error) {
+            SCacheResultsetFree(job->result);
+            job->result = SCacheResultsetFailed("ERR incremental refill does not fit its entry");
+        }
+    }
+    RedisModule_CloseKey(key);
+}
+
+// Moves a fetched resultset (names, types and values) in the cache with TTL.
+// Concurrent misses on the same query replace each other. Fills are local to
+// the node, they are neither replicated nor written to the AOF : the key API
+// does not propagate, and each replica fills its own cache.
+void SCacheResultsetInsert(RedisModuleCtx *ctx, CacheDetails* cache, FetchJob* job) {
+    // Fetched before a flush of the cache
+    if (job->request->generation != cache->generation)
+        return;
+    SCacheResultset* result = job->result;
+    RedisModuleString *keyname = SCacheKey(ctx, cache, job->query, job->len);
+    RedisModuleKey* key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_WRITE);
+    SCacheResultset* previous = (RedisModule_ModuleTypeGetType(key) == SCacheEntryType) ?
+        RedisModule_ModuleTypeGetValue(key) : NULL;
+    if ((previous)&&(previous->generation != cache->current))
+        previous = NULL;
+    result->ttl = SCacheAdaptiveTtl(cache, previous, result);
+    result->expire = RedisModule_Milliseconds() + result->ttl;
+    if (REDISMODULE_OK == SCacheEntrySet(ctx, cache, key, keyname, result)) {
+        job->result = NULL;
+        if (cache->subsume)
+            SCacheSupersetAdd(cache, job->query, job->len);
+    }
+    RedisModule_CloseKey(key);
+    RedisModule_FreeString(ctx,keyname);
+}
+
+// Loads a string from a RDB, NUL terminated like the module buffers
+char* SCacheLoadString(RedisModuleIO *rdb, size_t* len) {
+    size_t size;
+    char* buffer = RedisModule_LoadStringBuffer(rdb, &size);
+    buffer = RedisModule_Realloc(buffer, size+1);
+    buffer[size] = 0;
+    if (len) *len = size;
+    return buffer;
+}
+
+/* RDB saving callback of the cached resultsets. Only the entries of the caches
+ * created with PERSIST yes keep their values, the others are saved as husks. */
+void SCacheEntry_RdbSave(RedisModuleIO *rdb, void *value) {
+    SCacheResultset* entry = value;
+    // The entries of the flushed caches are saved as husks
+    int persist = (entry->persist)&&(!entry->husk)&&(SCacheGenerationLive(entry));
+    RedisModule_SaveUnsigned(rdb, persist);
+    if (!persist) return;
+    RedisModule_SaveSigned(rdb, entry->expire);
+    RedisModule_SaveSigned(rdb, entry->ttl);
+    RedisModule_SaveUnsigned(rdb, entry->checksum);
+    RedisModule_SaveSigned(rdb, entry->evict);
+    RedisModule_SaveUnsigned(rdb, entry->generation->id);
+    RedisModule_SaveUnsigned(rdb, entry->nmeta);
+    for (uint32_t i = 0; i < entry->nmeta; i++)
+        RedisModule_SaveStringBuffer(rdb, entry->meta[i].ptr, entry->meta[i].len);
+    RedisModule_SaveUnsigned(rdb, entry->nrows);
+    for (uint64_t i = 0; i < entry->nrows; i++)
+        RedisModule_SaveStringBuffer(rdb, entry->rows[i].ptr, entry->rows[i].len);
+}
+
+/* RDB loading callback of the cached resultsets. Husks and entries already
+ * expired are loaded as husks, a miss until the next fill. The key name is
+ * not known here, the loaded entries are evicted by the sweeper. */
+void *SCacheEntry_RdbLoad(RedisModuleIO *rdb, int encver) {
+    if (encver != SCACHE_ENTRY_ENCVER) return NULL;
+    SCacheResultset* entry = RedisModule_Calloc(1, sizeof(SCacheResultset));
+    entry->husk = 1;
+    if (0 == RedisModule_LoadUnsigned(rdb)) return entry;
+
+    entry->expire = RedisModule_LoadSigned(rdb);
+    entry->ttl = RedisModule_LoadSigned(rdb);
+    entry->checksum = RedisModule_LoadUnsigned(rdb);
+    entry->evict = RedisModule_LoadSigned(rdb);
+    // The entries of the caches not defined anymore are swept
+    uint64_t generation = RedisModule_LoadUnsigned(rdb);
+    if (Generations)
+        entry->generation = SCacheGenerationRetain(RedisModule_DictGetC(Generations,
+                    &generation, sizeof(generation), NULL));
+    size_t size = 0;
+    size_t capacity = 0;
+    uint64_t nmeta = RedisModule_LoadUnsigned(rdb);
+    entry->meta = RedisModule_Alloc(sizeof(SCacheBuffer)*(nmeta ? nmeta : 1));
+    for (; entry->nmeta < nmeta; entry->nmeta++) {
+        char* buffer = RedisModule_LoadStringBuffer(rdb, &entry->meta[entry->nmeta].len);
+        char* p = SCacheArenaGrow(entry, &capacity, &size, entry->meta[entry->nmeta].len+1);
+        memcpy(p, buffer, entry->meta[entry->nmeta].len);
+        p[entry->meta[entry->nmeta].len] = 0;
+        RedisModule_Free(buffer);
+    }
+    uint64_t nrows = RedisModule_LoadUnsigned(rdb);
+    entry->rows = RedisModule_Alloc(sizeof(SCacheBuffer)*(nrows ? nrows : 1));
+    for (; entry->nrows < nrows; entry->nrows++) {
+        char* buffer = RedisModule_LoadStringBuffer(rdb, &entry->rows[entry->nrows].len);
+        char* p = SCacheArenaGrow(entry, &capacity, &size, entry->rows[entry->nrows].len+1);
+        memcpy(p, buffer, entry->rows[entry->nrows].len);
+        p[entry->rows[entry->nrows].len] = 0;
+        RedisModule_Free(buffer);
+    }
+    SCacheArenaFinish(entry, size);
+    entry->persist = 1;
+    entry->husk = (entry->evict <= RedisModule_Milliseconds());
+    return entry;
+}
+
+/* Resultsets are not rewritten in the AOF, only in its RDB preamble */
+void SCacheEntry_AofRewrite(RedisModuleIO *aof, RedisModuleString *key, void *value) {
+    REDISMODULE_NOT_USED(aof);
+    REDISMODULE_NOT_USED(key);
+    REDISMODULE_NOT_USED(value);
+}
+
+size_t SCacheEntry_MemUsage(const void *value) {
+    const SCacheResultset* entry = value;
+    size_t size = sizeof(SCacheResultset) + sizeof(SCacheBuffer)*(entry->nmeta+entry->nrows);
+    for (uint32_t i = 0; i < entry->nmeta; i++)
+        size += entry->meta[i].len+1;
+    for (uint64_t i = 0; i < entry->nrows; i++)
+        size += entry->rows[i].len+1;
+    return size;
+}
+
+void SCacheEntry_Free(void *value) {
+    SCacheResultsetFree(value);
+}
+
+// The entries loaded from a RDB, where the key names are not known, have no
+// eviction timer. A sweeper incrementally scans the keyspace and deletes the
+// entries past their eviction time, the husks and the entries of the flushed
+// or deleted caches, without propagation. After a flush, it sweeps for up to
+// SCACHE_SWEEP_BUDGET per tick, until it went over the whole keyspace.
+#define SCACHE_SWEEP_KEYS 200       // Keys examined per sweep step
+#define SCACHE_SWEEP_BUDGET 1000    // Microseconds of sweep steps per tick after a flush
+RedisModuleScanCursor* SweepCursor = NULL;
+int SweepDb = 0;
+int SweepFlushed = 0;               // Keyspace wraps left before the sweeper slows down
+
+typedef struct SweepState_s {
+    int examined;
+    int count;
+    RedisModuleString* expired[SCACHE_SWEEP_KEYS];
+} SweepState;
+
+void SCacheSweep_ScanCallback(RedisModuleCtx *ctx, RedisModuleString *keyname,
+        RedisModuleKey *key, void *privdata) {
+    SweepState* state = privdata;
+    state->examined++;
+    if ((NULL == key)||(RedisModule_ModuleTypeGetType(key) != SCacheEntryType))
+        return;
+    SCacheResultset* entry = RedisModule_ModuleTypeGetValue(key);
+    if ((!entry->husk)&&(entry->evict > RedisModule_Milliseconds())&&(SCacheGenerationLive(entry)))
+        return;
+    // Keys are deleted after the scan step
+    if (state->count < SCACHE_SWEEP_KEYS)
+        state->expired[state->count++] = RedisModule_CreateStringFromString(ctx, keyname);
+}
+
+// Sweeps the next keys, each database in turn
+void SCacheSweepStep(RedisModuleCtx *ctx) {
+    SweepState state;
+    state.examined = 0;
+    state.count = 0;
+    if (REDISMODULE_OK != RedisModule_SelectDb(ctx, SweepDb)) {
+        SweepDb = 0;
+        RedisModule_SelectDb(ctx, SweepDb);
+        if (SweepFlushed) SweepFlushed--;
+    }
+    while ((state.examined < SCACHE_SWEEP_KEYS)&&(state.count < SCACHE_SWEEP_KEYS)) {
+        if (!RedisModule_Scan(ctx, SweepCursor, SCacheSweep_ScanCallback, &state)) {
+            RedisModule_ScanCursorRestart(SweepCursor);
+            SweepDb++;
+            break;
+        }
+    }
+    for (int i = 0; i < state.count; i++) {
+        RedisModuleKey* key = RedisModule_OpenKey(ctx, state.expired[i], REDISMODULE_WRITE);
+        if (RedisModule_ModuleTypeGetType(key) == SCacheEntryType)
+            RedisModule_DeleteKey(key);
+        RedisModule_CloseKey(key);
+        RedisModule_FreeString(ctx, state.expired[i]);
+    }
+}
+
+// Sweeps a step per tick, or several after a flush
+void SCacheSweep(RedisModuleCtx *ctx) {
+    uint64_t start = SCacheUsTime();
+    do {
+        SCacheSweepStep(ctx);
+    } while ((SweepFlushed)&&(SCacheUsTime()-start < SCACHE_SWEEP_BUDGET));
+}
+
+// Ends the generation of a flushed or dropped cache : its resultsets are misses
+// at once, and its fills in flight are dropped. Main thread only.
+void SCacheEndGeneration(CacheDetails* cache) {
+    __atomic_store_n(&cache->generation, ++Generation, __ATOMIC_RELAXED);
+    SCacheGenerationEnd(cache->current);
+    cache->current = NULL;
+    SCacheSupersetsFree(cache);
+    SweepFlushed = 2;
+}
+
+// Moves a cache to a new generation. Main thread only.
+void SCacheNewGeneration(CacheDetails* cache) {
+    SCacheEndGeneration(cache);
+    cache->current = SCacheGenerationNew(cache->generation);
+}
+
+void RedisModule_ReplyWithResultset(RedisModuleCtx *ctx, SCacheResultset* result, SCacheReplyKind kind) {
+    if (result->error) {
+        RedisModule_ReplyWithError(ctx,result->error);
+    } else if (SCACHE_REPLY_META == kind) {
+        RedisModule_ReplyWithArray(ctx, result->nmeta);
+        for (uint32_t i = 0; i < result->nmeta; i++)
+            RedisModule_ReplyWithStringBuffer(ctx, result->meta[i].ptr, result->meta[i].len);
+    } else {
+        RedisModule_ReplyWithArray(ctx, result->nrows);
+        for (uint64_t i = 0; i < result->nrows; i++)
+            RedisModule_ReplyWithStringBuffer(ctx, result->rows[i].ptr, result->rows[i].len);
+    }
+}
+
+// Mirrored tables : a whole table copied in memory, column by column, with
+// hash indexes on some of its columns, answering point lookups without any
+// resultset entry nor database access. A loader thread fetches the table on
+// its own connection and builds the copy, which replaces the previous one
+// under the GIL. Only RedisModule_Alloc is used to build it.
+#define SCACHE_MIRROR_RETRY 5000    // Milliseconds before a failed load is retried
+#define SCACHE_MIRROR_STACK 512     // Rows joined on the stack up to this length
+
+// Hash index of a column : chains of rows, in table order, by value hash.
+// The rows are numbered from 1 in the chains, 0 ends a chain.
+typedef struct SCacheMirrorIndex_s {
+    uint32_t mask;              // Number of buckets - 1, a power of 2
+    uint32_t* buckets;
+    uint32_t* next;             // Next row of each row in its chain
+} SCacheMirrorIndex;
+
+// Values of a column, one after another
+typedef struct SCacheColumn_s {
+    char* meta;                 // name|type
+    size_t metalen;
+    char* data;
+    size_t size;
+    size_t capacity;
+    uint64_t* offsets;          // Row r spans data from offsets[r] to offsets[r+1]
+    uint8_t* nulls;             // SQL NULL rows
+    SCacheMirrorIndex* index;   // NULL if not indexed
+} SCacheColumn;
+
+// Loaded copy of a table
+typedef struct SCacheMirrorData_s {
+    uint32_t ncolumns;
+    SCacheColumn* columns;
+    uint32_t nrows;
+    uint64_t bytes;
+} SCacheMirrorData;
+
+// Mirrored table of a cache. Main thread only.
+typedef struct SCacheMirror_s {
+    char* table;
+    uint32_t interval;          // Seconds between the reloads, 0 if none
+    uint32_t nindexed;
+    char** indexed;             // Names of the indexed columns
+    long long due;              // Next load (ms), 0 as soon as possible
+    int loading;                // A loader thread is running
+    int dropped;                // Dropped while loading, freed by the loader
+    char* error;                // Last load error, NULL once loaded
+    SCacheMirrorData* data;     // NULL until loaded
+    struct SCacheMirror_s* next;
+} SCacheMirror;
+
+void SCacheMirrorDataFree(SCacheMirrorData* data) {
+    if (NULL == data) return;
+    for (uint32_t i = 0; i < data->ncolumns; i++) {
+        SCacheColumn* column = &data->columns[i];
+        RedisModule_Free(column->meta);
+        RedisModule_Free(column->data);
+        RedisModule_Free(column->offsets);
+        RedisModule_Free(column->nulls);
+        if (column->index) {
+            RedisModule_Free(column->index->buckets);
+            RedisModule_Free(column->index->next);
+            RedisModule_Free(column->index);
+        }
+    }
+    RedisModule_Free(data->columns);
+    RedisModule_Free(data);
+}
+
+void SCacheMirrorFree(SCacheMirror* mirror) {
+    for (uint32_t i = 0; i < mirror->nindexed; i++)
+        RedisModule_Free(mirror->indexed[i]);
+    RedisModule_Free(mirror->indexed);
+    RedisModule_Free(mirror->table);
+    RedisModule_Free(mirror->error);
+    SCacheMirrorDataFree(mirror->data);
+    RedisModule_Free(mirror);
+}
+
+// Frees the mirrors of a released cache, none of them is loading as the
+// loaders hold a reference to the cache
+void SCacheMirrorsFree(CacheDetails* cache) {
+    while (cache->mirrors) {
+        SCacheMirror* mirror = cache->mirrors;
+        cache->mirrors = mirror->next;
+        SCacheMirrorFree(mirror);
+    }
+}
+
+uint32_t SCacheMirrorHash(const char* value, size_t len) {
+    uint64_t hash = SCacheChecksum(0xcbf29ce484222325ULL, value, len);
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// Builds the hash index of a loaded column. The rows are chained from the
+// last one, so that the chains are in table order.
+void SCacheMirrorIndexBuild(SCacheColumn* column, uint32_t nrows) {
+    SCacheMirrorIndex* index = column->index;
+    uint32_t nbuckets = 1;
+    while ((nbuckets < nrows)&&(nbuckets < (1U << 31)))
+        nbuckets <<= 1;
+    index->mask = nbuckets-1;
+    index->buckets = RedisModule_Calloc(nbuckets, sizeof(uint32_t));
+    index->next = RedisModule_Alloc(sizeof(uint32_t)*(nrows ? nrows : 1));
+    for (uint32_t r = nrows; r > 0; r--) {
+        index->next[r-1] = 0;
+        if (column->nulls[r-1])
+            continue;
+        uint32_t bucket = SCacheMirrorHash(column->data+column->offsets[r-1],
+                column->offsets[r]-column->offsets[r-1]) & index->mask;
+        index->next[r-1] = index->buckets[bucket];
+        index->buckets[bucket] = r;
+    }
+}
+
+// Fetches a whole table and builds its copy, with the hash indexes of the
+// indexed columns. Returns NULL and sets err on failure.
+SCacheMirrorData* SCacheMirrorFetch(const SCacheBackend* backend, void* conn, const char* query,
+        char** indexed, uint32_t nindexed, char* err, size_t errlen) {
+    void* res = NULL;
+    if (0 == backend->query(conn, query, strlen(query)))
+        res = backend->store_result(conn);
+    if (NULL == res) {
+        snprintf(err, errlen, "%s", backend->error(conn));
+        return NULL;
+    }
+    SCacheMirrorData* data = RedisModule_Calloc(1, sizeof(SCacheMirrorData));
+    data->ncolumns = backend->num_fields(res);
+    data->columns = RedisModule_Calloc(data->ncolumns ? data->ncolumns : 1, sizeof(SCacheColumn));
+    for (uint32_t i = 0; i < data->ncolumns; i++) {
+        const SCacheField* field = backend->fetch_field(res, i);
+        SCacheColumn* column = &data->columns[i];
+        column->metalen = strlen(field->name)+1+strlen(field->type);
+        column->meta = RedisModule_Alloc(column->metalen+1);
+        snprintf(column->meta, column->metalen+1, "%s|%s", field->name, field->type);
+    }
+    for (uint32_t j = 0; j < nindexed; j++) {
+        SCacheColumn* found = NULL;
+        size_t len = strlen(indexed[j]);
+        for (uint32_t i = 0; (i < data->ncolumns)&&(NULL == found); i++)
+            if (((len+1 < data->columns[i].metalen)&&('|' == data->columns[i].meta[len]))&&
+                    (!strncasecmp(data->columns[i].meta, indexed[j], len)))
+                found = &data->columns[i];
+        if (NULL == found) {
+            snprintf(err, errlen, "ERR unknown column %s", indexed[j]);
+            backend->free_result(res);
+            SCacheMirrorDataFree(data);
+            return NULL;
+        }
+        if (NULL == found->index)
+            found->index = RedisModule_Calloc(1, sizeof(SCacheMirrorIndex));
+    }
+
+    // Values appended column by column, the row arrays grow together
+    const char** row;
+    unsigned long *lengths;
+    uint32_t capacity = 0;
+    while (NULL != (row = backend->fetch_row(res, &lengths))) {
+        if (data->nrows == UINT32_MAX-1) {
+            snprintf(err, errlen, "ERR too many rows to mirror");
+            backend->free_result(res);
+            SCacheMirrorDataFree(data);
+            return NULL;
+        }
+        if (data->nrows == capacity) {
+            capacity = (capacity > UINT32_MAX/2) ? UINT32_MAX-1 : (capacity ? capacity*2 : 64);
+            for (uint32_t i = 0; i < data->ncolumns; i++) {
+                SCacheColumn* column = &data->columns[i];
+                column->offsets = RedisModule_Realloc(column->offsets, sizeof(uint64_t)*(capacity+1));
+                column->nulls = RedisModule_Realloc(column->nulls, capacity);
+                column->offsets[0] = 0;
+            }
+        }
+        for (uint32_t i = 0; i < data->ncolumns; i++) {
+            SCacheColumn* column = &data->columns[i];
+            size_t len = row[i] ? lengths[i] : 0;
+            if (column->size + len > column->capacity) {
+                column->capacity = (column->capacity ? column->capacity*2 : 256);
+                if (column->capacity < column->size + len) column->capacity = column->size + len;
+                column->data = RedisModule_Realloc(column->data, column->capacity);
+            }
+            if (len)
+                memcpy(column->data+column->size, row[i], len);
+            column->size += len;
+            column->nulls[data->nrows] = (NULL == row[i]);
+            column->offsets[data->nrows+1] = column->size;
+            data->bytes += len;
+        }
+        data->nrows++;
+    }
+    backend->free_result(res);
+
+    for (uint32_t i = 0; i < data->ncolumns; i++) {
+        SCacheColumn* column = &data->columns[i];
+        if (NULL == column->offsets) {
+            column->offsets = RedisModule_Calloc(1, sizeof(uint64_t));
+            column->nulls = RedisModule_Alloc(1);
+        }
+        if (column->index)
+            SCacheMirrorIndexBuild(column, data->nrows);
+    }
+    return data;
+}
+
+// Replies with a row of a mirror, its values pipe-separated like a cached
+// resultset
+void SCacheMirrorReplyRow(RedisModuleCtx *ctx, SCacheMirrorData* data, uint32_t r) {
+    if (0 == data->ncolumns) {
+        RedisModule_ReplyWithStringBuffer(ctx, "", 0);
+        return;
+    }
+    size_t len = data->ncolumns-1;
+    for (uint32_t i = 0; i < data->ncolumns; i++) {
+        SCacheColumn* column = &data->columns[i];
+        len += column->nulls[r] ? 4 : column->offsets[r+1]-column->offsets[r];
+    }
+    char stack[SCACHE_MIRROR_STACK];
+    char* buf = (len <= sizeof(stack)) ? stack : RedisModule_Alloc(len);
+    char* p = buf;
+    for (uint32_t i = 0; i < data->ncolumns; i++) {
+        SCacheColumn* column = &data->columns[i];
+        if (i) *p++ = '|';
+        if (column->nulls[r]) {
+            memcpy(p, "NULL", 4);
+            p += 4;
+        } else {
+            memcpy(p, column->data+column->offsets[r], column->offsets[r+1]-column->offsets[r]);
+            p += column->offsets[r+1]-column->offsets[r];
+        }
+    }
+    RedisModule_ReplyWithStringBuffer(ctx, buf, len);
+    if (buf != stack)
+        RedisModule_Free(buf);
+}
+
+// Returns the indexed column of a mirror by name, case insensitive, or NULL
+SCacheColumn* SCacheMirrorIndexed(SCacheMirrorData* data, const char* name, size_t len) {
+    for (uint32_t i = 0; i < data->ncolumns; i++) {
+        SCacheColumn* column = &data->columns[i];
+        if ((column->index)&&(len+1 < column->metalen)&&('|' == column->meta[len])&&
+                (!strncasecmp(column->meta, name, len)))
+            return column;
+    }
+    return NULL;
+}
+
+// Replies with the rows of a mirror whose indexed column equals a value, in
+// table order. The values compare as binary strings, as the database
+// returns them.
+void SCacheMirrorReplyLookup(RedisModuleCtx *ctx, SCacheMirrorData* data, SCacheColumn* column,
+        const char* value, size_t len) {
+    SCacheMirrorIndex* index = column->index;
+    long count = 0;
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    for (uint32_t r = index->buckets[SCacheMirrorHash(value, len) & index->mask]; r; r = index->next[r-1]) {
+        if ((column->offsets[r]-column->offsets[r-1] != len)||
+                (memcmp(column->data+column->offsets[r-1], value, len)))
+            continue;
+        SCacheMirrorReplyRow(ctx, data, r-1);
+        count++;
+    }
+    RedisModule_ReplySetArrayLength(ctx, count);
+}
+
+// Returns a cache definition by name, NULL if not found
+CacheDetails* SCacheGetCache(const char* cachename) {
+    CacheDetails* cur=CacheList;
+    while ((cur)&&(strcmp(cachename,cur->cachename)))
+        cur=cur->next;
+    return cur;
+}
+
+// Closes the connections and releases the cache definition once it is neither
+// listed nor used by a blocked client anymore. Main thread only.
+void SCacheRelease(CacheDetails* cache) {
+    if (--cache->refcount) return;
+    for (uint16_t i = 0; i < cache->nnodes; i++) {
+        SCacheNode* node = &cache->nodes[i];
+        while (node->nidle)
+            cache->backend->close(node->idle[--node->nidle]);
+        RedisModule_Free(node->idle);
+        RedisModule_Free(node->host);
+    }
+    if (cache->dbhandle) cache->backend->close(cache->dbhandle);
+    SCacheSupersetsFree(cache);
+    SCacheMirrorsFree(cache);
+    pthread_mutex_destroy(&cache->lock);
+    pthread_cond_destroy(&cache->wakeup);
+    RedisModule_Free(cache->nodes);
+    RedisModule_Free(cache->replicas);
+    RedisModule_Free(cache->incremental);
+    RedisModule_Free(cache->rowkey);
+    RedisModule_Free(cache->fetchers);
+    RedisModule_Free(cache->cachename);
+    RedisModule_Free(cache->dbhost);
+    RedisModule_Free(cache->dbname);
+    RedisModule_Free(cache->dbuser);
+    RedisModule_Free(cache->dbpass);
+    RedisModule_Free(cache);
+}
+
+// Returns true if a query can be concatenated with others in a multi-statement
+// batch : no statement separator nor comment running to the end of line
+int SCacheBatchable(const char* query, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if ((';' == query[i])||('#' == query[i])) return 0;
+        if (('-' == query[i])&&(i+1 < len)&&('-' == query[i+1])) return 0;
+    }
+    return 1;
+}
+
+// Runs several misses in one multi-statement round trip and demultiplexes the
+// resultsets to their jobs. The database stops at the first failing statement,
+// the following jobs are then fetched one by one, unless the batch was
+// cancelled meanwhile (stop set by another thread).
+void SCacheFetchBatch(const SCacheBackend* backend, void* conn, FetchJob** jobs, int count, const int* stop) {
+    int done = 0;
+    if (count > 1) {
+        size_t total = 0;
+        for (int i = 0; i < count; i++)
+            total += jobs[i]->len+1;
+        char* batch = RedisModule_Alloc(total);
+        char* p = batch;
+        for (int i = 0; i < count; i++) {
+            if (i) *p++ = ';';
+            memcpy(p, jobs[i]->query, jobs[i]->len);
+            p += jobs[i]->len;
+        }
+
+        uint64_t start = SCacheUsTime();
+        int state = backend->query(conn, batch, p-batch);
+        RedisModule_Free(batch);
+        for (int i = 0; i < count; i++)
+            SCacheTraceStage(jobs[i]->trace, SCACHE_STAGE_QUERY);
+        if (0 != state) {
+            jobs[done++]->result = SCacheResultsetError(backend, conn);
+        } else {
+            while (done < count) {
+                int next = done ? backend->next_result(conn) : 0;
+                if (next < 0) break;
+                jobs[done]->result = (next > 0) ? SCacheResultsetError(backend, conn)
+                    : SCacheResultsetEncode(backend, conn, start, jobs[done]->trace);
+                start = SCacheUsTime();
+                if (jobs[done++]->result->error) break;
+            }
+            SCacheResultsetDrain(backend, conn);
+        }
+    }
+    for (; done < count; done++) {
+        if ((stop)&&(__atomic_load_n(stop, __ATOMIC_RELAXED)))
+            jobs[done]->result = SCacheResultsetFailed(SCACHE_TIMEOUT_ERROR);
+        else
+            jobs[done]->result = SCacheResultsetFetch(backend, conn,
+                    jobs[done]->query, jobs[done]->len, jobs[done]->trace);
+    }
+}
+
+// Hands a completed fill over to its warming thread
+void SCacheWarmDone(FetchRequest* request) {
+    WarmTask* warm = request->warm;
+    pthread_mutex_lock(&warm->lock);
+    request->next = warm->done;
+    warm->done = request;
+    warm->outstanding--;
+    pthread_cond_signal(&warm->wakeup);
+    pthread_mutex_unlock(&warm->lock);
+}
+
+// Background refills completed by the fetchers, inserted by the expiry timer
+FetchRequest* RefreshDone = NULL;
+pthread_mutex_t RefreshLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Hands a completed background refill over to the expiry timer
+void SCacheRefreshDone(FetchRequest* request) {
+    pthread_mutex_lock(&RefreshLock);
+    request->next = RefreshDone;
+    RefreshDone = request;
+    pthread_mutex_unlock(&RefreshLock);
+}
+
+// Sets an absolute condition variable deadline, us microseconds from now
+void SCacheDeadline(struct timespec* deadline, long long us) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    long long ns = deadline->tv_nsec + us*1000;
+    deadline->tv_sec += ns / 1000000000;
+    deadline->tv_nsec = ns % 1000000000;
+}
+
+// Opens a connection to a node of the cache (the primary if NULL), fills err on
+// failure
+void* SCacheConnect(CacheDetails* cache, SCacheNode* node, unsigned int flags, char* err, size_t errlen) {
+    const char* host = node ? node->host : cache->dbhost;
+    uint16_t port = node ? node->port : cache->dbport;
+    void* conn = cache->backend->connect(host, port, cache->dbuser, cache->dbpass,
+            cache->dbname, ConnectTimeout, cache->timeout, flags, err, errlen);
+    if (NULL == conn)
+        RedisModule_Log(NULL, "warning", "Cache %s cannot connect to DB %s:%u: %s", cache->cachename, host, port, err);
+    return conn;
+}
+
+// Returns the control connection, NULL until it is connected
+void* SCacheControlConn(CacheDetails* cache) {
+    pthread_mutex_lock(&cache->lock);
+    void* conn = cache->dbhandle;
+    pthread_mutex_unlock(&cache->lock);
+    return conn;
+}
+
+// Opens the control connection when it is missing, only the first fetcher
+// writes it
+void SCacheControlConnect(CacheDetails* cache, char* err, size_t errlen) {
+    if (NULL != SCacheControlConn(cache)) return;
+    void* control = SCacheConnect(cache, NULL, 0, err, errlen);
+    pthread_mutex_lock(&cache->lock);
+    cache->dbhandle = control;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Counts the nodes of a host:port,... replica list, -1 if it is invalid
+int SCacheReplicasCount(const char* replicas) {
+    int count = 0;
+    const char* cur = replicas;
+    while (*cur) {
+        const char* end = strchr(cur, ',');
+        if (NULL == end) end = cur+strlen(cur);
+        const char* colon = memchr(cur, ':', end-cur);
+        if ((NULL == colon)||(colon == cur)) return -1;
+        char* endport;
+        long port = strtol(colon+1, &endport, 10);
+        if ((endport != end)||(port < 1)||(port > UINT16_MAX)) return -1;
+        count++;
+        cur = *end ? end+1 : end;
+    }
+    return count;
+}
+
+// Builds the nodes of a cache : its primary, then its replicas
+void SCacheNodesInit(CacheDetails* cache) {
+    cache->nnodes = 1 + (cache->replicas ? SCacheReplicasCount(cache->replicas) : 0);
+    cache->nodes = RedisModule_Calloc(cache->nnodes, sizeof(SCacheNode));
+    cache->nodes[0].host = RedisModule_Strdup(cache->dbhost);
+    cache->nodes[0].port = cache->dbport;
+    const char* cur = cache->replicas;
+    for (uint16_t i = 1; i < cache->nnodes; i++) {
+        const char* colon = strchr(cur, ':');
+        cache->nodes[i].host = RedisModule_Alloc(colon-cur+1);
+        memcpy(cache->nodes[i].host, cur, colon-cur);
+        cache->nodes[i].host[colon-cur] = 0;
+        cache->nodes[i].port = strtol(colon+1, (char**)&cur, 10);
+        if (',' == *cur) cur++;
+    }
+    for (uint16_t i = 0; i < cache->nnodes; i++) {
+        cache->nodes[i].idle = RedisModule_Calloc(cache->poolsize, sizeof(void*));
+        cache->nodes[i].ejectdelay = SCACHE_RECONNECT_DELAY;
+    }
+}
+
+// Picks the node of the next batch, among the nodes with a free connection
+// other than exclude, or only the primary for an uncacheable query. Ejected
+// nodes are skipped until their ejection delay is over, then probed by a
+// single batch. Returns NULL and sets ejected if no node is routable at all,
+// NULL alone if they are all busy. Called under the cache lock.
+SCacheNode* SCacheRoute(CacheDetails* cache, long long now, SCacheNode* exclude, int primary, int* ejected) {
+    SCacheNode* best = NULL;
+    uint64_t bestscore = 0;
+    *ejected = 1;
+    for (uint16_t i = 0; i < (primary ? 1 : cache->nnodes); i++) {
+        SCacheNode* node = &cache->nodes[i];
+        if ((node == exclude)||
+                ((node->failures >= SCACHE_EJECT_FAILURES)&&(node->ejected > now)))
+            continue;
+        *ejected = 0;
+        if ((node->outstanding >= cache->poolsize)||
+                ((node->failures >= SCACHE_EJECT_FAILURES)&&(node->outstanding)))
+            continue;
+        uint64_t score = (SCACHE_ROUTING_EWMA == cache->routing) ?
+            (node->ewma+1)*(node->outstanding+1) : node->outstanding;
+        if ((NULL == best)||(score < bestscore)) {
+            best = node;
+            bestscore = score;
+        }
+    }
+    return best;
+}
+
+// Accounts the end of a batch on a node : gives the connection back, updates
+// the latency average and the node health. Called under the cache lock.
+void SCacheNodeDone(CacheDetails* cache, SCacheNode* node, void* conn, uint64_t elapsed, long long now) {
+    node->outstanding--;
+    if (conn) {
+        node->idle[node->nidle++] = conn;
+        node->ewma = node->ewma ? (node->ewma*4 + elapsed)/5 : elapsed;
+        node->failures = 0;
+        node->ejectdelay = SCACHE_RECONNECT_DELAY;
+        return;
+    }
+    node->opened--;
+    // Batches still in flight when the node got ejected do not extend it
+    if ((++node->failures >= SCACHE_EJECT_FAILURES)&&(node->ejected <= now)) {
+        node->ejected = now + node->ejectdelay;
+        RedisModule_Log(NULL, "warning", "Cache %s ejects DB %s:%u for %lld ms",
+                cache->cachename, node->host, node->port, node->ejectdelay);
+        node->ejectdelay = (node->ejectdelay*2 > SCACHE_EJECT_MAX) ? SCACHE_EJECT_MAX : node->ejectdelay*2;
+    }
+}
+
+// Returns true if a failed batch lost its connection, rather than failing on
+// a query error
+int SCacheConnLost(CacheDetails* cache, void* conn, FetchJob** batch, int count) {
+    for (int i = 0; i < count; i++)
+        if (batch[i]->result->error)
+            return (0 != cache->backend->ping(conn));
+    return 0;
+}
+
+// Batch in flight, registered when it may be hedged or cancelled at the
+// deadline of its clients. An idle fetcher issues a late batch a second time
+// to another node, the first copy to complete fills the jobs and cancels the
+// other one. An idle fetcher cancels the copies still running at the
+// deadline. As a filled request is released by its client, the copies only
+// fetch the queries copied in the flight, into their own jobs. Protected by
+// the cache lock.
+typedef struct SCacheFlight_s {
+    int count;
+    uint64_t deadline;          // Hedged at this time (µs), 0 once decided
+    uint64_t expire;            // Cancelled at this time (µs), 0 if none
+    int running;                // Copies and cancellations in progress
+    int won;                    // The jobs are filled
+    int killed;                 // Cancelled at the deadline
+    int cancelling;             // Cancellations being sent
+    int done[2];                // Completed copies
+    int cancelled[2];           // Cancelled copies, their connection is closed
+    void* parked[2];            // Connections of cancelled copies, completed meanwhile
+    SCacheNode* nodes[2];       // Node and connection of each copy, the hedge second
+    void* conns[2];
+    FetchJob** jobs;
+    SCacheBuffer* queries;
+    struct SCacheFlight_s* next;
+} SCacheFlight;
+
+// Registers a batch, sent on conn, as a flight to hedge once it is late or to
+// cancel at the deadline of its clients. Called under the cache lock.
+SCacheFlight* SCacheFlightStart(CacheDetails* cache, FetchJob** batch, int count, SCacheNode* node, void* conn,
+        int hedge, long long deadline) {
+    size_t total = 0;
+    for (int i = 0; i < count; i++)
+        total += batch[i]->len;
+    SCacheFlight* flight = RedisModule_Calloc(1, sizeof(SCacheFlight)
+            + count*(sizeof(FetchJob*)+sizeof(SCacheBuffer)) + total);
+    flight->jobs = (FetchJob**)(flight+1);
+    flight->queries = (SCacheBuffer*)(flight->jobs+count);
+    char* p = (char*)(flight->queries+count);
+    for (int i = 0; i < count; i++) {
+        flight->jobs[i] = batch[i];
+        flight->queries[i].ptr = p;
+        flight->queries[i].len = batch[i]->len;
+        memcpy(p, batch[i]->query, batch[i]->len);
+        p += batch[i]->len;
+    }
+    uint64_t now = SCacheUsTime();
+    flight->count = count;
+    flight->deadline = hedge ? now + cache->hedgedelay : 0;
+    if (deadline) {
+        long long left = deadline - RedisModule_Milliseconds();
+        flight->expire = now + ((left > 0) ? left*1000 : 1);
+    }
+    flight->running = 1;
+    flight->nodes[0] = node;
+    flight->conns[0] = conn;
+
+    // The idle fetchers only watch the deadlines while there are flights
+    if (NULL == cache->flights)
+        pthread_cond_broadcast(&cache->wakeup);
+    flight->next = cache->flights;
+    cache->flights = flight;
+    return flight;
+}
+
+// Returns a flight to hedge, with the node to send it to, or to cancel, with
+// kill set, or NULL and sets wait to the time until the next deadline (µs),
+// -1 if none. A flight which cannot be hedged at its deadline, out of budget
+// or without a free node, is never hedged. Called under the cache lock.
+SCacheFlight* SCacheFlightLate(CacheDetails* cache, uint64_t now, SCacheNode** node, int* kill, long long* wait) {
+    *wait = -1;
+    *kill = 0;
+    for (SCacheFlight* flight = cache->flights; flight; flight = flight->next) {
+        if ((flight->expire)&&(!flight->killed)) {
+            if (flight->expire <= now) {
+                flight->killed = 1;
+                *kill = 1;
+                return flight;
+            }
+            if ((*wait < 0)||(flight->expire - now < (uint64_t)*wait))
+                *wait = flight->expire - now;
+        }
+        if (0 == flight->deadline) continue;
+        if (flight->deadline > now) {
+            if ((*wait < 0)||(flight->deadline - now < (uint64_t)*wait))
+                *wait = flight->deadline - now;
+            continue;
+        }
+        flight->deadline = 0;
+        int ejected;
+        if ((cache->stopping)||(cache->hedgetokens < 100)||
+                (NULL == (*node = SCacheRoute(cache, RedisModule_Milliseconds(), flight->nodes[0], 0, &ejected))))
+            continue;
+        cache->hedgetokens -= 100;
+        return flight;
+    }
+    return NULL;
+}
+
+// Releases a reference of a flight, under the cache lock
+void SCacheFlightRelease(SCacheFlight* flight) {
+    if (0 == --flight->running)
+        RedisModule_Free(flight);
+}
+
+// Completes a copy of a flight, under the cache lock. The first copy to
+// complete fills the jobs with its results and returns true, unless it lost
+// its connection while the other copy is still running.
+int SCacheFlightDone(CacheDetails* cache, SCacheFlight* flight, int copy, FetchJob* local, void* conn) {
+    flight->done[copy] = 1;
+    int other = (flight->nodes[1-copy])&&(!flight->done[1-copy]);
+    if ((flight->won)||((NULL == conn)&&(other))) {
+        for (int i = 0; i < flight->count; i++)
+            SCacheResultsetFree(local[i].result);
+        return 0;
+    }
+
+    flight->won = 1;
+    SCacheFlight** prev = &cache->flights;
+    while (*prev != flight)
+        prev = &(*prev)->next;
+    *prev = flight->next;
+    for (int i = 0; i < flight->count; i++) {
+        flight->jobs[i]->result = local[i].result;
+        SCacheTraceStage(flight->jobs[i]->trace, SCACHE_STAGE_QUERY);
+    }
+    return 1;
+}
+
+// Records the latency of a batch of a hedging cache, and recomputes the hedge
+// delay every quarter of the samples. Called under the cache lock.
+int SCacheLatencyCompare(const void* a, const void* b) {
+    uint64_t la = *(const uint64_t*)a;
+    uint64_t lb = *(const uint64_t*)b;
+    return (la > lb) - (la < lb);
+}
+
+void SCacheHedgeSample(CacheDetails* cache, uint64_t elapsed) {
+    cache->latencies[cache->nlatencies++ % SCACHE_HEDGE_SAMPLES] = elapsed;
+    if (cache->nlatencies % (SCACHE_HEDGE_SAMPLES/4)) return;
+
+    uint64_t sorted[SCACHE_HEDGE_SAMPLES];
+    size_t count = (cache->nlatencies < SCACHE_HEDGE_SAMPLES) ? cache->nlatencies : SCACHE_HEDGE_SAMPLES;
+    memcpy(sorted, cache->latencies, count*sizeof(uint64_t));
+    qsort(sorted, count, sizeof(uint64_t), SCacheLatencyCompare);
+    cache->hedgedelay = sorted[count*cache->hedge/100];
+}
+
+// Aborts the query running on target, a busy connection of a node, through
+// an idle connection of the same node or a temporary one
+void SCacheCancel(CacheDetails* cache, SCacheNode* node, void* target) {
+    char err[256];
+    pthread_mutex_lock(&cache->lock);
+    void* conn = node->nidle ? node->idle[--node->nidle] : NULL;
+    if (conn) node->outstanding++;
+    pthread_mutex_unlock(&cache->lock);
+
+    void* temp = conn ? NULL : SCacheConnect(cache, node, 0, err, sizeof(err));
+    if ((conn)||(temp))
+        cache->backend->cancel(conn ? conn : temp, target);
+    if (temp) cache->backend->close(temp);
+
+    if (conn) {
+        pthread_mutex_lock(&cache->lock);
+        node->idle[node->nidle++] = conn;
+        node->outstanding--;
+        pthread_mutex_unlock(&cache->lock);
+    }
+}
+
+// Cancels the running copies of a flight among mask, under the cache lock,
+// released meanwhile. As the cancellation could hit the next query of their
+// connection, the cancelled copies close it when they complete, or leave it
+// parked to the last canceller when they complete first.
+void SCacheFlightCancel(CacheDetails* cache, SCacheFlight* flight, int mask) {
+    void* targets[2] = {NULL, NULL};
+    for (int c = 0; c < 2; c++) {
+        if ((!(mask & (1<<c)))||(NULL == flight->conns[c])||(flight->done[c])||(flight->cancelled[c]))
+            continue;
+        __atomic_store_n(&flight->cancelled[c], 1, __ATOMIC_RELAXED);
+        targets[c] = flight->conns[c];
+    }
+    if ((NULL == targets[0])&&(NULL == targets[1])) return;
+
+    flight->running++;
+    flight->cancelling++;
+    pthread_mutex_unlock(&cache->lock);
+    for (int c = 0; c < 2; c++)
+        if (targets[c])
+            SCacheCancel(cache, flight->nodes[c], targets[c]);
+    pthread_mutex_lock(&cache->lock);
+
+    void* parked[2] = {NULL, NULL};
+    if (0 == --flight->cancelling) {
+        for (int c = 0; c < 2; c++) {
+            if (NULL == (parked[c] = flight->parked[c])) continue;
+            flight->parked[c] = NULL;
+            flight->nodes[c]->outstanding--;
+            flight->nodes[c]->opened--;
+        }
+    }
+    SCacheFlightRelease(flight);
+    if ((parked[0])||(parked[1])) {
+        pthread_mutex_unlock(&cache->lock);
+        for (int c = 0; c < 2; c++)
+            if (parked[c]) cache->backend->close(parked[c]);
+        pthread_mutex_lock(&cache->lock);
+    }
+}
+
+// Accounts the outcome of a batch in the circuit breaker of its cache, under
+// the cache lock. The circuit opens after breaker consecutive failed batches,
+// for SCACHE_BREAKER_DELAY, then lets a single probe miss through : it opens
+// again if the probe fails, and closes on the first successful batch.
+void SCacheBreakerDone(CacheDetails* cache, int failed, long long now) {
+    if (0 == cache->breaker) return;
+    if (!failed) {
+        if (cache->breakeropen)
+            RedisModule_Log(NULL, "notice", "Cache %s closes its circuit breaker", cache->cachename);
+        cache->failures = 0;
+        cache->breakeropen = 0;
+        cache->probing = 0;
+        return;
+    }
+    if ((++cache->failures >= cache->breaker)&&((0 == cache->breakeropen)||(cache->probing))) {
+        if (0 == cache->breakeropen)
+            RedisModule_Log(NULL, "warning", "Cache %s opens its circuit breaker after %u failed batches",
+                    cache->cachename, cache->failures);
+        cache->breakeropen = now + SCACHE_BREAKER_DELAY;
+        cache->probing = 0;
+    }
+}
+
+// Admits the misses of a command, or returns the error of the misses to shed :
+// the queued misses are limited to the cache MAXPENDING, and the open circuit
+// breaker only lets a probe through. Inline misses never probe.
+const char* SCacheAdmit(CacheDetails* cache, int misses, int queued) {
+    const char* error = NULL;
+    long long now = RedisModule_Milliseconds();
+    pthread_mutex_lock(&cache->lock);
+    if ((queued)&&(cache->maxpending)&&(cache->pending + misses > cache->maxpending))
+        error = "OVERLOADED too many misses pending on the cache";
+    else if ((cache->breakeropen)&&((!queued)||(cache->breakeropen > now)||(cache->probing)))
+        error = "CIRCUITOPEN the cache database is failing";
+    else if (cache->breakeropen)
+        cache->probing = 1;
+    pthread_mutex_unlock(&cache->lock);
+    return error;
+}
+
+// Completes a job, the last one of its request unblocks its client. Called
+// under the cache lock.
+void SCacheJobDone(CacheDetails* cache, FetchJob* job) {
+    FetchRequest* request = job->request;
+    cache->pending--;
+    if (0 == --request->pending) {
+        if (request->warm)
+            SCacheWarmDone(request);
+        else if (request->bc)
+            RedisModule_UnblockClient(request->bc, request);
+        else
+            SCacheRefreshDone(request);
+    }
+}
+
+/* Fetcher thread, executes the queued misses until the cache is deleted.
+ * Misses already queued are batched together, up to the cache batch size, and
+ * routed to the primary or a replica. Each fetcher opens one connection at
+ * startup, so that all the connections of all the caches are established in
+ * parallel, the others are opened on demand. The first fetcher also opens the
+ * control connection, retried in the background every SCACHE_RECONNECT_DELAY
+ * while the database is not reachable. The idle fetchers hedge the late
+ * batches, and cancel the batches which outlived their clients. */
+void *SCacheFetcher_ThreadMain(void *arg) {
+    void **targ = arg;
+    CacheDetails *cache = targ[0];
+    uint16_t index = (uintptr_t)targ[1];
+    RedisModule_Free(targ);
+    FetchJob* batch[SCACHE_MAX_BATCH];
+    FetchJob local[SCACHE_MAX_BATCH];
+    FetchJob* copies[SCACHE_MAX_BATCH];
+    unsigned int flags = (cache->batchsize > 1) ? SCACHE_CONNECT_MULTI_STATEMENTS : 0;
+    char err[256] = "";
+
+    if (0 == index)
+        SCacheControlConnect(cache, err, sizeof(err));
+    long long lastconnect = RedisModule_Milliseconds();
+    SCacheNode* node = &cache->nodes[index % cache->nnodes];
+    pthread_mutex_lock(&cache->lock);
+    if (node->opened < cache->poolsize) {
+        node->opened++;
+        node->outstanding++;
+        pthread_mutex_unlock(&cache->lock);
+        void* conn = SCacheConnect(cache, node, flags, err, sizeof(err));
+        pthread_mutex_lock(&cache->lock);
+        SCacheNodeDone(cache, node, conn, 0, RedisModule_Milliseconds());
+    }
+
+    while (1) {
+        int ejected = 0;
+        int kill = 0;
+        SCacheFlight* flight = NULL;
+        node = NULL;
+        while ((!cache->stopping)&&((NULL == cache->queuehead)||
+                    ((NULL == (node = SCacheRoute(cache, RedisModule_Milliseconds(), NULL,
+                                cache->queuehead->bypass, &ejected)))&&(!ejected)))) {
+            long long wait = -1;
+            if ((cache->flights)&&(flight = SCacheFlightLate(cache, SCacheUsTime(), &node, &kill, &wait)))
+                break;
+            if ((index)||(cache->dbhandle)) {
+                if (wait < 0) {
+                    pthread_cond_wait(&cache->wakeup, &cache->lock);
+                } else {
+                    struct timespec deadline;
+                    SCacheDeadline(&deadline, wait);
+                    pthread_cond_timedwait(&cache->wakeup, &cache->lock, &deadline);
+                }
+                continue;
+            }
+            // The missing control connection is retried in the background
+            struct timespec deadline;
+            long long delay = lastconnect + SCACHE_RECONNECT_DELAY - RedisModule_Milliseconds();
+            delay = (delay > 0) ? delay*1000 : 0;
+            SCacheDeadline(&deadline, ((wait >= 0)&&(wait < delay)) ? wait : delay);
+            if ((ETIMEDOUT == pthread_cond_timedwait(&cache->wakeup, &cache->lock, &deadline))&&
+                    (RedisModule_Milliseconds() >= lastconnect + SCACHE_RECONNECT_DELAY)) {
+                pthread_mutex_unlock(&cache->lock);
+                SCacheControlConnect(cache, err, sizeof(err));
+                lastconnect = RedisModule_Milliseconds();
+                pthread_mutex_lock(&cache->lock);
+            }
+        }
+
+        // Nobody waits for the batch anymore, the database stops working on it
+        if (kill) {
+            flight->running++;
+            SCacheFlightCancel(cache, flight, 3);
+            SCacheFlightRelease(flight);
+            continue;
+        }
+
+        int count = 0;
+        int copy = 0;
+        long long deadline = 0;
+        if (flight) {
+            // Hedges a late batch
+            copy = 1;
+            count = flight->count;
+            flight->nodes[1] = node;
+            flight->running++;
+            node->hedges++;
+        } else {
+            if (NULL == cache->queuehead) break;
+            if ((NULL == node)&&(!ejected)) {
+                // Stopping : the fetchers of the busy nodes drain the queue
+                node = SCacheRoute(cache, RedisModule_Milliseconds(), NULL, cache->queuehead->bypass, &ejected);
+                if ((NULL == node)&&(!ejected)) break;
+            }
+
+            // Waits a little for more misses to fill the batch
+            if ((node)&&(cache->batchsize > 1)&&(cache->batchwait)&&(cache->queued < cache->batchsize)) {
+                struct timespec deadline;
+                SCacheDeadline(&deadline, cache->batchwait);
+                while ((cache->queuehead)&&(cache->queued < cache->batchsize)&&(!cache->stopping)&&
+                        (ETIMEDOUT != pthread_cond_timedwait(&cache->wakeup, &cache->lock, &deadline)))
+                    ;
+                if (NULL == cache->queuehead) continue;
+            }
+
+            // Dequeues the first job, and the following batchable ones with
+            // it. The jobs whose client gave up are dropped. The uncacheable
+            // queries run alone, they may write.
+            long long now = RedisModule_Milliseconds();
+            while ((cache->queuehead)&&(count < cache->batchsize)) {
+                FetchJob* job = cache->queuehead;
+                long long jobdeadline = job->request->deadline;
+                int expired = (jobdeadline)&&(jobdeadline <= now);
+                if ((!expired)&&(count)&&((batch[0]->bypass)||(job->bypass)||
+                            (!SCacheBatchable(batch[0]->query, batch[0]->len))||
+                            (!SCacheBatchable(job->query, job->len))))
+                    break;
+                cache->queuehead = job->next;
+                cache->queued--;
+                if (expired) {
+                    job->result = SCacheResultsetFailed(SCACHE_TIMEOUT_ERROR);
+                    SCacheJobDone(cache, job);
+                    continue;
+                }
+                // The batch is cancelled once all its clients gave up
+                deadline = ((0 == count)||((deadline)&&(jobdeadline > deadline))) ? jobdeadline :
+                    (jobdeadline ? deadline : 0);
+                batch[count++] = job;
+            }
+            if (NULL == cache->queuehead) cache->queuetail = NULL;
+            if (0 == count) continue;
+        }
+
+        // Takes an idle connection of the node, or opens a new one
+        void* conn = NULL;
+        if (node) {
+            node->outstanding++;
+            if (node->nidle)
+                conn = node->idle[--node->nidle];
+            else
+                node->opened++;
+        }
+        if (flight) flight->conns[1] = conn;
+        pthread_mutex_unlock(&cache->lock);
+
+        if (!flight)
+            for (int i = 0; i < count; i++)
+                SCacheTraceStage(batch[i]->trace, SCACHE_STAGE_QUEUE);
+        if ((node)&&(NULL == conn)) {
+            conn = SCacheConnect(cache, node, flags, err, sizeof(err));
+            if (flight) {
+                pthread_mutex_lock(&cache->lock);
+                flight->conns[1] = conn;
+                pthread_mutex_unlock(&cache->lock);
+            }
+        }
+
+        // The batches which may be hedged or cancelled are fetched from
+        // copies of the jobs
+        FetchJob** jobs = batch;
+        int hedge = (cache->hedge)&&(cache->hedgedelay)&&(cache->nnodes > 1)&&
+            ((flight)||(!batch[0]->bypass));
+        if ((!deadline)||(NULL == cache->backend->cancel))
+            deadline = 0;
+        if ((!flight)&&((hedge)||(deadline))&&(conn)) {
+            pthread_mutex_lock(&cache->lock);
+            flight = SCacheFlightStart(cache, batch, count, node, conn, hedge, deadline);
+            pthread_mutex_unlock(&cache->lock);
+        }
+        if (flight) {
+            for (int i = 0; i < count; i++) {
+                memset(&local[i], 0, sizeof(FetchJob));
+                local[i].query = flight->queries[i].ptr;
+                local[i].len = flight->queries[i].len;
+                copies[i] = &local[i];
+            }
+            jobs = copies;
+        }
+
+        uint64_t start = SCacheUsTime();
+        if (conn) {
+            SCacheFetchBatch(cache->backend, conn, jobs, count, flight ? &flight->cancelled[copy] : NULL);
+            if (SCacheConnLost(cache, conn, jobs, count)) {
+                cache->backend->close(conn);
+                conn = NULL;
+            }
+        } else {
+            char msg[300];
+            if (node)
+                snprintf(msg, sizeof(msg), "ERR cannot connect to DB: %s", err);
+            else
+                snprintf(msg, sizeof(msg), "ERR all the DB nodes are ejected");
+            for (int i = 0; i < count; i++)
+                jobs[i]->result = SCacheResultsetFailed(msg);
+        }
+        uint64_t elapsed = SCacheUsTime() - start;
+
+        pthread_mutex_lock(&cache->lock);
+        // Each batch earns the budget of hedgebudget/100 hedge
+        if ((cache->hedge)&&(0 == copy)) {
+            cache->hedgetokens += cache->hedgebudget;
+            if (cache->hedgetokens > SCACHE_HEDGE_BURST*100)
+                cache->hedgetokens = SCACHE_HEDGE_BURST*100;
+        }
+        int won = 1;
+        int killed = 0;
+        void* closing = NULL;
+        if (flight) {
+            won = SCacheFlightDone(cache, flight, copy, local, conn);
+            killed = flight->killed;
+            jobs = flight->jobs;
+            if (!won) count = 0;
+            if ((flight->cancelled[copy])&&(conn)) {
+                // Not pooled, closed here or by the canceller
+                if (flight->cancelling) {
+                    flight->parked[copy] = conn;
+                } else {
+                    node->outstanding--;
+                    node->opened--;
+                    closing = conn;
+                }
+                node = NULL;
+            }
+        }
+        if ((cache->hedge)&&(node)&&(conn))
+            SCacheHedgeSample(cache, elapsed);
+        if (node)
+            SCacheNodeDone(cache, node, conn, elapsed, RedisModule_Milliseconds());
+        if (count)
+            SCacheBreakerDone(cache, (NULL == conn)||(killed), RedisModule_Milliseconds());
+
+        for (int i = 0; i < count; i++)
+            SCacheJobDone(cache, jobs[i]);
+
+        // The winner cancels the other copy
+        if ((won)&&(flight)&&(flight->nodes[1-copy])&&(cache->backend->cancel))
+            SCacheFlightCancel(cache, flight, 1<<(1-copy));
+        if (flight)
+            SCacheFlightRelease(flight);
+        if (closing) {
+            pthread_mutex_unlock(&cache->lock);
+            cache->backend->close(closing);
+            pthread_mutex_lock(&cache->lock);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
+
+// Starts the fetcher threads of a cache, poolsize per node
+int SCacheStartFetchers(CacheDetails* cache) {
+    SCacheNodesInit(cache);
+    cache->nfetchers = cache->poolsize*cache->nnodes;
+    cache->fetchers = RedisModule_Calloc(cache->nfetchers, sizeof(pthread_t));
+    for (uint16_t i = 0; i < cache->nfetchers; i++) {
+        void **targ = RedisModule_Alloc(sizeof(void*)*2);
+        targ[0] = cache;
+        targ[1] = (void*)(uintptr_t)i;
+        if (pthread_create(&cache->fetchers[i],NULL,SCacheFetcher_ThreadMain,targ) != 0) {
+            RedisModule_Free(targ);
+            cache->nfetchers = i;
+            return REDISMODULE_ERR;
+        }
+    }
+    return REDISMODULE_OK;
+}
+
+// Stops the fetcher threads, the queued misses fail at once. The batches
+// already running complete, the threads are joined by SCacheStopWait.
+void SCacheStopFetchers(CacheDetails* cache) {
+    pthread_mutex_lock(&cache->lock);
+    cache->stopping = 1;
+    while (cache->queuehead) {
+        FetchJob* job = cache->queuehead;
+        cache->queuehead = job->next;
+        cache->queued--;
+        job->result = SCacheResultsetFailed(SCACHE_DELETED_ERROR);
+        SCacheJobDone(cache, job);
+    }
+    cache->queuetail = NULL;
+    pthread_cond_broadcast(&cache->wakeup);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Joins the stopped fetcher threads and closes the connections, which may
+// block until the running batches complete or the connects time out
+void SCacheStopWait(CacheDetails* cache) {
+    for (uint16_t i = 0; i < cache->nfetchers; i++)
+        pthread_join(cache->fetchers[i], NULL);
+    for (uint16_t i = 0; i < cache->nnodes; i++) {
+        SCacheNode* node = &cache->nodes[i];
+        while (node->nidle)
+            cache->backend->close(node->idle[--node->nidle]);
+    }
+    if (cache->dbhandle) cache->backend->close(cache->dbhandle);
+    cache->dbhandle = NULL;
+}
+
+/* Reaper thread of a dropped cache, waits for its fetchers off the main
+ * thread then releases it under the GIL */
+void *SCacheDrop_ThreadMain(void *arg) {
+    CacheDetails* cache = arg;
+    SCacheStopWait(cache);
+    RedisModuleCtx* ctx = RedisModule_GetThreadSafeContext(NULL);
+    RedisModule_ThreadSafeContextLock(ctx);
+    SCacheRelease(cache);
+    RedisModule_ThreadSafeContextUnlock(ctx);
+    RedisModule_FreeThreadSafeContext(ctx);
+    return NULL;
+}
+
+// Stops an unlinked cache without blocking : its resultsets are swept as those
+// of a flushed cache, its queued misses fail, its fetchers are joined by a
+// reaper thread. Blocked clients still waiting for it keep it alive.
+void SCacheDrop(CacheDetails* cache) {
+    SCacheEndGeneration(cache);
+    SCacheStopFetchers(cache);
+    pthread_t tid;
+    if (pthread_create(&tid,NULL,SCacheDrop_ThreadMain,cache) != 0) {
+        RedisModule_Log(NULL, "warning", "Cache %s cannot start reaper thread", cache->cachename);
+        SCacheStopWait(cache);
+        SCacheRelease(cache);
+        return;
+    }
+    pthread_detach(tid);
+}
+
+// Queues the misses of a request to the cache fetchers. Fails if the cache is
+// being deleted.
+int SCacheEnqueue(CacheDetails* cache, FetchRequest* request) {
+    pthread_mutex_lock(&cache->lock);
+    if (cache->stopping) {
+        pthread_mutex_unlock(&cache->lock);
+        return REDISMODULE_ERR;
+    }
+    for (int i = 0; i < request->count; i++) {
+        FetchJob* job = &request->jobs[i];
+        if (job->result) continue;
+        job->next = NULL;
+        if (cache->queuetail)
+            cache->queuetail->next = job;
+        else
+            cache->queuehead = job;
+        cache->queuetail = job;
+        cache->queued++;
+        cache->pending++;
+    }
+    pthread_cond_broadcast(&cache->wakeup);
+    pthread_mutex_unlock(&cache->lock);
+    return REDISMODULE_OK;
+}
+
+// Replies to a fetch request and moves the fetched resultsets in the cache.
+// Main thread only.
+void SCacheFetchReply(RedisModuleCtx *ctx, FetchRequest* request) {
+    if (request->multi)
+        RedisModule_ReplyWithArray(ctx, request->count);
+    for (int i = 0; i < request->count; i++) {
+        FetchJob* job = &request->jobs[i];
+        SCacheTraceStage(job->trace, SCACHE_STAGE_UNBLOCK);
+        RedisModule_ReplyWithResultset(ctx, job->result, request->kind);
+        SCacheTraceStage(job->trace, SCACHE_STAGE_REPLY);
+    }
+
+    for (int i = 0; i < request->count; i++) {
+        FetchJob* job = &request->jobs[i];
+        if ((job->result->hit)||(job->result->error)) continue;
+        SCacheSlowlogMiss(request->cache->cachename, job->query, job->len,
+                job->result->dbtime, job->result->nrows, job->result->bytes);
+        if (!job->bypass)
+            SCacheResultsetInsert(ctx, request->cache, job);
+        SCacheTraceStage(job->trace, SCACHE_STAGE_INSERT);
+        SCacheTraceEnd(job->trace, request->cache->cachename, job->query, job->len);
+    }
+}
+
+void SCacheFetchRequestFree(FetchRequest* request) {
+    for (int i = 0; i < request->count; i++) {
+        RedisModule_Free(request->jobs[i].query);
+        RedisModule_Free(request->jobs[i].merge);
+        RedisModule_Free(request->jobs[i].watermark);
+        SCacheResultsetFree(request->jobs[i].result);
+    }
+    // Warming fills share the reference of their warming
+    if (NULL == request->warm)
+        SCacheRelease(request->cache);
+    RedisModule_Free(request);
+}
+
+// Queues the background refill of a hit in the refresh window or the grace
+// delay of its cache, unless its misses are shed, an incremental one if the
+// entry allows it. Main thread only.
+void SCacheRefreshStart(RedisModuleCtx *ctx, CacheDetails* cache, const char* query, size_t len,
+        SCacheResultset* entry) {
+    if (SCacheAdmit(cache, 1, 1)) return;
+    FetchRequest* request = RedisModule_Calloc(1, sizeof(FetchRequest)+sizeof(FetchJob));
+    request->cache = cache;
+    cache->refcount++;
+    request->count = 1;
+    request->pending = 1;
+    request->db = RedisModule_GetSelectedDb(ctx);
+    request->generation = cache->generation;
+    request->deadline = cache->timeout ? RedisModule_Milliseconds() + cache->timeout : 0;
+    FetchJob* job = &request->jobs[0];
+    job->request = request;
+    job->query = RedisModule_Alloc(len+1);
+    memcpy(job->query, query, len);
+    job->query[len] = 0;
+    job->len = len;
+    size_t deltalen;
+    char* delta = SCacheDeltaQuery(cache, entry, query, len, &deltalen);
+    if (delta) {
+        job->merge = job->query;
+        job->mergelen = len;
+        job->query = delta;
+        job->len = deltalen;
+        job->watermark = RedisModule_Strdup(entry->watermark);
+    }
+    if (REDISMODULE_OK != SCacheEnqueue(cache, request))
+        SCacheFetchRequestFree(request);
+}
+
+// Inserts the completed background refills in the keyspace, the incremental
+// ones merged in their entry. A failed refill leaves its entry to expire, and
+// lets a later hit retry. Main thread only.
+void SCacheRefreshCollect(RedisModuleCtx *ctx) {
+    pthread_mutex_lock(&RefreshLock);
+    FetchRequest* done = RefreshDone;
+    RefreshDone = NULL;
+    pthread_mutex_unlock(&RefreshLock);
+    if (NULL == done) return;
+
+    int db = RedisModule_GetSelectedDb(ctx);
+    while (done) {
+        FetchRequest* request = done;
+        FetchJob* job = &request->jobs[0];
+        done = request->next;
+        if (REDISMODULE_OK == RedisModule_SelectDb(ctx, request->db)) {
+            if (NULL == job->result->error)
+                SCacheSlowlogMiss(request->cache->cachename, job->merge ? job->merge : job->query,
+                        job->merge ? job->mergelen : job->len,
+                        job->result->dbtime, job->result->nrows, job->result->bytes);
+            if (job->merge)
+                SCacheDeltaApply(ctx, request->cache, job);
+            if (NULL == job->result->error) {
+                SCacheResultsetInsert(ctx, request->cache, job);
+            } else {
+                RedisModuleString* keyname = SCacheKey(ctx, request->cache, job->query, job->len);
+                RedisModuleKey* key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ);
+                if (RedisModule_ModuleTypeGetType(key) == SCacheEntryType)
+                    ((SCacheResultset*)RedisModule_ModuleTypeGetValue(key))->refreshing = 0;
+                RedisModule_CloseKey(key);
+                RedisModule_FreeString(ctx, keyname);
+            }
+        }
+        SCacheFetchRequestFree(request);
+    }
+    RedisModule_SelectDb(ctx, db);
+}
+
+// Load of a mirror by a loader thread, with copies of its definition
+typedef struct SCacheMirrorLoad_s {
+    CacheDetails* cache;
+    SCacheMirror* mirror;
+    char* query;
+    uint32_t nindexed;
+    char** indexed;
+} SCacheMirrorLoad;
+
+void SCacheMirrorLoadFree(SCacheMirrorLoad* load) {
+    for (uint32_t i = 0; i < load->nindexed; i++)
+        RedisModule_Free(load->indexed[i]);
+    RedisModule_Free(load->indexed);
+    RedisModule_Free(load->query);
+    RedisModule_Free(load);
+}
+
+// Installs a loaded copy of a table, or records the load error, then
+// schedules the next load : after the interval of the mirror, or retried
+// a few seconds later on failure, unless it was requested meanwhile.
+// Under the GIL.
+void SCacheMirrorLoaded(SCacheMirrorLoad* load, SCacheMirrorData* data, const char* err) {
+    SCacheMirror* mirror = load->mirror;
+    CacheDetails* cache = load->cache;
+    long long now = RedisModule_Milliseconds();
+    mirror->loading = 0;
+    if (mirror->dropped) {
+        SCacheMirrorDataFree(data);
+        SCacheMirrorFree(mirror);
+    } else if (data) {
+        SCacheMirrorDataFree(mirror->data);
+        mirror->data = data;
+        RedisModule_Free(mirror->error);
+        mirror->error = NULL;
+        if (mirror->due)
+            mirror->due = mirror->interval ? now + (long long)mirror->interval*1000 : LLONG_MAX;
+        RedisModule_Log(NULL, "notice", "Cache %s mirrored %s: %u rows, %llu bytes", cache->cachename,
+                mirror->table, data->nrows, (unsigned long long)data->bytes);
+    } else {
+        RedisModule_Free(mirror->error);
+        mirror->error = RedisModule_Strdup(err);
+        if (mirror->due)
+            mirror->due = now + SCACHE_MIRROR_RETRY;
+        RedisModule_Log(NULL, "warning", "Cache %s cannot mirror %s: %s", cache->cachename,
+                mirror->table, err);
+    }
+    SCacheMirrorLoadFree(load);
+    SCacheRelease(cache);
+}
+
+void *SCacheMirror_ThreadMain(void *arg) {
+    SCacheMirrorLoad* load = arg;
+    CacheDetails* cache = load->cache;
+    char err[256];
+    char msg[300];
+    SCacheMirrorData* data = NULL;
+    void* conn = SCacheConnect(cache, NULL, 0, err, sizeof(err));
+    if (NULL == conn) {
+        snprintf(msg, sizeof(msg), "ERR cannot connect to DB: %s", err);
+    } else {
+        data = SCacheMirrorFetch(cache->backend, conn, load->query, load->indexed, load->nindexed,
+                msg, sizeof(msg));
+        cache->backend->close(conn);
+    }
+
+    RedisModuleCtx* ctx = RedisModule_GetThreadSafeContext(NULL);
+    RedisModule_ThreadSafeContextLock(ctx);
+    SCacheMirrorLoaded(load, data, msg);
+    RedisModule_ThreadSafeContextUnlock(ctx);
+    RedisModule_FreeThreadSafeContext(ctx);
+    return NULL;
+}
+
+// Starts a loader thread fetching a mirrored table. Main thread only.
+void SCacheMirrorStart(CacheDetails* cache, SCacheMirror* mirror, long long now) {
+    SCacheMirrorLoad* load = RedisModule_Calloc(1, sizeof(SCacheMirrorLoad));
+    load->cache = cache;
+    load->mirror = mirror;
+    size_t len = strlen(mirror->table)+15;
+    load->query = RedisModule_Alloc(len);
+    snprintf(load->query, len, "SELECT * FROM %s", mirror->table);
+    load->nindexed = mirror->nindexed;
+    load->indexed = RedisModule_Alloc(sizeof(char*)*(mirror->nindexed ? mirror->nindexed : 1));
+    for (uint32_t i = 0; i < mirror->nindexed; i++)
+        load->indexed[i] = RedisModule_Strdup(mirror->indexed[i]);
+
+    // A new request while loading sets due back to 0
+    cache->refcount++;
+    mirror->loading = 1;
+    mirror->due = LLONG_MAX;
+    pthread_t tid;
+    if (pthread_create(&tid,NULL,SCacheMirror_ThreadMain,load) != 0) {
+        RedisModule_Log(NULL, "warning", "Cache %s cannot start mirror thread", cache->cachename);
+        mirror->loading = 0;
+        mirror->due = now + SCACHE_MIRROR_RETRY;
+        SCacheMirrorLoadFree(load);
+        cache->refcount--;
+        return;
+    }
+    pthread_detach(tid);
+}
+
+// Starts the loads of the mirrors which are due, from the module timer
+void SCacheMirrorsTick(void) {
+    long long now = RedisModule_Milliseconds();
+    for (CacheDetails* cache = CacheList; cache; cache = cache->next)
+        for (SCacheMirror* mirror = cache->mirrors; mirror; mirror = mirror->next)
+            if ((!mirror->loading)&&(mirror->due <= now))
+                SCacheMirrorStart(cache, mirror, now);
+}
+
+// Returns the mirror of a table, NULL if it is not mirrored
+SCacheMirror* SCacheMirrorGet(CacheDetails* cache, const char* table) {
+    SCacheMirror* mirror = cache->mirrors;
+    while ((mirror)&&(strcmp(table, mirror->table)))
+        mirror = mirror->next;
+    return mirror;
+}
+
+// Adds a mirror definition at the end of the mirrors of a cache, to be loaded
+// as soon as possible
+SCacheMirror* SCacheMirrorAdd(CacheDetails* cache, const char* table) {
+    SCacheMirror* mirror = RedisModule_Calloc(1, sizeof(SCacheMirror));
+    mirror->table = RedisModule_Strdup(table);
+    SCacheMirror** last = &cache->mirrors;
+    while (*last)
+        last = &(*last)->next;
+    *last = mirror;
+    return mirror;
+}
+
+/* Timer callback of the entries expiry : evicts the entries due, inserts the
+ * background refills, sweeps the entries without eviction timer and starts
+ * the mirror loads due */
+void SCacheExpire_Timer(RedisModuleCtx *ctx, void *data) {
+    REDISMODULE_NOT_USED(data);
+    SCacheWheelAdvance(ctx);
+    SCacheRefreshCollect(ctx);
+    SCacheSweep(ctx);
+    SCacheMirrorsTick();
+    RedisModule_CreateTimer(ctx, SCACHE_WHEEL_TICK, SCacheExpire_Timer, NULL);
+}
+
+/* Reply callback for blocking commands SCACHE.GETVALUE/GETMETA/MGET */
+int SCacheFetch_Reply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+    SCacheFetchReply(ctx, RedisModule_GetBlockedClientPrivateData(ctx));
+    return REDISMODULE_OK;
+}
+
+/* The client deadline expired, its misses are dropped or cancelled by the
+ * fetchers, which unblock it anyway */
+int SCacheFetch_Timeout(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+    return RedisModule_ReplyWithError(ctx, SCACHE_TIMEOUT_ERROR);
+}
+
+/* Private data freeing callback for SCACHE.GETVALUE/GETMETA/MGET commands. */
+void SCacheFetch_FreeData(RedisModuleCtx *ctx, void *privdata) {
+    REDISMODULE_NOT_USED(ctx);
+    SCacheFetchRequestFree(privdata);
+}
+
+// Cache warming file entries, <cachename> <query> lines loaded with the module
+typedef struct WarmEntry_s {
+    char* cachename;
+    char* query;
+    size_t len;
+    struct WarmEntry_s* next;
+} WarmEntry;
+
+WarmEntry* WarmFileList = NULL;
+uint32_t DefaultWarmRate = 100; // Warming fills per second without RATE
+
+// Main thread or thread safe context locked
+void SCacheWarmFree(WarmTask* warm) {
+    for (size_t i = 0; i < warm->count; i++)
+        RedisModule_Free(warm->queries[i].ptr);
+    RedisModule_Free(warm->queries);
+    RedisModule_Free(warm->driver);
+    RedisModule_Free(warm->template);
+    RedisModule_Free(warm->error);
+    pthread_mutex_destroy(&warm->lock);
+    pthread_cond_destroy(&warm->wakeup);
+    SCacheRelease(warm->cache);
+    RedisModule_Free(warm);
+}
+
+// Main thread only
+WarmTask* SCacheWarmCreate(CacheDetails* cache, uint32_t rate) {
+    WarmTask* warm = RedisModule_Calloc(1, sizeof(WarmTask));
+    warm->cache = cache;
+    cache->refcount++;
+    warm->rate = rate;
+    pthread_mutex_init(&warm->lock, NULL);
+    pthread_cond_init(&warm->wakeup, NULL);
+    return warm;
+}
+
+void SCacheWarmAddQuery(WarmTask* warm, const char* query, size_t len) {
+    if (0 == (warm->count & (warm->count+1)))
+        warm->queries = RedisModule_Realloc(warm->queries, sizeof(SCacheBuffer)*(warm->count+1)*2);
+    SCacheBuffer* buffer = &warm->queries[warm->count++];
+    buffer->len = len;
+    buffer->ptr = RedisModule_Alloc(len+1);
+    memcpy(buffer->ptr, query, len);
+    buffer->ptr[len] = 0;
+}
+
+// Builds a query from the warming template, replacing $1..$9 with the driving
+// query columns. Single quotes are doubled, so values can be quoted in the
+// template ('$1').
+void SCacheWarmAddRow(WarmTask* warm, const char** row, unsigned long* lengths, unsigned int num_fields) {
+    size_t len = 0;
+    for (const char* p = warm->template; *p; p++) {
+        unsigned int col = p[1]-'1';
+        if (('$' == p[0])&&(p[1] >= '1')&&(p[1] <= '9')&&(col < num_fields)) {
+            len += row[col] ? lengths[col]*2 : 4;
+            p++;
+        } else
+            len++;
+    }
+
+    char* query = RedisModule_Alloc(len+1);
+    char* q = query;
+    for (const char* p = warm->template; *p; p++) {
+        unsigned int col = p[1]-'1';
+        if (('$' == p[0])&&(p[1] >= '1')&&(p[1] <= '9')&&(col < num_fields)) {
+            if (NULL == row[col]) {
+                memcpy(q, "NULL", 4);
+                q += 4;
+            } else {
+                for (unsigned long i = 0; i < lengths[col]; i++) {
+                    if ('\'' == row[col][i]) *q++ = '\'';
+                    *q++ = row[col][i];
+                }
+            }
+            p++;
+        } else
+            *q++ = *p;
+    }
+    SCacheWarmAddQuery(warm, query, q-query);
+    RedisModule_Free(query);
+}
+
+// Runs the driving query on a dedicated connection to build the queries list
+int SCacheWarmRunDriver(WarmTask* warm) {
+    CacheDetails* cache = warm->cache;
+    const SCacheBackend* backend = cache->backend;
+    char err[256];
+    void* conn = SCacheConnect(cache, NULL, 0, err, sizeof(err));
+    if (NULL == conn) {
+        char msg[300];
+        snprintf(msg, sizeof(msg), "ERR cannot connect to DB: %s", err);
+        warm->error = RedisModule_Strdup(msg);
+        return REDISMODULE_ERR;
+    }
+
+    void* res = NULL;
+    if (0 == backend->query(conn, warm->driver, strlen(warm->driver)))
+        res = backend->store_result(conn);
+    if (NULL == res) {
+        warm->error = RedisModule_Strdup(backend->error(conn));
+        backend->close(conn);
+        return REDISMODULE_ERR;
+    }
+    unsigned int num_fields = backend->num_fields(res);
+    const char** row;
+    unsigned long *lengths;
+    while (NULL != (row = backend->fetch_row(res, &lengths)))
+        SCacheWarmAddRow(warm, row, lengths, num_fields);
+    backend->free_result(res);
+    backend->close(conn);
+    return REDISMODULE_OK;
+}
+
+// Inserts the completed fills in the keyspace, after waiting for the number
+// of outstanding fills to drop to max
+void SCacheWarmCollect(WarmTask* warm, uint32_t max) {
+    pthread_mutex_lock(&warm->lock);
+    while (warm->outstanding > max)
+        pthread_cond_wait(&warm->wakeup, &warm->lock);
+    FetchRequest* done = warm->done;
+    warm->done = NULL;
+    pthread_mutex_unlock(&warm->lock);
+    if (NULL == done) return;
+
+    RedisModule_ThreadSafeContextLock(warm->ctx);
+    while (done) {
+        FetchRequest* request = done;
+        FetchJob* job = &request->jobs[0];
+        done = request->next;
+        if (job->result->error) {
+            warm->errors++;
+        } else {
+            SCacheSlowlogMiss(warm->cache->cachename, job->query, job->len,
+                    job->result->dbtime, job->result->nrows, job->result->bytes);
+            SCacheResultsetInsert(warm->ctx, warm->cache, job);
+            warm->filled++;
+        }
+        SCacheFetchRequestFree(request);
+    }
+    RedisModule_ThreadSafeContextUnlock(warm->ctx);
+}
+
+/* The thread entry point of a cache warming. It feeds the cache fetch queue at
+ * the warming rate, with a bounded number of outstanding fills so that the
+ * client misses are not delayed, and inserts the fills in the keyspace. */
+void *SCacheWarm_ThreadMain(void *arg) {
+    WarmTask* warm = arg;
+    CacheDetails* cache = warm->cache;
+    uint32_t window = cache->nfetchers*cache->batchsize;
+
+    if ((NULL == warm->driver)||(REDISMODULE_OK == SCacheWarmRunDriver(warm))) {
+        uint64_t start = SCacheUsTime();
+        for (size_t i = 0; i < warm->count; i++) {
+            if (warm->rate) {
+                uint64_t due = start + i*1000000/warm->rate;
+                uint64_t now = SCacheUsTime();
+                if (due > now) {
+                    struct timespec delay = { (due-now)/1000000, ((due-now)%1000000)*1000 };
+                    nanosleep(&delay, NULL);
+                }
+            }
+            SCacheWarmCollect(warm, window-1);
+
+            // The query is moved to the fill
+            FetchRequest* request = RedisModule_Calloc(1, sizeof(FetchRequest)+sizeof(FetchJob));
+            request->cache = cache;
+            request->warm = warm;
+            request->generation = __atomic_load_n(&cache->generation, __ATOMIC_RELAXED);
+            request->kind = SCACHE_REPLY_VALUE;
+            request->count = 1;
+            request->pending = 1;
+            request->jobs[0].request = request;
+            request->jobs[0].query = warm->queries[i].ptr;
+            request->jobs[0].len = warm->queries[i].len;
+            warm->queries[i].ptr = NULL;
+
+            pthread_mutex_lock(&warm->lock);
+            warm->outstanding++;
+            pthread_mutex_unlock(&warm->lock);
+            if (REDISMODULE_OK != SCacheEnqueue(cache, request)) {
+                // The cache is being deleted
+                pthread_mutex_lock(&warm->lock);
+                warm->outstanding--;
+                pthread_mutex_unlock(&warm->lock);
+                SCacheFetchRequestFree(request);
+                break;
+            }
+        }
+        SCacheWarmCollect(warm, 0);
+    }
+
+    RedisModuleCtx* ctx = warm->ctx;
+    if (warm->bc) {
+        RedisModule_FreeThreadSafeContext(ctx);
+        RedisModule_UnblockClient(warm->bc, warm);
+    } else {
+        RedisModule_ThreadSafeContextLock(ctx);
+        RedisModule_Log(ctx, warm->error ? "warning" : "notice",
+                "Cache %s warmed: %llu filled, %llu errors%s%s", cache->cachename,
+                (unsigned long long)warm->filled, (unsigned long long)warm->errors,
+                warm->error ? ", " : "", warm->error ? warm->error : "");
+        SCacheWarmFree(warm);
+        RedisModule_ThreadSafeContextUnlock(ctx);
+        RedisModule_FreeThreadSafeContext(ctx);
+    }
+    return NULL;
+}
+
+int SCacheWarmStart(WarmTask* warm) {
+    pthread_t tid;
+    if (pthread_create(&tid,NULL,SCacheWarm_ThreadMain,warm) != 0)
+        return REDISMODULE_ERR;
+    pthread_detach(tid);
+    return REDISMODULE_OK;
+}
+
+// Warms a new cache with its entries of the warm file. Main thread only.
+void SCacheWarmFromFile(CacheDetails* cache) {
+    if ((ClusterMode)&&(SCACHE_LAYOUT_SPREAD == cache->layout))
+        return;
+    WarmTask* warm = NULL;
+    for (WarmEntry* cur = WarmFileList; cur; cur = cur->next) {
+        if (strcmp(cur->cachename, cache->cachename)) continue;
+        if (NULL == warm) warm = SCacheWarmCreate(cache, DefaultWarmRate);
+        SCacheWarmAddQuery(warm, cur->query, cur->len);
+    }
+    if (NULL == warm) return;
+
+    warm->ctx = RedisModule_GetThreadSafeContext(NULL);
+    if (REDISMODULE_OK != SCacheWarmStart(warm)) {
+        RedisModule_Log(NULL, "warning", "Cache %s cannot start warming thread", cache->cachename);
+        RedisModule_FreeThreadSafeContext(warm->ctx);
+        SCacheWarmFree(warm);
+    }
+}
+
+// Loads the warm file, <cachename> <query> lines, empty lines and lines
+// starting with # are ignored
+int SCacheWarmLoadFile(RedisModuleCtx *ctx, const char* path) {
+    FILE* file = fopen(path, "r");
+    if (NULL == file) {
+        RedisModule_Log(ctx, "warning", "Cannot open warm file %s", path);
+        return REDISMODULE_ERR;
+    }
+    char* line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    WarmEntry** tail = &WarmFileList;
+    while (-1 != (linelen = getline(&line, &linecap, file))) {
+        while ((linelen)&&(isspace((unsigned char)line[linelen-1])))
+            line[--linelen] = 0;
+        char* query = line;
+        while (isspace((unsigned char)*query)) query++;
+        if ((0 == *query)||('#' == *query)) continue;
+        char* cachename = query;
+        while ((*query)&&(!isspace((unsigned char)*query))) query++;
+        if (0 == *query) continue;
+        *query++ = 0;
+        while (isspace((unsigned char)*query)) query++;
+
+        WarmEntry* entry = RedisModule_Alloc(sizeof(WarmEntry));
+        entry->cachename = RedisModule_Strdup(cachename);
+        entry->query = RedisModule_Strdup(query);
+        entry->len = strlen(query);
+        entry->next = NULL;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    free(line);
+    fclose(file);
+    return REDISMODULE_OK;
+}
+
+/* Reply callback for blocking command SCACHE.WARM */
+int SCacheWarm_Reply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+    WarmTask* warm = RedisModule_GetBlockedClientPrivateData(ctx);
+    if (warm->error)
+        return RedisModule_ReplyWithError(ctx, warm->error);
+    RedisModule_ReplyWithArray(ctx, 3);
+    RedisModule_ReplyWithLongLong(ctx, warm->count);
+    RedisModule_ReplyWithLongLong(ctx, warm->filled);
+    RedisModule_ReplyWithLongLong(ctx, warm->errors);
+    return REDISMODULE_OK;
+}
+
+/* Private data freeing callback for SCACHE.WARM command. */
+void SCacheWarm_FreeData(RedisModuleCtx *ctx, void *privdata) {
+    REDISMODULE_NOT_USED(ctx);
+    SCacheWarmFree(privdata);
+}
 
 void RedisModule_ReplyWithCacheDetails(RedisModuleCtx *ctx, CacheDetails* cur) {
-    RedisModule_ReplyWithArray(ctx, 8);
+    RedisModule_ReplyWithArray(ctx, 31);
     RedisModule_ReplyWithStringBuffer(ctx, cur->cachename, strlen(cur->cachename));
     RedisModule_ReplyWithLongLong(ctx,cur->ttl);
     RedisModule_ReplyWithStringBuffer(ctx, cur->dbhost, strlen(cur->dbhost));
@@ -74,14 +4171,98 @@ void RedisModule_ReplyWithCacheDetails(RedisModuleCtx *ctx, CacheDetails* cur) {
     RedisModule_ReplyWithStringBuffer(ctx, cur->dbuser, strlen(cur->dbuser));
     //	RedisModule_ReplyWithStringBuffer(ctx, cur->dbpass, strlen(cur->dbpass));
     RedisModule_ReplyWithStringBuffer(ctx, "xxxxxxxx",8);
-    RedisModule_ReplyWithLongLong(ctx, (long long)cur->dbhandle);
+    RedisModule_ReplyWithLongLong(ctx, (long long)SCacheControlConn(cur));
+    RedisModule_ReplyWithCString(ctx, cur->backend->name);
+    RedisModule_ReplyWithLongLong(ctx, cur->poolsize);
+    RedisModule_ReplyWithLongLong(ctx, cur->batchsize);
+    RedisModule_ReplyWithLongLong(ctx, cur->batchwait);
+    RedisModule_ReplyWithLongLong(ctx, cur->persist);
+    RedisModule_ReplyWithCString(ctx, (SCACHE_LAYOUT_HASHTAG == cur->layout) ? "hashtag" : "spread");
+    RedisModule_ReplyWithLongLong(ctx, cur->ttlmin);
+    RedisModule_ReplyWithLongLong(ctx, cur->ttlmax);
+    RedisModule_ReplyWithCString(ctx, cur->replicas ? cur->replicas : "");
+    RedisModule_ReplyWithCString(ctx, (SCACHE_ROUTING_EWMA == cur->routing) ? "ewma" : "leastconn");
+    RedisModule_ReplyWithLongLong(ctx, cur->hedge);
+    RedisModule_ReplyWithLongLong(ctx, cur->hedgebudget);
+    RedisModule_ReplyWithLongLong(ctx, cur->maxpending);
+    RedisModule_ReplyWithLongLong(ctx, cur->stale);
+    RedisModule_ReplyWithLongLong(ctx, cur->breaker);
+    RedisModule_ReplyWithLongLong(ctx, cur->timeout);
+    RedisModule_ReplyWithLongLong(ctx, cur->grace);
+    RedisModule_ReplyWithLongLong(ctx, cur->refresh);
+    RedisModule_ReplyWithLongLong(ctx, cur->subsume);
+    RedisModule_ReplyWithCString(ctx, cur->incremental ? cur->incremental : "");
+    RedisModule_ReplyWithCString(ctx, cur->rowkey ? cur->rowkey : "");
+    pthread_mutex_lock(&cur->lock);
+    uint32_t pending = cur->pending;
+    const char* circuit = (0 == cur->breakeropen) ? "closed" :
+        (cur->breakeropen > RedisModule_Milliseconds()) ? "open" : "half-open";
+    pthread_mutex_unlock(&cur->lock);
+    RedisModule_ReplyWithLongLong(ctx, pending);
+    RedisModule_ReplyWithCString(ctx, circuit);
+}
+
+// Frees a cache definition which was never registered
+void SCacheDefinitionFree(CacheDetails* cur) {
+    SCacheMirrorsFree(cur);
+    RedisModule_Free(cur->incremental);
+    RedisModule_Free(cur->rowkey);
+    RedisModule_Free(cur->replicas);
+    RedisModule_Free(cur->cachename);
+    RedisModule_Free(cur->dbhost);
+    RedisModule_Free(cur->dbname);
+    RedisModule_Free(cur->dbuser);
+    RedisModule_Free(cur->dbpass);
+    RedisModule_Free(cur);
+}
+
+// Starts the fetchers of a new cache definition and links it in the cache
+// list. The fetchers open the pooled connections themselves, in parallel.
+int SCacheRegister(CacheDetails* cur) {
+    cur->slot = SCacheKeySlot(cur->cachename, strlen(cur->cachename));
+    cur->refcount = 1;
+    cur->current = SCacheGenerationNew(cur->generation);
+    pthread_mutex_init(&cur->lock, NULL);
+    pthread_cond_init(&cur->wakeup, NULL);
+    if (REDISMODULE_OK != SCacheStartFetchers(cur)) {
+        SCacheDrop(cur);
+        return REDISMODULE_ERR;
+    }
+
+    // CRITICAL SECTION BEGIN : should be in a mutex
+    cur->next = CacheList;
+    CacheList = cur;
+    // CRITICAL SECTION END : should be in a mutex
+
+    SCacheWarmFromFile(cur);
+    return REDISMODULE_OK;
+}
+
+// Unlinks a cache definition from the list, returns NULL if not found
+CacheDetails* SCacheUnlink(const char* cachename) {
+    CacheDetails* cur=CacheList;
+    CacheDetails* tmp=NULL;
+
+    if ((CacheList)&&!strcmp(cachename,CacheList->cachename)) {
+        // First cache in the list
+        tmp=CacheList;
+        CacheList = CacheList->next;
+    } else {
+        // Not the first cache in the list, search in the list
+        while ((cur)&&(cur->next)&&(strcmp(cachename,cur->next->cachename)))
+            cur=cur->next;
+
+        if ((cur)&&(cur->next)) {
+            // Cache definition found
+            tmp=cur->next;
+            cur->next = cur->next->next;
+        }
+    }
+    return tmp;
 }
 
 /* Reply callback for blocking command SCACHE.CREATE */
 int SCacheCreate_Reply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    REDISMODULE_NOT_USED(argv);
-    REDISMODULE_NOT_USED(argc);
-
     CacheDetails *privdata=RedisModule_GetBlockedClientPrivateData(ctx);
 
     if ( NULL == privdata->dbhandle) {
@@ -90,22 +4271,48 @@ int SCacheCreate_Reply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
     }
 
     // FreeData will be automatically called after this callback to release the
-    // memory, we need to create and store a copy of privdata.
-    CacheDetails *cur=(CacheDetails*)RedisModule_Alloc(sizeof(CacheDetails));
+    // memory, we need to create and store a copy of privdata. The control
+    // connection is moved to the copy.
+    CacheDetails *cur=(CacheDetails*)RedisModule_Calloc(1,sizeof(CacheDetails));
     cur->cachename = RedisModule_Strdup(privdata->cachename);
     cur->ttl = privdata->ttl;
+    cur->ttlmin = privdata->ttlmin;
+    cur->ttlmax = privdata->ttlmax;
     cur->dbhost = RedisModule_Strdup(privdata->dbhost);
     cur->dbport = privdata->dbport;
     cur->dbname = RedisModule_Strdup(privdata->dbname);
     cur->dbuser = RedisModule_Strdup(privdata->dbuser);
     cur->dbpass = RedisModule_Strdup(privdata->dbpass);
+    cur->backend = privdata->backend;
     cur->dbhandle = privdata->dbhandle;
+    cur->poolsize = privdata->poolsize;
+    cur->replicas = privdata->replicas ? RedisModule_Strdup(privdata->replicas) : NULL;
+    cur->routing = privdata->routing;
+    cur->hedge = privdata->hedge;
+    cur->hedgebudget = privdata->hedgebudget;
+    cur->maxpending = privdata->maxpending;
+    cur->stale = privdata->stale;
+    cur->breaker = privdata->breaker;
+    cur->timeout = privdata->timeout;
+    cur->grace = privdata->grace;
+    cur->refresh = privdata->refresh;
+    cur->subsume = privdata->subsume;
+    cur->generation = privdata->generation;
+    cur->incremental = privdata->incremental ? RedisModule_Strdup(privdata->incremental) : NULL;
+    cur->rowkey = privdata->rowkey ? RedisModule_Strdup(privdata->rowkey) : NULL;
+    cur->batchsize = privdata->batchsize;
+    cur->batchwait = privdata->batchwait;
+    cur->persist = privdata->persist;
+    cur->layout = privdata->layout;
+    privdata->dbhandle = NULL;
 
-    // CRITICAL SECTION BEGIN : should be in a mutex
-    cur->next = CacheList;
-    CacheList = cur;
-    // CRITICAL SECTION END : should be in a mutex
+    if (REDISMODULE_OK != SCacheRegister(cur)) {
+        RedisModule_ReplyWithError(ctx,"ERR Can't start fetcher threads");
+        return REDISMODULE_OK;
+    }
 
+    // Replicas and the AOF define the cache without testing the connection
+    RedisModule_Replicate(ctx, "scache.define", "v", argv+1, (size_t)(argc-1));
     RedisModule_ReplyWithCacheDetails(ctx,cur);
     return REDISMODULE_OK;
 }
@@ -121,12 +4328,9 @@ int SCacheCreate_Timeout(RedisModuleCtx *ctx, RedisModuleString **argv, int argc
 void SCacheCreate_FreeData(RedisModuleCtx *ctx, void *privdata) {
     REDISMODULE_NOT_USED(ctx);
     CacheDetails *cur=privdata;
-    RedisModule_Free(cur->cachename);
-    RedisModule_Free(cur->dbhost);
-    RedisModule_Free(cur->dbname);
-    RedisModule_Free(cur->dbuser);
-    RedisModule_Free(cur->dbpass);
-    RedisModule_Free(cur);
+    // Connection not moved to a cache definition (failure or timeout)
+    if (cur->dbhandle) cur->backend->close(cur->dbhandle);
+    SCacheDefinitionFree(cur);
 }
 
 /* The thread entry point that actually executes the blocking part
@@ -137,97 +4341,236 @@ void *SCacheCreate_ThreadMain(void *arg) {
     CacheDetails *cur = targ[1];
     RedisModule_Free(targ);
 
-    MYSQL* mysql;
-    // Init MySQL options structure with auto-reconnect in case of lost connection
-    mysql = mysql_init(NULL);
-    my_bool reconnect=1;
-    mysql_options(mysql,MYSQL_OPT_RECONNECT,&reconnect);
-    // Open the connection to MySQL
-    cur-> dbhandle = mysql_real_connect(mysql, cur->dbhost, cur->dbuser, cur->dbpass, cur->dbname, cur->dbport, 0, 0);
+    // Tests the database with the control connection, used by scache.test
+    // and transactions, the fetchers open the pool
+    char err[256];
+    cur->dbhandle = SCacheConnect(cur, NULL, 0, err, sizeof(err));
 
     RedisModule_UnblockClient(bc,cur);
     return NULL;
 }
 
-
-// Creates a new cache configuration and stores it in a hash
-// SCACHE.CREATE <CacheName> <DefaultTTL> <dbhost> <dbport> <dbname> <dbuser> <dbpass>
-int SCacheCreate_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    // REDISMODULE_NOT_USED(argv);
-    //REDISMODULE_NOT_USED(argc);
-    if (argc != 8 ) return RedisModule_WrongArity(ctx);
-
-    RedisModule_AutoMemory(ctx);
-    CacheDetails *cur = CacheList;
-    size_t len;
-    const char* cachename = RedisModule_StringPtrLen(argv[1], &len);
-
-    // Search for already defined cache
-    while ((cur)&&(strcmp(cachename,cur->cachename)))
-        cur=cur->next;
-    if (cur) {
-        RedisModule_ReplyWithError(ctx,"ERR Cache already defined, please delete before.");
-        return REDISMODULE_OK;
-    } else 
-        cur = (CacheDetails*)RedisModule_Alloc(sizeof(CacheDetails));
-
-    // Initialize cachename from the arguments in the structure
-    if (!(cur->cachename = (char*)RedisModule_Alloc(len+1))) {
-        RedisModule_Free(cur);
-        return RedisModule_ReplyWithError(ctx,"ERR unable to allocate memory to store the cachename.");
+// Parses a cache definition, the arguments of SCACHE.CREATE and SCACHE.DEFINE.
+// Replies with an error and returns NULL if they are invalid.
+CacheDetails* SCacheParseDefinition(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    // Optional <name> <value> pairs, MySQL backend by default
+    const char* backendname = "mysql";
+    long long poolsize = DefaultPoolSize;
+    long long batchsize = DefaultBatchSize;
+    long long batchwait = DefaultBatchWait;
+    int persist = 0;
+    SCacheLayout layout = SCACHE_LAYOUT_SPREAD;
+    long long ttlmin = 0;
+    long long ttlmax = 0;
+    const char* replicas = NULL;
+    SCacheRouting routing = SCACHE_ROUTING_LEASTCONN;
+    long long hedge = 0;
+    long long hedgebudget = 5;
+    long long maxpending = 0;
+    long long stale = 0;
+    long long breaker = 0;
+    long long timeout = 0;
+    long long grace = 0;
+    long long refresh = 0;
+    int subsume = 0;
+    const char* incremental = NULL;
+    const char* rowkey = NULL;
+    const char* error = NULL;
+    for (int i = 8; (i < argc)&&(NULL == error); i += 2) {
+        const char* option = RedisModule_StringPtrLen(argv[i], NULL);
+        if (!strcasecmp(option, "backend"))
+            backendname = RedisModule_StringPtrLen(argv[i+1], NULL);
+        else if (!strcasecmp(option, "poolsize")) {
+            if ((REDISMODULE_OK != RedisModule_StringToLongLong(argv[i+1], &poolsize))
+                    ||(poolsize < 1)||(poolsize > 1024))
+                error = "ERR invalid pool size";
+        } else if (!strcasecmp(option, "batchsize")) {
+            if ((REDISMODULE_OK != RedisModule_StringToLongLong(argv[i+1], &batchsize))
+                    ||(batchsize < 1)||(batchsize > SCACHE_MAX_BATCH))
+                error = "ERR invalid batch size";
+        } else if (!strcasecmp(option, "batchwait")) {
+            if ((REDISMODULE_OK != RedisModule_StringToLongLong(argv[i+1], &batchwait))
+                    ||(batchwait < 0)||(batchwait > 1000000))
+                error = "ERR invalid batch wait";
+        } else if (!strcasecmp(option, "persist")) {
+            const char* value = RedisModule_StringPtrLen(argv[i+1], NULL);
+            if (!strcasecmp(value, "yes"))
+                persist = 1;
+            else if (strcasecmp(value, "no"))
+                error = "ERR invalid persist flag, expected yes or no";
+        } else if (!strcasecmp(option, "layout")) {
+            const char* value = RedisModule_StringPtrLen(argv[i+1], NULL);
+            if (!strcasecmp(value, "hashtag"))
+                layout = SCACHE_LAYOUT_HASHTAG;
+            else if (strcasecmp(value, "spread"))
+                error = "ERR invalid layout, expected spread or hashtag";
+        } else if (!strcasecmp(option, "ttlmin")) {
+            if ((REDISMODULE_OK != RedisModule_StringToLongLong(argv[i+1], &ttlmin))
+                    ||(ttlmin < 1)||(ttlmin > UINT16_MAX))
+                error = "ERR invalid minimum TTL";
+        } else if (!strcasecmp(option, "ttlmax")) {
+            if ((REDISMODULE_OK != RedisModule_StringToLongLong(argv[i+1], &ttlmax))
+                    ||(ttlmax < 1)||(ttlmax > UINT16_MAX))
+                error = "ERR invalid maximum TTL";
+        } else if (!strcasecmp(option, "replicas")) {
+            replicas = RedisModule_StringPtrLen(argv[i+1], NULL);
+            int count = SCacheReplicasCount(replicas);
+            if ((count < 0)||(count >= SCACHE_MAX_NODES))
+                error = "ERR invalid replicas, expected host:port[,host:port...]";
+        } else if (!strcasecmp(option, "routing")) {
+            const char* value = RedisModule_StringPtrLen(argv[i+1], NULL);
+            if (!strcasecmp(value, "ewma"))
+                routing = SCACHE_ROUTING_EWMA;
+            else if (strcasecmp(value, "leastconn"))
+                error = "ERR invalid routing, expected leastconn or ewma";
+        } else if (!strcasecmp(option, "hedge")) {
+            if ((REDISMODULE_OK != RedisModule_StringToLongLong(argv[i+1], &hedge))
+                    ||(hedge < 0)||(hedge > 99))
+                error = "ERR invalid hedge percentile";
+        } else if (!strcasecmp(option, "hedgebudget")) {
+            if ((REDISMODULE_OK != RedisModule_StringToLongLong(argv[i+1], &hedgebudget))
+                    ||(hedgebudget < 1)||(hedgebudget > 100))
+                error = "ERR invalid hedge budget";
+        } else if (!strcasecmp(option, "maxpending")) {
+            if ((REDISMODULE_OK != RedisModule_StringToLongLong(argv[i+1], &maxpending))
+                    ||(maxpending < 0)||(maxpending > UINT32_MAX))
+                error = "ERR invalid maximum pending misses";
+        } else if (!strcasecmp(option, "stale")) {
+            if ((REDISMODULE_OK != RedisModule_StringToLongLong(argv[i+1], &stale))
+                    ||(stale < 0)||(stale > UINT16_MAX))
+                error = "ERR invalid stale delay";
+        } else if (!strcasecmp(option, "breaker")) {
+            if ((REDISMODULE_OK != RedisModule_StringToLongLong(argv[i+1], &breaker))
+                    ||(breaker < 0)||(breaker > UINT16_MAX))
+                error = "ERR invalid circuit breaker threshold";
+        } else if (!strcasecmp(option, "timeout")) {
+            if ((REDISMODULE_OK != RedisModule_StringToLongLong(argv[i+1], &timeout))
+                    ||(timeout < 0)||(timeout > UINT32_MAX))
+                error = "ERR invalid timeout";
+        } else if (!strcasecmp(option, "grace")) {
+            if ((REDISMODULE_OK != RedisModule_StringToLongLong(argv[i+1], &grace))
+                    ||(grace < 0)||(grace > UINT16_MAX))
+                error = "ERR invalid grace delay";
+        } else if (!strcasecmp(option, "refresh")) {
+            if ((REDISMODULE_OK != RedisModule_StringToLongLong(argv[i+1], &refresh))
+                    ||(refresh < 0)||(refresh > 99))
+                error = "ERR invalid refresh window";
+        } else if (!strcasecmp(option, "subsume")) {
+            const char* value = RedisModule_StringPtrLen(argv[i+1], NULL);
+            if (!strcasecmp(value, "yes"))
+                subsume = 1;
+            else if (strcasecmp(value, "no"))
+                error = "ERR invalid subsume flag, expected yes or no";
+        } else if (!strcasecmp(option, "incremental")) {
+            size_t len;
+            incremental = RedisModule_StringPtrLen(argv[i+1], &len);
+            if ((strlen(incremental) != len)||(!SCacheIsIdent(incremental, len, 0)))
+                error = "ERR invalid incremental column";
+        } else if (!strcasecmp(option, "rowkey")) {
+            size_t len;
+            rowkey = RedisModule_StringPtrLen(argv[i+1], &len);
+            if ((strlen(rowkey) != len)||(!SCacheIsIdent(rowkey, len, 0)))
+                error = "ERR invalid row key column";
+        } else
+            error = "ERR syntax error, expected BACKEND, POOLSIZE, BATCHSIZE, BATCHWAIT, PERSIST, LAYOUT, TTLMIN, TTLMAX, REPLICAS, ROUTING, HEDGE, HEDGEBUDGET, MAXPENDING, STALE, BREAKER, TIMEOUT, GRACE, REFRESH, SUBSUME, INCREMENTAL or ROWKEY";
     }
-    memcpy(cur->cachename, cachename, len+1);
-
-    // Initialize ttl from the arguments in the structure
-    if (0 == (cur->ttl=atoi(RedisModule_StringPtrLen(argv[2], &len)))) {
-        RedisModule_Free(cur);
-        return RedisModule_ReplyWithError(ctx,"ERR invalid default TTL");
+    if ((NULL == error)&&(rowkey)&&(NULL == incremental))
+        error = "ERR ROWKEY requires an INCREMENTAL column";
+    if (error) {
+        RedisModule_ReplyWithError(ctx,error);
+        return NULL;
     }
-
-    // Initialize dbhost from the arguments in the structure
-    const char* dbhost = RedisModule_StringPtrLen(argv[3], &len);
-    if (!(cur->dbhost = (char*)RedisModule_Alloc(len+1))) {
-        RedisModule_Free(cur);
-        return RedisModule_ReplyWithError(ctx,"ERR unable to allocate memory to store the dbhost.");
+    char err[256];
+    const SCacheBackend* backend = SCacheBackendGet(backendname, err, sizeof(err));
+    if (NULL == backend) {
+        RedisModule_ReplyWithError(ctx,err);
+        return NULL;
     }
-    memcpy(cur->dbhost, dbhost, len+1);
+    // Backends without multi-statement queries fetch misses one by one
+    if (NULL == backend->next_result)
+        batchsize = 1;
 
-    // Initialize dbport from the arguments in the structure
-    if (0 == (cur->dbport=atoi(RedisModule_StringPtrLen(argv[4], &len)))) {
-        RedisModule_Free(cur);
-        return RedisModule_ReplyWithError(ctx,"ERR invalid dbport number");
+    // Initialize ttl and dbport from the arguments in the structure
+    long long ttl, dbport;
+    if ((REDISMODULE_OK != RedisModule_StringToLongLong(argv[2], &ttl))||(ttl < 1)||(ttl > UINT16_MAX)) {
+        RedisModule_ReplyWithError(ctx,"ERR invalid default TTL");
+        return NULL;
     }
-
-    // Initialize dbname from the arguments in the structure
-    const char* dbname = RedisModule_StringPtrLen(argv[5], &len);
-    if (!(cur->dbname = (char*)RedisModule_Alloc(len+1))) {
-        RedisModule_Free(cur);
-        return RedisModule_ReplyWithError(ctx,"ERR unable to allocate memory to store the dbname.");
+    // The default TTL is the initial TTL of the queries of adaptive caches
+    if (0 == ttlmin) ttlmin = ttl;
+    if (0 == ttlmax) ttlmax = ttl;
+    if ((ttlmin > ttl)||(ttl > ttlmax)) {
+        RedisModule_ReplyWithError(ctx,"ERR the default TTL has to be between TTLMIN and TTLMAX");
+        return NULL;
     }
-    memcpy(cur->dbname, dbname, len+1);
-
-    // Initialize dbuser from the arguments in the structure
-    const char* dbuser = RedisModule_StringPtrLen(argv[6], &len);
-    if (!(cur->dbuser = (char*)RedisModule_Alloc(len+1))) {
-        RedisModule_Free(cur);
-        return RedisModule_ReplyWithError(ctx,"ERR unable to allocate memory to store the dbuser.");
+    if ((REDISMODULE_OK != RedisModule_StringToLongLong(argv[4], &dbport))||(dbport < 1)||(dbport > UINT16_MAX)) {
+        RedisModule_ReplyWithError(ctx,"ERR invalid dbport number");
+        return NULL;
     }
-    memcpy(cur->dbuser, dbuser, len+1);
 
-    // Initialize dbpass from the arguments in the structure
-    const char* dbpass = RedisModule_StringPtrLen(argv[7], &len);
-    if (!(cur->dbpass = (char*)RedisModule_Alloc(len+1))) {
-        RedisModule_Free(cur);
-        return RedisModule_ReplyWithError(ctx,"ERR unable to allocate memory to store the dbpass.");
-    }
-    memcpy(cur->dbpass, dbpass, len+1);
+    CacheDetails *cur = (CacheDetails*)RedisModule_Calloc(1,sizeof(CacheDetails));
+    cur->backend = backend;
+    cur->poolsize = poolsize;
+    cur->batchsize = batchsize;
+    cur->batchwait = batchwait;
+    cur->persist = persist;
+    cur->layout = layout;
+    cur->ttl = ttl;
+    cur->ttlmin = ttlmin;
+    cur->ttlmax = ttlmax;
+    cur->dbport = dbport;
+    cur->replicas = (replicas)&&(*replicas) ? RedisModule_Strdup(replicas) : NULL;
+    cur->routing = routing;
+    cur->hedge = hedge;
+    cur->hedgebudget = hedgebudget;
+    cur->maxpending = maxpending;
+    cur->stale = stale;
+    cur->breaker = breaker;
+    cur->timeout = timeout;
+    cur->grace = grace;
+    cur->refresh = refresh;
+    cur->subsume = subsume;
+    cur->generation = ++Generation;
+    cur->incremental = incremental ? RedisModule_Strdup(incremental) : NULL;
+    cur->rowkey = rowkey ? RedisModule_Strdup(rowkey) : NULL;
+
+    // Initialize the strings from the arguments in the structure
+    cur->cachename = RedisModule_Strdup(RedisModule_StringPtrLen(argv[1], NULL));
+    cur->dbhost = RedisModule_Strdup(RedisModule_StringPtrLen(argv[3], NULL));
+    cur->dbname = RedisModule_Strdup(RedisModule_StringPtrLen(argv[5], NULL));
+    cur->dbuser = RedisModule_Strdup(RedisModule_StringPtrLen(argv[6], NULL));
+    cur->dbpass = RedisModule_Strdup(RedisModule_StringPtrLen(argv[7], NULL));
+    return cur;
+}
+
+// Creates a new cache configuration, after a connection test. The definition
+// is replicated and saved in the RDB snapshots.
+// SCACHE.CREATE <CacheName> <DefaultTTL> <dbhost> <dbport> <dbname> <dbuser> <dbpass>
+//               [BACKEND <name>] [POOLSIZE <n>] [BATCHSIZE <n>] [BATCHWAIT <us>]
+//               [PERSIST yes|no] [LAYOUT spread|hashtag] [TTLMIN <s>] [TTLMAX <s>]
+//               [REPLICAS <host:port,...>] [ROUTING leastconn|ewma]
+//               [HEDGE <percentile>] [HEDGEBUDGET <percent>]
+//               [MAXPENDING <n>] [STALE <s>] [BREAKER <n>] [TIMEOUT <ms>]
+//               [GRACE <s>] [REFRESH <percent>] [SUBSUME yes|no]
+//               [INCREMENTAL <column> [ROWKEY <column>]]
+int SCacheCreate_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if ((argc < 8)||(argc % 2)) return RedisModule_WrongArity(ctx);
 
-    // Blocks the client connection with callbacks
+    // Search for already defined cache
+    if (SCacheGetCache(RedisModule_StringPtrLen(argv[1], NULL)))
+        return RedisModule_ReplyWithError(ctx,"ERR Cache already defined, please delete before.");
+
+    CacheDetails *cur = SCacheParseDefinition(ctx, argv, argc);
+    if (NULL == cur)
+        return REDISMODULE_OK;
+
+    // Blocks the client connection with callbacks, leaving time to the
+    // backend to report its own connection timeout
     RedisModuleBlockedClient *bc = RedisModule_BlockClient(ctx,
             SCacheCreate_Reply,
             SCacheCreate_Timeout,
             SCacheCreate_FreeData,
-            1000); // timeout in milliseconds
+            ConnectTimeout+1000); // timeout in milliseconds
 
     // Initialize the thread arguments structure
     void **targ = RedisModule_Alloc(sizeof(void*)*2);
@@ -238,6 +4581,8 @@ int SCacheCreate_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int
     pthread_t tid;
     if (pthread_create(&tid,NULL,SCacheCreate_ThreadMain,targ) != 0) {
         RedisModule_AbortBlock(bc);
+        RedisModule_Free(targ);
+        SCacheDefinitionFree(cur);
         return RedisModule_ReplyWithError(ctx,"-ERR Can't start thread");
     }
 
@@ -245,6 +4590,170 @@ int SCacheCreate_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int
     return REDISMODULE_OK;
 }
 
+// Defines a cache without testing its database, its connections are opened
+// in the background and retried until the database is reachable. It replaces
+// an existing definition, it is how the definitions are replicated.
+// SCACHE.DEFINE <same arguments as SCACHE.CREATE>
+int SCacheDefine_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if ((argc < 8)||(argc % 2)) return RedisModule_WrongArity(ctx);
+
+    CacheDetails *cur = SCacheParseDefinition(ctx, argv, argc);
+    if (NULL == cur)
+        return REDISMODULE_OK;
+    CacheDetails *old = SCacheUnlink(cur->cachename);
+    if (old)
+        SCacheDrop(old);
+    if (REDISMODULE_OK != SCacheRegister(cur))
+        return RedisModule_ReplyWithError(ctx,"ERR Can't start fetcher threads");
+
+    RedisModule_ReplicateVerbatim(ctx);
+    RedisModule_ReplyWithCacheDetails(ctx,cur);
+    return REDISMODULE_OK;
+}
+
+/* RDB auxiliary data saving callback : the cache definitions are saved before
+ * the keyspace, a restarted node or a new replica defines its caches first. */
+void SCacheDefinitions_AuxSave(RedisModuleIO *rdb, int when) {
+    REDISMODULE_NOT_USED(when);
+    uint64_t count = 0;
+    for (CacheDetails* cur = CacheList; cur; cur = cur->next)
+        count++;
+    RedisModule_SaveUnsigned(rdb, count);
+    for (CacheDetails* cur = CacheList; cur; cur = cur->next) {
+        RedisModule_SaveStringBuffer(rdb, cur->cachename, strlen(cur->cachename));
+        RedisModule_SaveUnsigned(rdb, cur->ttl);
+        RedisModule_SaveStringBuffer(rdb, cur->dbhost, strlen(cur->dbhost));
+        RedisModule_SaveUnsigned(rdb, cur->dbport);
+        RedisModule_SaveStringBuffer(rdb, cur->dbname, strlen(cur->dbname));
+        RedisModule_SaveStringBuffer(rdb, cur->dbuser, strlen(cur->dbuser));
+        RedisModule_SaveStringBuffer(rdb, cur->dbpass, strlen(cur->dbpass));
+        RedisModule_SaveStringBuffer(rdb, cur->backend->name, strlen(cur->backend->name));
+        RedisModule_SaveUnsigned(rdb, cur->poolsize);
+        RedisModule_SaveUnsigned(rdb, cur->batchsize);
+        RedisModule_SaveUnsigned(rdb, cur->batchwait);
+        RedisModule_SaveUnsigned(rdb, cur->persist);
+        RedisModule_SaveUnsigned(rdb, cur->layout);
+        RedisModule_SaveUnsigned(rdb, cur->ttlmin);
+        RedisModule_SaveUnsigned(rdb, cur->ttlmax);
+        const char* replicas = cur->replicas ? cur->replicas : "";
+        RedisModule_SaveStringBuffer(rdb, replicas, strlen(replicas));
+        RedisModule_SaveUnsigned(rdb, cur->routing);
+        RedisModule_SaveUnsigned(rdb, cur->hedge);
+        RedisModule_SaveUnsigned(rdb, cur->hedgebudget);
+        RedisModule_SaveUnsigned(rdb, cur->maxpending);
+        RedisModule_SaveUnsigned(rdb, cur->stale);
+        RedisModule_SaveUnsigned(rdb, cur->breaker);
+        RedisModule_SaveUnsigned(rdb, cur->timeout);
+        RedisModule_SaveUnsigned(rdb, cur->grace);
+        RedisModule_SaveUnsigned(rdb, cur->refresh);
+        RedisModule_SaveUnsigned(rdb, cur->subsume);
+        uint64_t nmirrors = 0;
+        for (SCacheMirror* mirror = cur->mirrors; mirror; mirror = mirror->next)
+            nmirrors++;
+        RedisModule_SaveUnsigned(rdb, nmirrors);
+        for (SCacheMirror* mirror = cur->mirrors; mirror; mirror = mirror->next) {
+            RedisModule_SaveStringBuffer(rdb, mirror->table, strlen(mirror->table));
+            RedisModule_SaveUnsigned(rdb, mirror->interval);
+            RedisModule_SaveUnsigned(rdb, mirror->nindexed);
+            for (uint32_t j = 0; j < mirror->nindexed; j++)
+                RedisModule_SaveStringBuffer(rdb, mirror->indexed[j], strlen(mirror->indexed[j]));
+        }
+        const char* incremental = cur->incremental ? cur->incremental : "";
+        RedisModule_SaveStringBuffer(rdb, incremental, strlen(incremental));
+        const char* rowkey = cur->rowkey ? cur->rowkey : "";
+        RedisModule_SaveStringBuffer(rdb, rowkey, strlen(rowkey));
+        RedisModule_SaveUnsigned(rdb, cur->generation);
+    }
+    RedisModule_SaveUnsigned(rdb, Generation);
+}
+
+/* RDB auxiliary data loading callback : the loaded definitions replace the
+ * current ones, their connections are opened in the background, in parallel,
+ * while the keyspace is loaded. */
+int SCacheDefinitions_AuxLoad(RedisModuleIO *rdb, int encver, int when) {
+    REDISMODULE_NOT_USED(when);
+    if (encver != SCACHE_ENTRY_ENCVER) return REDISMODULE_ERR;
+
+    while (CacheList) {
+        CacheDetails* cur = CacheList;
+        CacheList = cur->next;
+        SCacheDrop(cur);
+    }
+
+    uint64_t count = RedisModule_LoadUnsigned(rdb);
+    for (uint64_t i = 0; i < count; i++) {
+        CacheDetails *cur = (CacheDetails*)RedisModule_Calloc(1,sizeof(CacheDetails));
+        cur->cachename = SCacheLoadString(rdb, NULL);
+        cur->ttl = RedisModule_LoadUnsigned(rdb);
+        cur->dbhost = SCacheLoadString(rdb, NULL);
+        cur->dbport = RedisModule_LoadUnsigned(rdb);
+        cur->dbname = SCacheLoadString(rdb, NULL);
+        cur->dbuser = SCacheLoadString(rdb, NULL);
+        cur->dbpass = SCacheLoadString(rdb, NULL);
+        char* backendname = SCacheLoadString(rdb, NULL);
+        cur->poolsize = RedisModule_LoadUnsigned(rdb);
+        cur->batchsize = RedisModule_LoadUnsigned(rdb);
+        cur->batchwait = RedisModule_LoadUnsigned(rdb);
+        cur->persist = RedisModule_LoadUnsigned(rdb);
+        cur->layout = RedisModule_LoadUnsigned(rdb);
+        cur->ttlmin = RedisModule_LoadUnsigned(rdb);
+        cur->ttlmax = RedisModule_LoadUnsigned(rdb);
+        cur->replicas = SCacheLoadString(rdb, NULL);
+        cur->routing = RedisModule_LoadUnsigned(rdb);
+        if (0 == *cur->replicas) {
+            RedisModule_Free(cur->replicas);
+            cur->replicas = NULL;
+        }
+        cur->hedge = RedisModule_LoadUnsigned(rdb);
+        cur->hedgebudget = RedisModule_LoadUnsigned(rdb);
+        cur->maxpending = RedisModule_LoadUnsigned(rdb);
+        cur->stale = RedisModule_LoadUnsigned(rdb);
+        cur->breaker = RedisModule_LoadUnsigned(rdb);
+        cur->timeout = RedisModule_LoadUnsigned(rdb);
+        cur->grace = RedisModule_LoadUnsigned(rdb);
+        cur->refresh = RedisModule_LoadUnsigned(rdb);
+        cur->subsume = RedisModule_LoadUnsigned(rdb);
+        // The mirrors are loaded by the module timer once the cache is defined
+        uint64_t nmirrors = RedisModule_LoadUnsigned(rdb);
+        for (uint64_t j = 0; j < nmirrors; j++) {
+            char* table = SCacheLoadString(rdb, NULL);
+            SCacheMirror* mirror = SCacheMirrorAdd(cur, table);
+            RedisModule_Free(table);
+            mirror->interval = RedisModule_LoadUnsigned(rdb);
+            mirror->nindexed = RedisModule_LoadUnsigned(rdb);
+            mirror->indexed = RedisModule_Alloc(sizeof(char*)*(mirror->nindexed ? mirror->nindexed : 1));
+            for (uint32_t k = 0; k < mirror->nindexed; k++)
+                mirror->indexed[k] = SCacheLoadString(rdb, NULL);
+        }
+        cur->incremental = SCacheLoadString(rdb, NULL);
+        cur->rowkey = SCacheLoadString(rdb, NULL);
+        if (0 == *cur->incremental) {
+            RedisModule_Free(cur->incremental);
+            cur->incremental = NULL;
+        }
+        if (0 == *cur->rowkey) {
+            RedisModule_Free(cur->rowkey);
+            cur->rowkey = NULL;
+        }
+        cur->generation = RedisModule_LoadUnsigned(rdb);
+        if (cur->generation > Generation)
+            Generation = cur->generation;
+
+        char err[256];
+        cur->backend = SCacheBackendGet(backendname, err, sizeof(err));
+        RedisModule_Free(backendname);
+        if (NULL == cur->backend) {
+            RedisModule_Log(NULL, "warning", "Cache %s not defined: %s", cur->cachename, err);
+            SCacheDefinitionFree(cur);
+        } else if (REDISMODULE_OK != SCacheRegister(cur))
+            RedisModule_Log(NULL, "warning", "Cache %s not defined: cannot start fetcher threads", cur->cachename);
+    }
+    uint64_t generation = RedisModule_LoadUnsigned(rdb);
+    if (generation > Generation)
+        Generation = generation;
+    return REDISMODULE_OK;
+}
+
 // Lists all configured caches 
 // O(n) n=nb caches
 int SCacheList_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
@@ -308,7 +4817,8 @@ int SCacheTest_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int a
         cur=cur->next;
 
     if (cur) {
-        if (mysql_ping(cur->dbhandle))
+        void* conn = SCacheControlConn(cur);
+        if ((NULL == conn)||(cur->backend->ping(conn)))
             RedisModule_ReplyWithError(ctx,"ERR Connection failed.");
         else
             RedisModule_ReplyWithLongLong(ctx,1);
@@ -318,250 +4828,617 @@ int SCacheTest_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int a
     return REDISMODULE_OK;
 }
 
-// Flushes all the values from a cache
-int SCacheFlush_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    REDISMODULE_NOT_USED(argv);
-    REDISMODULE_NOT_USED(argc);
-    RedisModule_ReplyWithError(ctx,"ERR Not yet implemented.");
+// Reports the state of the database nodes of a cache : host, port, batches
+// in flight, open connections, latency average (µs), consecutive failures,
+// remaining ejection time (ms) and hedged batches received
+// SCACHE.NODES <cachename>
+int SCacheNodes_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 2) return RedisModule_WrongArity(ctx);
+
+    CacheDetails* cache = SCacheGetCache(RedisModule_StringPtrLen(argv[1], NULL));
+    if (NULL == cache)
+        return RedisModule_ReplyWithError(ctx,"ERR Cache definition not found.");
+
+    long long now = RedisModule_Milliseconds();
+    pthread_mutex_lock(&cache->lock);
+    RedisModule_ReplyWithArray(ctx, cache->nnodes);
+    for (uint16_t i = 0; i < cache->nnodes; i++) {
+        SCacheNode* node = &cache->nodes[i];
+        RedisModule_ReplyWithArray(ctx, 8);
+        RedisModule_ReplyWithCString(ctx, node->host);
+        RedisModule_ReplyWithLongLong(ctx, node->port);
+        RedisModule_ReplyWithLongLong(ctx, node->outstanding);
+        RedisModule_ReplyWithLongLong(ctx, node->opened);
+        RedisModule_ReplyWithLongLong(ctx, node->ewma);
+        RedisModule_ReplyWithLongLong(ctx, node->failures);
+        RedisModule_ReplyWithLongLong(ctx,
+                ((node->failures >= SCACHE_EJECT_FAILURES)&&(node->ejected > now)) ? node->ejected-now : 0);
+        RedisModule_ReplyWithLongLong(ctx, node->hedges);
+    }
+    pthread_mutex_unlock(&cache->lock);
     return REDISMODULE_OK;
 }
 
+// Flushes all the values from a cache, in O(1) : the cache moves to a new
+// generation, its previous resultsets are misses at once. Their memory is
+// reclaimed in the background by the sweeper, or by their refill.
+// SCACHE.FLUSH <cachename>
+int SCacheFlush_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 2) return RedisModule_WrongArity(ctx);
+    CacheDetails* cache = SCacheGetCache(RedisModule_StringPtrLen(argv[1], NULL));
+    if (NULL == cache)
+        return RedisModule_ReplyWithError(ctx,"ERR cache definition not found.");
+    SCacheNewGeneration(cache);
+    RedisModule_ReplicateVerbatim(ctx);
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
 // Flushes and delete a cache
 // O(n/2) + Flush n = nb caches
 int SCacheDelete_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    REDISMODULE_NOT_USED(argv);
-    REDISMODULE_NOT_USED(argc);
     if (argc != 2 ) return RedisModule_WrongArity(ctx);
 
-    // Flushes the cache first
-//    SCacheFlush_RedisCommand(ctx, argv, argc);
+    CacheDetails* tmp = SCacheUnlink(RedisModule_StringPtrLen(argv[1], NULL));
+    if (tmp) {
+        SCacheDrop(tmp);
+        RedisModule_ReplicateVerbatim(ctx);
+        RedisModule_ReplyWithLongLong(ctx,1);
+    } else {
+        // Cache definition not in the list
+        RedisModule_ReplyWithError(ctx,"ERR Cache definition not found.");
+    }
+    return REDISMODULE_OK;
+}
 
-    RedisModule_AutoMemory(ctx);
+// Declares the keys of a cache command for the cluster routing : the cache
+// name of hashtag caches, or the arguments from first (the queries) otherwise
+void SCacheDeclareKeys(RedisModuleCtx *ctx, RedisModuleString **argv, int argc, int first) {
+    if (argc < 2) return;
+    CacheDetails* cache = SCacheGetCache(RedisModule_StringPtrLen(argv[1], NULL));
+    if ((cache)&&(SCACHE_LAYOUT_HASHTAG == cache->layout)) {
+        RedisModule_KeyAtPos(ctx, 1);
+        return;
+    }
+    for (int i = first; i < argc; i++)
+        RedisModule_KeyAtPos(ctx, i);
+}
 
-    CacheDetails* cur=CacheList;
-    CacheDetails* tmp=NULL;
-    size_t len;
-    const char* cachename = RedisModule_StringPtrLen(argv[1], &len);
+// Parses the optional TIMEOUT <ms> following the cache name of a querying
+// command. Returns the position of the first query, or -1 if the timeout is
+// invalid.
+int SCacheParseTimeout(RedisModuleString **argv, int argc, long long* timeout) {
+    *timeout = -1;
+    if ((argc < 3)||(strcasecmp(RedisModule_StringPtrLen(argv[2], NULL), "TIMEOUT")))
+        return 2;
+    if ((argc < 4)||(RedisModule_StringToLongLong(argv[3], timeout) != REDISMODULE_OK)||(*timeout < 0))
+        return -1;
+    return 4;
+}
 
-    if ((CacheList)&&!strcmp(cachename,CacheList->cachename)) {
-        // First cache in the list
-        tmp=CacheList;
-        CacheList = CacheList->next;
-        mysql_close(tmp->dbhandle);
-        RedisModule_Free(tmp);
-        RedisModule_ReplyWithLongLong(ctx,1);
-    } else {
-        // Not the first cache in the list, search in the list
-        while ((cur)&&(cur->next)&&(strcmp(cachename,cur->next->cachename)))
-            cur=cur->next;
+#define SCACHE_GET_STACK 16         // Queries of a command looked up without allocation
 
-        if (cur->next) {
-            // Cache definition found
-            tmp=cur->next;
-            cur->next = cur->next->next;
-            mysql_close(tmp->dbhandle);
-            RedisModule_Free(tmp);
-            RedisModule_ReplyWithLongLong(ctx,1);
+// Gets resultsets from the cache. Hits are answered immediately, misses are
+// queued to the cache fetcher threads and the client is blocked until all of
+// them are fetched, in parallel, from the underlying database, or until its
+// timeout : the command TIMEOUT, or the cache one.
+int SCacheGet(RedisModuleCtx *ctx, RedisModuleString **argv, int argc, SCacheReplyKind kind, int multi) {
+    long long timeout;
+    int first = SCacheParseTimeout(argv, argc, &timeout);
+    if (RedisModule_IsKeysPositionRequest(ctx)) {
+        SCacheDeclareKeys(ctx, argv, argc, (first < 0) ? argc : first);
+        return REDISMODULE_OK;
+    }
+    if (first < 0)
+        return RedisModule_ReplyWithError(ctx,"ERR invalid TIMEOUT.");
+    if ((argc <= first)||((!multi)&&(argc != first+1))) return RedisModule_WrongArity(ctx);
+
+    // The hit path reads the module values directly, without automatic memory
+    // nor temporary allocations but the key names
+    uint64_t start = TraceSampleRate ? SCacheUsTime() : 0;
+    const char* cachename = RedisModule_StringPtrLen(argv[1], NULL);
+    CacheDetails* cache = SCacheGetCache(cachename);
+    if (NULL == cache)
+        return RedisModule_ReplyWithError(ctx,"ERR cache definition not found.");
+    int count = argc-first;
+    SCacheResultset* entrybuf[SCACHE_GET_STACK];
+    SCacheResultset* stalebuf[SCACHE_GET_STACK];
+    SCacheResultset** entries = (count <= SCACHE_GET_STACK) ? entrybuf :
+        RedisModule_PoolAlloc(ctx, sizeof(SCacheResultset*)*count);
+    SCacheResultset** stale = (0 == cache->stale) ? NULL : (count <= SCACHE_GET_STACK) ? stalebuf :
+        RedisModule_PoolAlloc(ctx, sizeof(SCacheResultset*)*count);
+    char bypassbuf[SCACHE_GET_STACK];
+    char* bypass = (count <= SCACHE_GET_STACK) ? bypassbuf : RedisModule_PoolAlloc(ctx, count);
+    int misses = 0;
+
+    // Try to get the resultsets from the built keys in the cache. The values
+    // outlive their closed keys until the command returns. The uncacheable
+    // queries are misses without any key lookup.
+    for (int i = 0; i < count; i++) {
+        size_t len;
+        const char* query = RedisModule_StringPtrLen(argv[i+first], &len);
+        if ((bypass[i] = SCacheQueryCall(cachename, query, len))) {
+            entries[i] = NULL;
+            if (stale) stale[i] = NULL;
+            misses++;
+            continue;
+        }
+        RedisModuleKey* key = SCacheOpenEntry(ctx, cache, query, len);
+        int refresh;
+        if (NULL == (entries[i] = SCacheEntryGet(key, cache, &refresh))) {
+            if (stale) stale[i] = SCacheEntryStale(key, cache);
+        } else if (refresh)
+            SCacheRefreshStart(ctx, cache, query, len, entries[i]);
+        RedisModule_CloseKey(key);
+        // A subsumed miss replaces its entry, its stale resultset is not used
+        if ((NULL == entries[i])&&(cache->subsume))
+            entries[i] = SCacheSubsume(ctx, cache, query, len);
+        if (NULL == entries[i])
+            misses++;
+    }
+
+    if (0 == misses) {
+        if (multi)
+            RedisModule_ReplyWithArray(ctx, count);
+        for (int i = 0; i < count; i++)
+            RedisModule_ReplyWithResultset(ctx, entries[i], kind);
+        return REDISMODULE_OK;
+    }
+
+    // Not found : populate the missing resultsets from the underlying DB
+    FetchRequest* request = RedisModule_Calloc(1, sizeof(FetchRequest)+sizeof(FetchJob)*count);
+    request->cache = cache;
+    cache->refcount++;
+    request->kind = kind;
+    request->multi = multi;
+    request->count = count;
+    request->generation = cache->generation;
+    for (int i = 0; i < count; i++) {
+        FetchJob* job = &request->jobs[i];
+        const char* query = RedisModule_StringPtrLen(argv[i+first], &job->len);
+        job->request = request;
+        job->query = RedisModule_Alloc(job->len+1);
+        memcpy(job->query, query, job->len);
+        job->query[job->len] = 0;
+        job->bypass = bypass[i];
+        if (entries[i]) {
+            job->result = SCacheResultsetCopy(entries[i]);
         } else {
-            // Cache definition not in the list
-            RedisModule_ReplyWithError(ctx,"ERR Cache definition not found.");
+            job->trace = SCacheTraceStart(&job->tracebuf, start);
+            SCacheTraceStage(job->trace, SCACHE_STAGE_LOOKUP);
+        }
+    }
+
+    // Shed misses are served stale, if possible, or fail fast
+    int noblock = RedisModule_GetContextFlags(ctx) &
+            (REDISMODULE_CTX_FLAGS_MULTI|REDISMODULE_CTX_FLAGS_LUA|REDISMODULE_CTX_FLAGS_DENY_BLOCKING);
+    const char* shed = SCacheAdmit(cache, misses, !noblock);
+    if (shed) {
+        for (int i = 0; i < count; i++) {
+            FetchJob* job = &request->jobs[i];
+            if (NULL != job->result)
+                continue;
+            job->result = ((stale)&&(stale[i])) ? SCacheResultsetCopy(stale[i]) : SCacheResultsetFailed(shed);
+        }
+        SCacheFetchReply(ctx, request);
+        SCacheFetchRequestFree(request);
+        return REDISMODULE_OK;
+    }
+
+    // Blocking is not allowed in transactions and scripts, fetch inline using
+    // the control connection
+    if (noblock) {
+        void* conn = SCacheControlConn(cache);
+        for (int i = 0; i < count; i++) {
+            FetchJob* job = &request->jobs[i];
+            if (NULL != job->result)
+                continue;
+            if (NULL == conn)
+                job->result = SCacheResultsetFailed("ERR cache not connected to DB yet");
+            else
+                job->result = SCacheResultsetFetch(cache->backend, conn,
+                        job->query, job->len, job->trace);
         }
+        SCacheFetchReply(ctx, request);
+        SCacheFetchRequestFree(request);
+        return REDISMODULE_OK;
     }
+
+    // Blocks the client connection until the last miss is fetched
+    if (timeout < 0)
+        timeout = cache->timeout;
+    request->pending = misses;
+    request->deadline = timeout ? RedisModule_Milliseconds() + timeout : 0;
+    request->bc = RedisModule_BlockClient(ctx,
+            SCacheFetch_Reply,
+            timeout ? SCacheFetch_Timeout : NULL,
+            SCacheFetch_FreeData,
+            timeout);
+    SCacheEnqueue(cache, request);
+
     return REDISMODULE_OK;
 }
 
-// Queries the underlying DB to populate the keys (names, types and values) in the cache with TTL 
-int SCachePopulate(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    REDISMODULE_NOT_USED(argv);
-    REDISMODULE_NOT_USED(argc);
+// Gets values from the cache (eventually fetching them from underlying database)
+// SCACHE.GETVALUE <cachename> [TIMEOUT <ms>] <query>
+int SCacheGetValue_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return SCacheGet(ctx, argv, argc, SCACHE_REPLY_VALUE, 0);
+}
 
-    if (argc != 3) return RedisModule_WrongArity(ctx);
+// Gets resultset's meta data from the cache (eventually fetching them from underlying database)
+// SCACHE.GETMETA <cachename> [TIMEOUT <ms>] <query>
+int SCacheGetMeta_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return SCacheGet(ctx, argv, argc, SCACHE_REPLY_META, 0);
+}
 
-    RedisModule_AutoMemory(ctx);
+// Gets the values of several queries from the same cache, the misses are
+// fetched in parallel on the cache connections
+// SCACHE.MGET <cachename> [TIMEOUT <ms>] <query> [<query> ...]
+int SCacheMGet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return SCacheGet(ctx, argv, argc, SCACHE_REPLY_VALUE, 1);
+}
 
+// Mirrors a whole table of a cache database in memory, with hash indexes on
+// some of its columns for scache.lookup. The table is loaded in the
+// background, then reloaded every INTERVAL seconds, and whenever the command
+// is run again, after a change of the table. The definition is replicated
+// and saved in the RDB snapshots.
+// SCACHE.MIRROR <cachename> <table> [INTERVAL <s>] [INDEX <column> [<column> ...]]
+// SCACHE.MIRROR <cachename> <table> DROP
+int SCacheMirror_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc < 3) return RedisModule_WrongArity(ctx);
+    CacheDetails* cache = SCacheGetCache(RedisModule_StringPtrLen(argv[1], NULL));
+    if (NULL == cache)
+        return RedisModule_ReplyWithError(ctx,"ERR cache definition not found.");
     size_t len;
-    const char* cachename = RedisModule_StringPtrLen(argv[1], &len);
+    const char* table = RedisModule_StringPtrLen(argv[2], &len);
+    if ((strlen(table) != len)||(!SCacheIsIdent(table, len, 1)))
+        return RedisModule_ReplyWithError(ctx,"ERR invalid table name");
+    SCacheMirror* mirror = SCacheMirrorGet(cache, table);
 
-    CacheDetails* cur=CacheList;
-    while ((cur)&&strcmp(cur->cachename,cachename))
-        cur=cur->next;
+    if ((4 == argc)&&(!strcasecmp(RedisModule_StringPtrLen(argv[3], NULL), "drop"))) {
+        if (NULL == mirror)
+            return RedisModule_ReplyWithError(ctx,"ERR table not mirrored");
+        SCacheMirror** cur = &cache->mirrors;
+        while (*cur != mirror)
+            cur = &(*cur)->next;
+        *cur = mirror->next;
+        if (mirror->loading)
+            mirror->dropped = 1;
+        else
+            SCacheMirrorFree(mirror);
+        RedisModule_ReplicateVerbatim(ctx);
+        return RedisModule_ReplyWithSimpleString(ctx, "OK");
+    }
 
-    if (NULL == cur) {
-        RedisModule_ReplyWithError(ctx,"ERR cache definition not found.");
-        return REDISMODULE_OK;
+    long long interval = 0;
+    int first = argc;
+    for (int i = 3; i < argc; i += 2) {
+        const char* option = RedisModule_StringPtrLen(argv[i], NULL);
+        if (!strcasecmp(option, "index")) {
+            first = i+1;
+            break;
+        } else if ((!strcasecmp(option, "interval"))&&(i+1 < argc)) {
+            if ((REDISMODULE_OK != RedisModule_StringToLongLong(argv[i+1], &interval))
+                    ||(interval < 0)||(interval > UINT32_MAX/1000))
+                return RedisModule_ReplyWithError(ctx,"ERR invalid interval");
+        } else
+            return RedisModule_ReplyWithError(ctx,"ERR syntax error, expected INTERVAL, INDEX or DROP");
+    }
+    if (first == argc)
+        return RedisModule_ReplyWithError(ctx,"ERR at least one INDEX column expected");
+    for (int i = first; i < argc; i++) {
+        const char* column = RedisModule_StringPtrLen(argv[i], &len);
+        if ((strlen(column) != len)||(!SCacheIsIdent(column, len, 0)))
+            return RedisModule_ReplyWithError(ctx,"ERR invalid column name");
     }
 
-    // Execute the underlying query
-    const char* query = RedisModule_StringPtrLen(argv[2], &len);
-    int state = mysql_query(cur->dbhandle, query);
+    // A new definition, or the new columns of an existing one, loaded as soon
+    // as possible. The previous copy is served until then.
+    if (NULL == mirror)
+        mirror = SCacheMirrorAdd(cache, table);
+    for (uint32_t i = 0; i < mirror->nindexed; i++)
+        RedisModule_Free(mirror->indexed[i]);
+    mirror->nindexed = argc-first;
+    mirror->indexed = RedisModule_Realloc(mirror->indexed, sizeof(char*)*mirror->nindexed);
+    for (int i = first; i < argc; i++)
+        mirror->indexed[i-first] = RedisModule_Strdup(RedisModule_StringPtrLen(argv[i], NULL));
+    mirror->interval = interval;
+    mirror->due = 0;
 
-    if( state != 0 ) {
-        // Underlying error
-        const char *error = mysql_error(cur->dbhandle);
-        RedisModule_ReplyWithError(ctx,error);
+    RedisModule_ReplicateVerbatim(ctx);
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+// Looks up the rows of a mirrored table by the value of an indexed column, in
+// O(1), without any resultset entry nor database access. Replies with the
+// pipe-separated values of the rows, like scache.getvalue.
+// SCACHE.LOOKUP <cachename> <table> <column> <value>
+int SCacheLookup_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 5) return RedisModule_WrongArity(ctx);
+    CacheDetails* cache = SCacheGetCache(RedisModule_StringPtrLen(argv[1], NULL));
+    if (NULL == cache)
+        return RedisModule_ReplyWithError(ctx,"ERR cache definition not found.");
+    SCacheMirror* mirror = SCacheMirrorGet(cache, RedisModule_StringPtrLen(argv[2], NULL));
+    if (NULL == mirror)
+        return RedisModule_ReplyWithError(ctx,"ERR table not mirrored");
+    if (NULL == mirror->data)
+        return RedisModule_ReplyWithError(ctx, mirror->error ? mirror->error : "ERR table not loaded yet");
+    size_t len;
+    const char* name = RedisModule_StringPtrLen(argv[3], &len);
+    SCacheColumn* column = SCacheMirrorIndexed(mirror->data, name, len);
+    if (NULL == column)
+        return RedisModule_ReplyWithError(ctx,"ERR column not indexed");
+    const char* value = RedisModule_StringPtrLen(argv[4], &len);
+    SCacheMirrorReplyLookup(ctx, mirror->data, column, value, len);
+    return REDISMODULE_OK;
+}
+
+// Pre-populates a cache, from a list of queries or from a driving query whose
+// rows produce the parameters of a query template. Replies with the number
+// of queries, of filled resultsets and of errors once the warming is done.
+// SCACHE.WARM <cachename> [RATE <n>] QUERIES <query> [<query> ...]
+// SCACHE.WARM <cachename> [RATE <n>] DRIVER <drivingquery> <template>
+int SCacheWarm_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (RedisModule_IsKeysPositionRequest(ctx)) {
+        SCacheDeclareKeys(ctx, argv, argc, argc);
         return REDISMODULE_OK;
-    } else {
-        // Fetch resultset
-        MYSQL_RES* result = mysql_store_result(cur->dbhandle);
-        if( result == (MYSQL_RES *)NULL ) {
-            const char *error = mysql_error(cur->dbhandle);
-            RedisModule_ReplyWithError(ctx,error);
-        }
-
-        // Build value and meta keynames cachename::query::value/cachename::query::meta
-        RedisModuleString *valuekey = RedisModule_CreateStringFromString(ctx,argv[1]);
-        RedisModule_StringAppendBuffer(ctx,valuekey,"::",2);
-        RedisModule_StringAppendBuffer(ctx,valuekey,query,len);
-        RedisModuleString *metakey = RedisModule_CreateStringFromString(ctx,valuekey);
-        RedisModule_StringAppendBuffer(ctx,valuekey,"::value",7);
-        RedisModule_StringAppendBuffer(ctx,metakey,"::meta",6);
-
-        // Cache results meta
-        unsigned int num_fields = mysql_num_fields(result);
-        MYSQL_FIELD *fields = mysql_fetch_fields(result);
-        RedisModuleString* tmp=NULL;
-        unsigned int i=0;
-        char* name;
-        char* type;
-        while (i < num_fields) {
-            name = RedisModule_Strdup(fields[i].name);
-            switch (fields[i].type) {
-                case MYSQL_TYPE_TINY: type = RedisModule_Strdup("MYSQL_TYPE_TINY"); break;
-                case MYSQL_TYPE_SHORT: type = RedisModule_Strdup("MYSQL_TYPE_SHORT"); break;
-                case MYSQL_TYPE_LONG: type = RedisModule_Strdup("MYSQL_TYPE_LONG"); break;
-                case MYSQL_TYPE_INT24: type = RedisModule_Strdup("MYSQL_TYPE_INT24"); break;
-                case MYSQL_TYPE_LONGLONG: type = RedisModule_Strdup("MYSQL_TYPE_LONGLONG"); break;
-                case MYSQL_TYPE_DECIMAL: type = RedisModule_Strdup("MYSQL_TYPE_DECIMAL"); break;
-                case MYSQL_TYPE_NEWDECIMAL: type = RedisModule_Strdup("MYSQL_TYPE_NEWDECIMAL"); break;
-                case MYSQL_TYPE_FLOAT: type = RedisModule_Strdup("MYSQL_TYPE_FLOAT"); break;
-                case MYSQL_TYPE_DOUBLE: type = RedisModule_Strdup("MYSQL_TYPE_DOUBLE"); break;
-                case MYSQL_TYPE_BIT: type = RedisModule_Strdup("MYSQL_TYPE_BIT"); break;
-                case MYSQL_TYPE_TIMESTAMP: type = RedisModule_Strdup("MYSQL_TYPE_TIMESTAMP"); break;
-                case MYSQL_TYPE_DATE: type = RedisModule_Strdup("MYSQL_TYPE_DATE"); break;
-                case MYSQL_TYPE_TIME: type = RedisModule_Strdup("MYSQL_TYPE_TIME"); break;
-                case MYSQL_TYPE_DATETIME: type = RedisModule_Strdup("MYSQL_TYPE_DATETIME"); break;
-                case MYSQL_TYPE_YEAR: type = RedisModule_Strdup("MYSQL_TYPE_YEAR"); break;
-                case MYSQL_TYPE_STRING: type = RedisModule_Strdup("MYSQL_TYPE_STRING"); break;
-                case MYSQL_TYPE_VAR_STRING: type = RedisModule_Strdup("MYSQL_TYPE_VAR_STRING"); break;
-                case MYSQL_TYPE_BLOB: type = RedisModule_Strdup("MYSQL_TYPE_BLOB"); break;
-                case MYSQL_TYPE_SET: type = RedisModule_Strdup("MYSQL_TYPE_SET"); break;
-                case MYSQL_TYPE_ENUM: type = RedisModule_Strdup("MYSQL_TYPE_ENUM"); break;
-                case MYSQL_TYPE_GEOMETRY: type = RedisModule_Strdup("MYSQL_TYPE_GEOMETRY"); break;
-                case MYSQL_TYPE_NULL: type = RedisModule_Strdup("MYSQL_TYPE_NULL"); break;
-                default: type = RedisModule_Strdup("UNKNOWN"); break;
-            }
-            tmp = RedisModule_CreateString(ctx,name,strlen(name));
-            RedisModule_StringAppendBuffer(ctx,tmp,"|",1);
-            RedisModule_StringAppendBuffer(ctx,tmp,type,strlen(type));
-            RedisModule_Call(ctx,"RPUSH","ss",metakey,tmp);
-            RedisModule_FreeString(ctx,tmp);
-            RedisModule_Free(name);
-            RedisModule_Free(type);
-            i++;
-        }
+    }
+    if (argc < 4) return RedisModule_WrongArity(ctx);
 
-        // Cache result values
-        MYSQL_ROW row;
-        char* rowstr;
-        char* value;
-        uint16_t count=0;
-        while (NULL != (row = mysql_fetch_row(result))) {
-            rowstr = RedisModule_Strdup("");
-            for(i = 0; i < num_fields; i++) {
-                value = (char*)(row[i] ? row[i] : "NULL");
-                rowstr = (char*)RedisModule_Realloc(rowstr,strlen(rowstr)+1+strlen(value)+1);
-                strcat(rowstr,"|");
-                strcat(rowstr,value);
-            }
-            RedisModule_Call(ctx,"RPUSH","sc",valuekey,&rowstr[1],strlen(&rowstr[1]));
-            RedisModule_Free(rowstr);
-            count++;
-        }
+    CacheDetails* cache = SCacheGetCache(RedisModule_StringPtrLen(argv[1], NULL));
+    if (NULL == cache)
+        return RedisModule_ReplyWithError(ctx,"ERR Cache definition not found.");
+    // The queries of a spread cache belong to slots of other nodes
+    if ((ClusterMode)&&(SCACHE_LAYOUT_SPREAD == cache->layout))
+        return RedisModule_ReplyWithError(ctx,"ERR only hashtag caches can be warmed in cluster mode");
+    if (RedisModule_GetContextFlags(ctx) &
+            (REDISMODULE_CTX_FLAGS_MULTI|REDISMODULE_CTX_FLAGS_LUA|REDISMODULE_CTX_FLAGS_DENY_BLOCKING))
+        return RedisModule_ReplyWithError(ctx,"ERR scache.warm cannot be called from transactions or scripts");
 
-        // Set expiration time (TTL) on the meta and value keys
-        RedisModule_Call(ctx,"EXPIRE","sl",metakey,cur->ttl);
-        RedisModule_Call(ctx,"EXPIRE","sl",valuekey,cur->ttl);
+    int i = 2;
+    long long rate = DefaultWarmRate;
+    if (!strcasecmp(RedisModule_StringPtrLen(argv[i], NULL), "rate")) {
+        if ((REDISMODULE_OK != RedisModule_StringToLongLong(argv[i+1], &rate))||(rate < 0))
+            return RedisModule_ReplyWithError(ctx,"ERR invalid rate");
+        i += 2;
+    }
+    if (i+1 >= argc) return RedisModule_WrongArity(ctx);
 
-        return REDISMODULE_OK;
+    const char* mode = RedisModule_StringPtrLen(argv[i], NULL);
+    WarmTask* warm;
+    if (!strcasecmp(mode, "queries")) {
+        warm = SCacheWarmCreate(cache, rate);
+        for (i++; i < argc; i++) {
+            size_t len;
+            const char* query = RedisModule_StringPtrLen(argv[i], &len);
+            SCacheWarmAddQuery(warm, query, len);
+        }
+    } else if (!strcasecmp(mode, "driver")) {
+        if (i+3 != argc) return RedisModule_WrongArity(ctx);
+        warm = SCacheWarmCreate(cache, rate);
+        warm->driver = RedisModule_Strdup(RedisModule_StringPtrLen(argv[i+1], NULL));
+        warm->template = RedisModule_Strdup(RedisModule_StringPtrLen(argv[i+2], NULL));
+    } else
+        return RedisModule_ReplyWithError(ctx,"ERR syntax error, expected QUERIES or DRIVER");
+
+    // Blocks the client connection until the warming is done
+    warm->bc = RedisModule_BlockClient(ctx,
+            SCacheWarm_Reply,
+            NULL,
+            SCacheWarm_FreeData,
+            0);
+    warm->ctx = RedisModule_GetThreadSafeContext(warm->bc);
+    if (REDISMODULE_OK != SCacheWarmStart(warm)) {
+        RedisModule_AbortBlock(warm->bc);
+        RedisModule_FreeThreadSafeContext(warm->ctx);
+        SCacheWarmFree(warm);
+        return RedisModule_ReplyWithError(ctx,"ERR Can't start thread");
     }
+    return REDISMODULE_OK;
 }
 
-// Gets values from the cache (eventually fetching them from underlying database)
-int SCacheGetValue_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    REDISMODULE_NOT_USED(argc);
-    REDISMODULE_NOT_USED(argv);
-    if (argc != 3) return RedisModule_WrongArity(ctx);
+// Lists the most expensive query fingerprints, sorted by cumulative DB time
+// SCACHE.SLOWLOG [<count>|RESET]
+// O(n log n) n = nb fingerprints
+int SCacheSlowlog_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc > 2) return RedisModule_WrongArity(ctx);
 
-    RedisModule_AutoMemory(ctx);
+    long long count = SlowlogMaxLen;
+    if (2 == argc) {
+        const char* arg = RedisModule_StringPtrLen(argv[1], NULL);
+        if (!strcasecmp(arg, "reset")) {
+            SlowlogEntry* cur;
+            RedisModuleDictIter* iter = RedisModule_DictIteratorStartC(SlowlogDict, "^", NULL, 0);
+            while (RedisModule_DictNextC(iter, NULL, (void**)&cur))
+                SCacheSlowlogFreeEntry(cur);
+            RedisModule_DictIteratorStop(iter);
+            RedisModule_FreeDict(NULL, SlowlogDict);
+            SlowlogDict = RedisModule_CreateDict(NULL);
+            return RedisModule_ReplyWithSimpleString(ctx, "OK");
+        }
+        if ((REDISMODULE_OK != RedisModule_StringToLongLong(argv[1], &count))||(count < 0))
+            return RedisModule_ReplyWithError(ctx,"ERR invalid count");
+    }
 
-    // Build the keys cachename::query::value
-    RedisModuleString *valuekey = RedisModule_CreateStringFromString(ctx,argv[1]);
-    RedisModule_StringAppendBuffer(ctx,valuekey,"::",2);
-    size_t len;
-    const char* query = RedisModule_StringPtrLen(argv[2], &len);
-    RedisModule_StringAppendBuffer(ctx,valuekey,query,len);
-    RedisModule_StringAppendBuffer(ctx,valuekey,"::value",7);
-
-    // Try to get the resultset from the built valuekey in the cache
-    RedisModuleCallReply *reply = RedisModule_Call(ctx,"LRANGE","scc",valuekey,"0","-1");
-    if (0 == RedisModule_CallReplyLength(reply)) {
-        // Not found : Populate it from the underlying DB and retry
-        // Forget the empty result
-        RedisModule_FreeCallReply(reply);
-        // Populate the cache using the underlying database
-        SCachePopulate(ctx,argv,argc);
-        // Retry cache query
-        reply = RedisModule_Call(ctx,"LRANGE","scc",valuekey,"0","-1");
-    }
-
-    RedisModule_ReplyWithCallReply(ctx,reply);
+    // Snapshot and sort the table
+    size_t num = RedisModule_DictSize(SlowlogDict);
+    SlowlogEntry** entries = RedisModule_Alloc(sizeof(SlowlogEntry*)*(num+1));
+    size_t i = 0;
+    RedisModuleDictIter* iter = RedisModule_DictIteratorStartC(SlowlogDict, "^", NULL, 0);
+    while ((i<num)&&(RedisModule_DictNextC(iter, NULL, (void**)&entries[i])))
+        i++;
+    RedisModule_DictIteratorStop(iter);
+    qsort(entries, num, sizeof(SlowlogEntry*), SCacheSlowlogCompare);
+    if ((size_t)count < num) num = count;
+
+    RedisModule_ReplyWithArray(ctx, num);
+    for (i=0; i<num; i++) {
+        SlowlogEntry* cur = entries[i];
+        RedisModule_ReplyWithArray(ctx, 8);
+        RedisModule_ReplyWithStringBuffer(ctx, cur->cachename, strlen(cur->cachename));
+        RedisModule_ReplyWithStringBuffer(ctx, cur->query, strlen(cur->query));
+        RedisModule_ReplyWithLongLong(ctx, cur->calls);
+        RedisModule_ReplyWithLongLong(ctx, cur->misses);
+        RedisModule_ReplyWithLongLong(ctx, cur->dbtime);
+        RedisModule_ReplyWithLongLong(ctx, cur->maxdbtime);
+        RedisModule_ReplyWithLongLong(ctx, cur->rows);
+        RedisModule_ReplyWithLongLong(ctx, cur->bytes);
+    }
+    RedisModule_Free(entries);
     return REDISMODULE_OK;
 }
 
-// Gets resultset's meta data from the cache (eventually fetching them from underlying database)
-int SCacheGetMeta_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    REDISMODULE_NOT_USED(argc);
-    REDISMODULE_NOT_USED(argv);
-    if (argc != 3) return RedisModule_WrongArity(ctx);
+// Reports the sampled miss path tracing
+// SCACHE.TRACE STATS|RESET|LAST [<count>]
+int SCacheTrace_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if ((argc < 2)||(argc > 3)) return RedisModule_WrongArity(ctx);
 
-    RedisModule_AutoMemory(ctx);
+    const char* subcmd = RedisModule_StringPtrLen(argv[1], NULL);
+    if ((!strcasecmp(subcmd, "stats"))&&(2 == argc)) {
+        // Per stage : name, count, total, max, p50, p99, p99.9 (microseconds)
+        RedisModule_ReplyWithArray(ctx, SCACHE_STAGES);
+        for (int stage = 0; stage < SCACHE_STAGES; stage++) {
+            StageHistogram* hist = &TraceHistograms[stage];
+            RedisModule_ReplyWithArray(ctx, 7);
+            RedisModule_ReplyWithCString(ctx, SCacheStageNames[stage]);
+            RedisModule_ReplyWithLongLong(ctx, hist->count);
+            RedisModule_ReplyWithLongLong(ctx, hist->total);
+            RedisModule_ReplyWithLongLong(ctx, hist->max);
+            RedisModule_ReplyWithLongLong(ctx, SCacheHistogramPercentile(hist, 50));
+            RedisModule_ReplyWithLongLong(ctx, SCacheHistogramPercentile(hist, 99));
+            RedisModule_ReplyWithLongLong(ctx, SCacheHistogramPercentile(hist, 99.9));
+        }
+    } else if ((!strcasecmp(subcmd, "reset"))&&(2 == argc)) {
+        memset(TraceHistograms, 0, sizeof(TraceHistograms));
+        for (uint32_t i = 0; i < TraceMaxLen; i++)
+            if (TraceRing[i].cachename) SCacheTraceFreeRecord(&TraceRing[i]);
+        TraceRingNext = 0;
+        RedisModule_ReplyWithSimpleString(ctx, "OK");
+    } else if (!strcasecmp(subcmd, "last")) {
+        long long count = TraceMaxLen;
+        if ((3 == argc)&&((REDISMODULE_OK != RedisModule_StringToLongLong(argv[2], &count))||(count < 0)))
+            return RedisModule_ReplyWithError(ctx,"ERR invalid count");
+
+        // Most recent traces first
+        long long replied = 0;
+        RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+        for (uint32_t i = 1; (i <= TraceMaxLen)&&(replied < count); i++) {
+            TraceRecord* record = &TraceRing[(TraceRingNext + TraceMaxLen - i) % TraceMaxLen];
+            if (NULL == record->cachename) break;
+            RedisModule_ReplyWithArray(ctx, 5);
+            RedisModule_ReplyWithCString(ctx, record->cachename);
+            RedisModule_ReplyWithCString(ctx, record->query);
+            RedisModule_ReplyWithLongLong(ctx, record->timestamp);
+            RedisModule_ReplyWithLongLong(ctx, record->total);
+            RedisModule_ReplyWithArray(ctx, SCACHE_STAGES*2);
+            for (int stage = 0; stage < SCACHE_STAGES; stage++) {
+                RedisModule_ReplyWithCString(ctx, SCacheStageNames[stage]);
+                RedisModule_ReplyWithLongLong(ctx, record->stages[stage]);
+            }
+            replied++;
+        }
+        RedisModule_ReplySetArrayLength(ctx, replied);
+    } else
+        RedisModule_ReplyWithError(ctx,"ERR unknown subcommand, try STATS, LAST or RESET");
 
-    // Build the meta key cachename::query::meta
-    RedisModuleString *valuekey = RedisModule_CreateStringFromString(ctx,argv[1]);
-    RedisModule_StringAppendBuffer(ctx,valuekey,"::",2);
-    size_t len;
-    const char* query = RedisModule_StringPtrLen(argv[2], &len);
-    RedisModule_StringAppendBuffer(ctx,valuekey,query,len);
-    RedisModule_StringAppendBuffer(ctx,valuekey,"::meta",6);
-
-    // Try to fetch the meta from the built meta key, from the cache
-    RedisModuleCallReply *reply = RedisModule_Call(ctx,"LRANGE","scc",valuekey,"0","-1");
-    if (0 == RedisModule_CallReplyLength(reply)) {
-        // Not found : populate the cache from the underlying DB and retry
-        // Forget the empty result
-        RedisModule_FreeCallReply(reply);
-        // Populate the cache using the underlying database
-        SCachePopulate(ctx,argv,argc);
-        // Retry cache query
-        reply = RedisModule_Call(ctx,"LRANGE","scc",valuekey,"0","-1");
-    }
-
-    RedisModule_ReplyWithCallReply(ctx,reply);
     return REDISMODULE_OK;
 }
 
 // Module initialization
+// MODULE LOAD scache.so [slowlog-max-len <n>] [trace-sample-rate <n>] [trace-max-len <n>]
+//                        [backend-dir <path>] [pool-size <n>] [batch-size <n>] [batch-wait <us>]
+//                        [warm-file <path>] [warm-rate <n>] [connect-timeout <ms>]
 int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    REDISMODULE_NOT_USED(argv);
-    REDISMODULE_NOT_USED(argc);
-
     if (RedisModule_Init(ctx,"scache",1,REDISMODULE_APIVER_1)
             == REDISMODULE_ERR) return REDISMODULE_ERR;
 
+    // Module arguments are <name> <value> pairs
+    for (int i=0; i<argc; i+=2) {
+        const char* name = RedisModule_StringPtrLen(argv[i], NULL);
+        if (i+1 >= argc) {
+            RedisModule_Log(ctx, "warning", "Missing value for module argument %s", name);
+            return REDISMODULE_ERR;
+        }
+        if (!strcasecmp(name, "backend-dir")) {
+            RedisModule_Free(BackendDir);
+            BackendDir = RedisModule_Strdup(RedisModule_StringPtrLen(argv[i+1], NULL));
+            continue;
+        }
+        if (!strcasecmp(name, "warm-file")) {
+            if (REDISMODULE_OK != SCacheWarmLoadFile(ctx, RedisModule_StringPtrLen(argv[i+1], NULL)))
+                return REDISMODULE_ERR;
+            continue;
+        }
+        long long value;
+        if (REDISMODULE_OK != RedisModule_StringToLongLong(argv[i+1], &value)) {
+            RedisModule_Log(ctx, "warning", "Invalid value for module argument %s", name);
+            return REDISMODULE_ERR;
+        }
+        if ((!strcasecmp(name, "slowlog-max-len"))&&(value >= 0))
+            SlowlogMaxLen = value;
+        else if ((!strcasecmp(name, "trace-sample-rate"))&&(value >= 0))
+            TraceSampleRate = value;
+        else if ((!strcasecmp(name, "trace-max-len"))&&(value >= 0))
+            TraceMaxLen = value;
+        else if ((!strcasecmp(name, "pool-size"))&&(value >= 1)&&(value <= 1024))
+            DefaultPoolSize = value;
+        else if ((!strcasecmp(name, "batch-size"))&&(value >= 1)&&(value <= SCACHE_MAX_BATCH))
+            DefaultBatchSize = value;
+        else if ((!strcasecmp(name, "batch-wait"))&&(value >= 0)&&(value <= 1000000))
+            DefaultBatchWait = value;
+        else if ((!strcasecmp(name, "warm-rate"))&&(value >= 0)&&(value <= UINT32_MAX))
+            DefaultWarmRate = value;
+        else if ((!strcasecmp(name, "connect-timeout"))&&(value >= 1)&&(value <= 3600000))
+            ConnectTimeout = value;
+        else {
+            RedisModule_Log(ctx, "warning", "Unknown module argument %s", name);
+            return REDISMODULE_ERR;
+        }
+    }
+
+    // Backends are searched next to the module by default
+    if (NULL == BackendDir) {
+        Dl_info info;
+        if ((dladdr((void*)SCacheBackendGet, &info))&&(info.dli_fname)&&(strrchr(info.dli_fname,'/'))) {
+            BackendDir = RedisModule_Strdup(info.dli_fname);
+            *strrchr(BackendDir,'/') = 0;
+        } else
+            BackendDir = RedisModule_Strdup(".");
+    }
+
+    RedisModuleTypeMethods tm = {
+        .version = REDISMODULE_TYPE_METHOD_VERSION,
+        .rdb_load = SCacheEntry_RdbLoad,
+        .rdb_save = SCacheEntry_RdbSave,
+        .aof_rewrite = SCacheEntry_AofRewrite,
+        .mem_usage = SCacheEntry_MemUsage,
+        .free = SCacheEntry_Free,
+        .aux_load = SCacheDefinitions_AuxLoad,
+        .aux_save = SCacheDefinitions_AuxSave,
+        .aux_save_triggers = REDISMODULE_AUX_BEFORE_RDB
+    };
+    SCacheEntryType = RedisModule_CreateDataType(ctx, "scache-rs", SCACHE_ENTRY_ENCVER, &tm);
+    if (NULL == SCacheEntryType) return REDISMODULE_ERR;
+
+    if (RedisModule_GetContextFlags(ctx) & REDISMODULE_CTX_FLAGS_CLUSTER) {
+        ClusterMode = 1;
+        SCacheSlotTagsInit();
+    }
+
+    SweepCursor = RedisModule_ScanCursorCreate();
+    RedisModule_CreateTimer(ctx, SCACHE_WHEEL_TICK, SCacheExpire_Timer, NULL);
+
+    SlowlogDict = RedisModule_CreateDict(NULL);
+    TraceRing = RedisModule_Calloc(TraceMaxLen ? TraceMaxLen : 1, sizeof(TraceRecord));
+
     if (RedisModule_CreateCommand(ctx,"scache.create",
                 SCacheCreate_RedisCommand,"write deny-oom no-monitor fast",0,0,0) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
 
+    if (RedisModule_CreateCommand(ctx,"scache.define",
+                SCacheDefine_RedisCommand,"write deny-oom no-monitor",0,0,0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
     if (RedisModule_CreateCommand(ctx,"scache.list",
                 SCacheList_RedisCommand,"readonly deny-oom fast",0,0,0) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
@@ -574,20 +5451,48 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
                 SCacheTest_RedisCommand,"readonly deny-oom fast",0,0,0) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
 
+    if (RedisModule_CreateCommand(ctx,"scache.nodes",
+                SCacheNodes_RedisCommand,"readonly fast",0,0,0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
     if (RedisModule_CreateCommand(ctx,"scache.flush",
-                SCacheFlush_RedisCommand,"readonly deny-oom fast",0,0,0) == REDISMODULE_ERR)
+                SCacheFlush_RedisCommand,"write fast",0,0,0) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
 
     if (RedisModule_CreateCommand(ctx,"scache.delete",
-                SCacheDelete_RedisCommand,"readonly deny-oom fast",0,0,0) == REDISMODULE_ERR)
+                SCacheDelete_RedisCommand,"write deny-oom fast",0,0,0) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
 
     if (RedisModule_CreateCommand(ctx,"scache.getvalue",
-                SCacheGetValue_RedisCommand,"write deny-oom fast",0,0,0) == REDISMODULE_ERR)
+                SCacheGetValue_RedisCommand,"readonly deny-oom fast getkeys-api",0,0,0) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
 
     if (RedisModule_CreateCommand(ctx,"scache.getmeta",
-                SCacheGetMeta_RedisCommand,"write deny-oom fast",0,0,0) == REDISMODULE_ERR)
+                SCacheGetMeta_RedisCommand,"readonly deny-oom fast getkeys-api",0,0,0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"scache.mget",
+                SCacheMGet_RedisCommand,"readonly deny-oom fast getkeys-api",0,0,0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"scache.mirror",
+                SCacheMirror_RedisCommand,"write deny-oom",0,0,0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"scache.lookup",
+                SCacheLookup_RedisCommand,"readonly fast",0,0,0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"scache.warm",
+                SCacheWarm_RedisCommand,"readonly deny-oom getkeys-api",0,0,0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"scache.slowlog",
+                SCacheSlowlog_RedisCommand,"readonly",0,0,0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"scache.trace",
+                SCacheTrace_RedisCommand,"readonly",0,0,0) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
 
     return REDISMODULE_OK;
@@ -0,0 +1,478 @@
+///         @file  scache_test.c
+///        @brief  SmartCache module unit tests
+///       @author  François Cerbelle (Fanfan), francois@cerbelle.net
+///    @copyright  Copyright (c) 2017, François Cerbelle
+///
+/// Calls the pure functions of the module directly, without Redis : the
+/// parsing and filtering of the subsumed queries, the classification of the
+/// uncacheable ones, and the queries and merges of the incremental refills.
+/// The resultsets are fetched from an in-memory database with the SQLite
+/// backend, so that they are encoded and typed like the cached ones. The
+/// module API functions used are plain libc ones.
+///
+/// Run with "make test", the SQLite backend is loaded from the current
+/// directory.
+///
+///  This source code is released for free distribution under the terms of the
+///  GNU General Public License as published by the Free Software Foundation.
+///
+
+#include "scache.c"
+#include <stdio.h>
+
+static int Failures = 0;
+static int Checks = 0;
+
+#define CHECK(cond) do { \
+    Checks++; \
+    if (!(cond)) { \
+        Failures++; \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    } \
+} while (0)
+
+static void* TestAlloc(size_t bytes) { return malloc(bytes); }
+static void* TestCalloc(size_t nmemb, size_t size) { return calloc(nmemb, size); }
+static void* TestRealloc(void* ptr, size_t bytes) { return realloc(ptr, bytes); }
+static char* TestStrdup(const char* str) { return strdup(str); }
+static void TestLog(RedisModuleCtx* ctx, const char* level, const char* fmt, ...) {
+    REDISMODULE_NOT_USED(ctx);
+    REDISMODULE_NOT_USED(level);
+    REDISMODULE_NOT_USED(fmt);
+}
+
+static const SCacheBackend* Backend = NULL;
+static void* Conn = NULL;
+
+// Runs a statement, ignoring its resultset
+static void Exec(const char* query) {
+    SCacheResultset* result = SCacheResultsetFetch(Backend, Conn, query, strlen(query), NULL);
+    if (result->error)
+        fprintf(stderr, "%s: %s\n", query, result->error);
+    SCacheResultsetFree(result);
+}
+
+static SCacheResultset* Fetch(const char* query) {
+    SCacheResultset* result = SCacheResultsetFetch(Backend, Conn, query, strlen(query), NULL);
+    CHECK(NULL == result->error);
+    return result;
+}
+
+// Returns true if the rows of a resultset are the given ones, in order
+static int RowsAre(SCacheResultset* result, const char** rows, uint64_t nrows) {
+    if ((NULL == result)||(result->nrows != nrows))
+        return 0;
+    for (uint64_t i = 0; i < nrows; i++)
+        if (strcmp(result->rows[i].ptr, rows[i]))
+            return 0;
+    return 1;
+}
+
+// Returns true if two resultsets hold the same rows, whatever their order
+static int SameRows(SCacheResultset* a, SCacheResultset* b) {
+    if ((NULL == a)||(NULL == b)||(a->nrows != b->nrows))
+        return 0;
+    for (uint64_t i = 0; i < a->nrows; i++) {
+        uint64_t inb = 0;
+        uint64_t ina = 0;
+        for (uint64_t j = 0; j < b->nrows; j++)
+            inb += !strcmp(a->rows[i].ptr, b->rows[j].ptr);
+        for (uint64_t j = 0; j < a->nrows; j++)
+            ina += !strcmp(a->rows[i].ptr, a->rows[j].ptr);
+        if (ina != inb)
+            return 0;
+    }
+    return 1;
+}
+
+// Answers a query from a superset, NULL if it is fetched from the database
+static SCacheResultset* Subsume(SCacheResultset* superset, int star, const char* query) {
+    SCacheSelect select;
+    if (SCacheSelectParse(query, strlen(query), &select))
+        return NULL;
+    SCacheResultset* result = SCacheSubsumeFrom(superset, star, &select);
+    SCacheSelectFree(&select);
+    return result;
+}
+
+// The subsumed resultset must be the one of the database
+static void CheckSubsumed(SCacheResultset* superset, int star, const char* query) {
+    SCacheResultset* subsumed = Subsume(superset, star, query);
+    SCacheResultset* fetched = Fetch(query);
+    CHECK(NULL != subsumed);
+    CHECK(SameRows(subsumed, fetched));
+    SCacheResultsetFree(subsumed);
+    SCacheResultsetFree(fetched);
+}
+
+static void CheckNotSubsumed(SCacheResultset* superset, int star, const char* query) {
+    SCacheResultset* subsumed = Subsume(superset, star, query);
+    CHECK(NULL == subsumed);
+    SCacheResultsetFree(subsumed);
+}
+
+static void TestSelectParse(void) {
+    SCacheSelect select;
+    const char* query = "SELECT id, name FROM t WHERE name = 'a|b' AND n >= -2.5 AND s IS NOT NULL "
+        "ORDER BY n DESC, id LIMIT 5, 10";
+    CHECK(0 == SCacheSelectParse(query, strlen(query), &select));
+    CHECK((!select.star)&&(2 == select.ncolumns));
+    CHECK((1 == select.table.len)&&('t' == *select.table.ptr));
+    CHECK(3 == select.nconds);
+    CHECK((SCACHE_OP_EQ == select.conds[0].op)&&(select.conds[0].quoted)&&
+            (3 == select.conds[0].value.len)&&(!memcmp(select.conds[0].value.ptr, "a|b", 3)));
+    CHECK((SCACHE_OP_GE == select.conds[1].op)&&(!select.conds[1].quoted)&&
+            (4 == select.conds[1].value.len)&&(!memcmp(select.conds[1].value.ptr, "-2.5", 4)));
+    CHECK(SCACHE_OP_NOTNULL == select.conds[2].op);
+    CHECK((2 == select.nsorts)&&(select.sorts[0].desc)&&(!select.sorts[1].desc));
+    CHECK((10 == select.limit)&&(5 == select.offset));
+    SCacheSelectFree(&select);
+
+    // Doubled quotes are unquoted, the WHERE conditions end at ORDER BY
+    query = "select * from t where s = 'it''s' order by id limit 3 offset 1";
+    CHECK(0 == SCacheSelectParse(query, strlen(query), &select));
+    CHECK((select.star)&&(1 == select.nconds));
+    CHECK((4 == select.conds[0].value.len)&&(!memcmp(select.conds[0].value.ptr, "it's", 4)));
+    CHECK(!strncmp(select.where, "order by", 8));
+    CHECK((3 == select.limit)&&(1 == select.offset));
+    SCacheSelectFree(&select);
+
+    query = "SELECT * FROM t";
+    CHECK(0 == SCacheSelectParse(query, strlen(query), &select));
+    CHECK((0 == select.nconds)&&(-1 == select.limit)&&(select.where == query+strlen(query)));
+    SCacheSelectFree(&select);
+
+    // Anything else is fetched from the database
+    const char* others[] = {
+        "SELECT * FROM t, u",
+        "SELECT * FROM t JOIN u ON t.id = u.id",
+        "SELECT a FROM t GROUP BY a",
+        "SELECT count(*) FROM t",
+        "SELECT * FROM t WHERE a = 1 OR b = 2",
+        "SELECT * FROM t WHERE a = b",
+        "SELECT * FROM t WHERE a IN (1, 2)",
+        "SELECT DISTINCT a FROM t",
+        "SELECT * FROM t WHERE s = 'unterminated",
+        "UPDATE t SET a = 1",
+        NULL
+    };
+    for (int i = 0; others[i]; i++) {
+        int parsed = (0 == SCacheSelectParse(others[i], strlen(others[i]), &select));
+        CHECK(!parsed);
+        if (parsed) {
+            fprintf(stderr, "  parsed: %s\n", others[i]);
+            SCacheSelectFree(&select);
+        }
+    }
+}
+
+static void TestCondMatch(void) {
+    SCacheCond cond = {{"n", 1}, SCACHE_OP_LT, {"10", 2}, 0, 0, 1};
+    SCacheToken nine = {"9", 1};
+    SCacheToken null = {"NULL", 4};
+    SCacheToken ten = {"10.0", 4};
+
+    // Numbers compare as numbers, strings as binary strings
+    CHECK(1 == SCacheCondMatch(&cond, &nine));
+    cond.op = SCACHE_OP_EQ;
+    CHECK(1 == SCacheCondMatch(&cond, &ten));
+    cond.numeric = 0;
+    cond.quoted = 1;
+    CHECK(0 == SCacheCondMatch(&cond, &ten));
+    cond.op = SCACHE_OP_LT;
+    CHECK(0 == SCacheCondMatch(&cond, &nine));
+
+    // A NULL of a numeric column is a SQL NULL, of a string column it may
+    // be the 'NULL' string
+    cond.numeric = 1;
+    CHECK(0 == SCacheCondMatch(&cond, &null));
+    cond.op = SCACHE_OP_NULL;
+    CHECK(1 == SCacheCondMatch(&cond, &null));
+    cond.op = SCACHE_OP_NOTNULL;
+    CHECK(0 == SCacheCondMatch(&cond, &null));
+    cond.numeric = 0;
+    CHECK(-1 == SCacheCondMatch(&cond, &null));
+    cond.op = SCACHE_OP_EQ;
+    CHECK(-1 == SCacheCondMatch(&cond, &null));
+}
+
+static void TestSubsume(void) {
+    Exec("CREATE TABLE t (id INTEGER, n INTEGER, s TEXT)");
+    Exec("INSERT INTO t VALUES (1, 10, 'x'), (2, 9, '10'), (3, 100, 'y'), (4, -5, '9'), "
+            "(5, 9, 'X'), (6, NULL, 'z')");
+    SCacheResultset* superset = Fetch("SELECT * FROM t");
+    CHECK(6 == superset->nrows);
+
+    // Numeric columns compare as numbers, string ones as strings
+    CheckSubsumed(superset, 1, "SELECT * FROM t WHERE n > 9");
+    CheckSubsumed(superset, 1, "SELECT id FROM t WHERE n <= 9.5");
+    CheckSubsumed(superset, 1, "SELECT id FROM t WHERE n = '9'");
+    CheckSubsumed(superset, 1, "SELECT id, s FROM t WHERE s > '10'");
+    CheckSubsumed(superset, 1, "SELECT id FROM t WHERE s = 'x'");
+    CheckSubsumed(superset, 1, "SELECT id FROM t WHERE n IS NULL");
+    CheckSubsumed(superset, 1, "SELECT id FROM t WHERE n IS NOT NULL AND n <> 9");
+    CheckSubsumed(superset, 1, "SELECT id FROM t WHERE s = 'a|b'");
+
+    // ORDER BY and LIMIT, NULLs first, ties in the superset order
+    CheckSubsumed(superset, 1, "SELECT id, n FROM t WHERE n IS NOT NULL ORDER BY n DESC LIMIT 2");
+    CheckSubsumed(superset, 1, "SELECT id FROM t ORDER BY n LIMIT 2 OFFSET 1");
+    CheckSubsumed(superset, 1, "SELECT id FROM t ORDER BY n, id DESC LIMIT 1, 3");
+    CheckSubsumed(superset, 1, "SELECT id FROM t ORDER BY s");
+    SCacheResultset* result = Subsume(superset, 1, "SELECT id FROM t WHERE n IS NOT NULL ORDER BY n LIMIT 3");
+    const char* lowest[] = {"4", "2", "5"};
+    CHECK(RowsAre(result, lowest, 3));
+    SCacheResultsetFree(result);
+    result = Subsume(superset, 1, "SELECT id FROM t LIMIT 2");
+    const char* first[] = {"1", "2"};
+    CHECK(RowsAre(result, first, 2));
+    SCacheResultsetFree(result);
+
+    // A number with a string column, or a string which is not a number
+    // with a numeric one, converts as the database does
+    CheckNotSubsumed(superset, 1, "SELECT id FROM t WHERE s = 10");
+    CheckNotSubsumed(superset, 1, "SELECT id FROM t WHERE n = 'abc'");
+    // Columns missing from a projected superset
+    SCacheResultset* projected = Fetch("SELECT id, n FROM t");
+    CheckSubsumed(projected, 0, "SELECT n FROM t WHERE id > 3");
+    CheckNotSubsumed(projected, 0, "SELECT * FROM t WHERE id > 3");
+    CheckNotSubsumed(projected, 0, "SELECT id FROM t WHERE s = 'x'");
+    SCacheResultsetFree(projected);
+    SCacheResultsetFree(superset);
+
+    // A 'NULL' string or a value holding a pipe cannot be told apart in the
+    // encoded rows
+    Exec("INSERT INTO t VALUES (7, 1, 'NULL')");
+    superset = Fetch("SELECT * FROM t");
+    CheckNotSubsumed(superset, 1, "SELECT id FROM t WHERE s = 'x'");
+    CheckNotSubsumed(superset, 1, "SELECT id FROM t WHERE s IS NULL");
+    CheckSubsumed(superset, 1, "SELECT id FROM t WHERE n > 5");
+    SCacheResultsetFree(superset);
+    Exec("UPDATE t SET s = 'a|b' WHERE id = 7");
+    superset = Fetch("SELECT * FROM t");
+    CheckNotSubsumed(superset, 1, "SELECT id FROM t WHERE n > 5");
+    SCacheResultsetFree(superset);
+    superset = Fetch("SELECT s, id FROM t");
+    CheckNotSubsumed(superset, 0, "SELECT id FROM t WHERE id > 5");
+    SCacheResultsetFree(superset);
+    Exec("DROP TABLE t");
+}
+
+static int Uncacheable(const char* query) {
+    char* normalized = malloc(strlen(query)+1);
+    size_t len = SCacheNormalizeQuery(query, strlen(query), normalized);
+    int uncacheable = SCacheUncacheable(normalized, len);
+    free(normalized);
+    return uncacheable;
+}
+
+static void TestUncacheable(void) {
+    const char* cacheable[] = {
+        "SELECT * FROM t WHERE id = 1",
+        "  select a, b from t order by a limit 10",
+        "WITH x AS (SELECT * FROM t) SELECT * FROM x",
+        "SELECT 'now()', 'a;b', '@x' FROM t",
+        "SELECT `now` FROM t",
+        "SELECT t.user, t.rand FROM t",
+        "SELECT * FROM t WHERE created > '2026-01-01'",
+        "SHOW TABLES",
+        "EXPLAIN SELECT * FROM t",
+        NULL
+    };
+    const char* uncacheable[] = {
+        "INSERT INTO t VALUES (1)",
+        "UPDATE t SET a = 1",
+        "delete from t",
+        "REPLACE INTO t VALUES (1)",
+        "CALL p()",
+        "SET @x = 1",
+        "SELECT * FROM t; DELETE FROM t",
+        "SELECT NOW()",
+        "SELECT * FROM t WHERE d > now ()",
+        "SELECT * FROM t WHERE d < CURRENT_TIMESTAMP",
+        "SELECT rand() FROM t",
+        "SELECT UUID()",
+        "SELECT LAST_INSERT_ID()",
+        "SELECT * FROM t WHERE id = @id",
+        "SELECT * FROM t FOR UPDATE",
+        "SELECT * FROM t FOR SHARE",
+        "SELECT * FROM t LOCK IN SHARE MODE",
+        "SELECT a INTO @a FROM t",
+        "SELECT * INTO OUTFILE '/tmp/x' FROM t",
+        NULL
+    };
+    for (int i = 0; cacheable[i]; i++) {
+        CHECK(!Uncacheable(cacheable[i]));
+        if (Uncacheable(cacheable[i])) fprintf(stderr, "  uncacheable: %s\n", cacheable[i]);
+    }
+    for (int i = 0; uncacheable[i]; i++) {
+        CHECK(Uncacheable(uncacheable[i]));
+        if (!Uncacheable(uncacheable[i])) fprintf(stderr, "  cacheable: %s\n", uncacheable[i]);
+    }
+}
+
+// Returns the incremental refill query of an entry, "" to refill it in full
+static char* Delta(CacheDetails* cache, SCacheResultset* entry, const char* query) {
+    size_t len;
+    char* delta = SCacheDeltaQuery(cache, entry, query, strlen(query), &len);
+    CHECK((NULL == delta)||(strlen(delta) == len));
+    return delta ? delta : strdup("");
+}
+
+static void CheckDelta(CacheDetails* cache, const char* query, const char* expected) {
+    SCacheResultset* entry = Fetch(query);
+    char* delta = Delta(cache, entry, query);
+    CHECK(!strcmp(delta, expected));
+    if (strcmp(delta, expected))
+        fprintf(stderr, "  %s -> %s\n", query, delta);
+    free(delta);
+    SCacheResultsetFree(entry);
+}
+
+// Refills an entry incrementally, the merged entry replaces it
+static SCacheResultset* Refill(CacheDetails* cache, SCacheResultset* entry, const char* query) {
+    char* delta = Delta(cache, entry, query);
+    CHECK(*delta);
+    SCacheResultset* fetched = Fetch(delta);
+    free(delta);
+    SCacheResultset* merged = SCacheDeltaMerge(cache, entry, fetched);
+    CHECK(NULL != merged);
+    SCacheResultsetFree(fetched);
+    SCacheResultsetFree(entry);
+    return merged;
+}
+
+static void TestDeltaQuery(void) {
+    CacheDetails cache = {0};
+    cache.incremental = "id";
+    Exec("CREATE TABLE ev (id INTEGER, k TEXT, upd TEXT)");
+    Exec("INSERT INTO ev VALUES (1, 'a', '2026-01-01 00:00:00'), (3, 'b', '2026-01-03 00:00:00'), "
+            "(2, 'c', '2026-01-02 00:00:00')");
+
+    // The watermark is included : the rows committed since with the same
+    // value are fetched too
+    CheckDelta(&cache, "SELECT * FROM ev", "SELECT * FROM ev WHERE id >= 3");
+    CheckDelta(&cache, "SELECT id, k FROM ev WHERE k <> 'z'  ORDER BY id",
+            "SELECT id, k FROM ev WHERE k <> 'z' AND id >= 3 ORDER BY id");
+    CheckDelta(&cache, "SELECT * FROM ev WHERE id > 1 order by ID asc",
+            "SELECT * FROM ev WHERE id > 1 AND id >= 3 order by ID asc");
+    // Refilled in full : LIMIT, other orders, the column not selected
+    CheckDelta(&cache, "SELECT * FROM ev LIMIT 2", "");
+    CheckDelta(&cache, "SELECT * FROM ev ORDER BY id DESC", "");
+    CheckDelta(&cache, "SELECT * FROM ev ORDER BY k", "");
+    CheckDelta(&cache, "SELECT k FROM ev", "");
+    CheckDelta(&cache, "SELECT count(*) FROM ev", "");
+
+    // String watermarks are quoted, backslashes refill in full
+    cache.incremental = "upd";
+    CheckDelta(&cache, "SELECT * FROM ev", "SELECT * FROM ev WHERE upd >= '2026-01-03 00:00:00'");
+    Exec("UPDATE ev SET upd = '2026-01-04 it''s' WHERE id = 3");
+    CheckDelta(&cache, "SELECT * FROM ev", "SELECT * FROM ev WHERE upd >= '2026-01-04 it''s'");
+    Exec("UPDATE ev SET upd = '2026-01-05 \\' WHERE id = 3");
+    CheckDelta(&cache, "SELECT * FROM ev", "");
+
+    // A numeric column ignores its NULLs
+    cache.incremental = "id";
+    Exec("INSERT INTO ev VALUES (NULL, 'n', NULL)");
+    CheckDelta(&cache, "SELECT * FROM ev", "SELECT * FROM ev WHERE id >= 3");
+    Exec("DROP TABLE ev");
+}
+
+static void TestDeltaMerge(void) {
+    CacheDetails cache = {0};
+    cache.incremental = "id";
+    Exec("CREATE TABLE ev (id INTEGER, k TEXT, upd TEXT)");
+    Exec("INSERT INTO ev VALUES (1, 'a', '2026-01-01'), (2, 'b', '2026-01-02'), (3, 'c', '2026-01-02')");
+
+    // Append-only : the rows at the watermark are not duplicated
+    const char* query = "SELECT id, k FROM ev ORDER BY id";
+    SCacheResultset* entry = Fetch(query);
+    Exec("INSERT INTO ev VALUES (4, 'd', '2026-01-03'), (5, 'e', '2026-01-03')");
+    entry = Refill(&cache, entry, query);
+    SCacheResultset* full = Fetch(query);
+    CHECK(SameRows(entry, full));
+    CHECK(entry->checksum == full->checksum);
+    CHECK((1 == entry->deltas)&&(!strcmp(entry->watermark, "5")));
+    SCacheResultsetFree(full);
+    // Nothing new : only the rows at the watermark are fetched again
+    entry = Refill(&cache, entry, query);
+    full = Fetch(query);
+    CHECK(SameRows(entry, full));
+    CHECK(2 == entry->deltas);
+    SCacheResultsetFree(full);
+    SCacheResultsetFree(entry);
+
+    // Versioned : with '>' the row committed later with the watermark value
+    // would be missed, the updated rows replace their previous version
+    cache.incremental = "upd";
+    cache.rowkey = "id";
+    query = "SELECT id, k, upd FROM ev";
+    entry = Fetch(query);
+    Exec("INSERT INTO ev VALUES (6, 'g', '2026-01-03')");
+    Exec("UPDATE ev SET k = 'B', upd = '2026-01-04' WHERE id = 2");
+    entry = Refill(&cache, entry, query);
+    full = Fetch(query);
+    CHECK(SameRows(entry, full));
+    CHECK(!strcmp(entry->watermark, "2026-01-04"));
+    SCacheResultsetFree(full);
+    // The pipe of a value makes its row impossible to key
+    Exec("UPDATE ev SET k = 'x|y', upd = '2026-01-05' WHERE id = 1");
+    char* delta = Delta(&cache, entry, query);
+    SCacheResultset* fetched = Fetch(delta);
+    CHECK(NULL == SCacheDeltaMerge(&cache, entry, fetched));
+    SCacheResultsetFree(fetched);
+    free(delta);
+    SCacheResultsetFree(entry);
+
+    // Without ROWKEY the equal rows are deduplicated, the updated ones are
+    // kept until the next full refill
+    cache.rowkey = NULL;
+    Exec("UPDATE ev SET k = 'a' WHERE id = 1");
+    entry = Fetch(query);
+    Exec("INSERT INTO ev VALUES (7, 'h', '2026-01-05')");
+    entry = Refill(&cache, entry, query);
+    full = Fetch(query);
+    CHECK(SameRows(entry, full));
+    SCacheResultsetFree(full);
+    SCacheResultsetFree(entry);
+
+    // A delta which does not fit its entry is refilled in full
+    entry = Fetch(query);
+    fetched = Fetch("SELECT id, k FROM ev");
+    CHECK(NULL == SCacheDeltaMerge(&cache, entry, fetched));
+    SCacheResultsetFree(fetched);
+    SCacheResultsetFree(entry);
+    Exec("DROP TABLE ev");
+}
+
+int main(void) {
+    RedisModule_Alloc = TestAlloc;
+    RedisModule_Calloc = TestCalloc;
+    RedisModule_Realloc = TestRealloc;
+    RedisModule_Free = free;
+    RedisModule_Strdup = TestStrdup;
+    RedisModule_Log = TestLog;
+
+    char err[256];
+    BackendDir = ".";
+    Backend = SCacheBackendGet("sqlite", err, sizeof(err));
+    if (NULL == Backend) {
+        fprintf(stderr, "%s\n", err);
+        return 1;
+    }
+    Conn = Backend->connect("", 0, "", "", ":memory:", 1000, 0, 0, err, sizeof(err));
+    if (NULL == Conn) {
+        fprintf(stderr, "%s\n", err);
+        return 1;
+    }
+
+    TestSelectParse();
+    TestCondMatch();
+    TestSubsume();
+    TestUncacheable();
+    TestDeltaQuery();
+    TestDeltaMerge();
+
+    Backend->close(Conn);
+    printf("%d checks, %d failures\n", Checks, Failures);
+    return Failures ? 1 : 0;
+}
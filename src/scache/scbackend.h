@@ -0,0 +1,95 @@
+///         @file  scbackend.h
+///        @brief  SmartCache database backend interface
+///       @author  François Cerbelle (Fanfan), francois@cerbelle.net
+///    @copyright  Copyright (c) 2017, François Cerbelle
+///
+/// A backend is a shared object (scbackend_<name>.so) loaded with dlopen by
+/// the scache module when a cache using it is created. It exports a
+/// SCacheBackendEntry function returning its function table. Connections and
+/// resultsets are opaque handles for the module.
+///
+/// A connection is only used by one thread at a time, but different
+/// connections can be used concurrently from different threads. Resultsets are
+/// fully buffered by store_result, like mysql_store_result does.
+///
+///  This source code is released for free distribution under the terms of the
+///  GNU General Public License as published by the Free Software Foundation.
+///
+
+#ifndef SCBACKEND_H
+#define SCBACKEND_H
+
+#include <stddef.h>
+
+#define SCACHE_BACKEND_APIVER 4
+#define SCACHE_BACKEND_ENTRY "SCacheBackendEntry"
+
+// Connection flags
+#define SCACHE_CONNECT_MULTI_STATEMENTS 1   // Allow ';'-separated statements
+
+// Generic class of a column, whatever the backend specific type is
+typedef enum {
+    SCACHE_FIELD_STRING = 0,
+    SCACHE_FIELD_INTEGER,
+    SCACHE_FIELD_REAL,
+    SCACHE_FIELD_TEMPORAL,
+    SCACHE_FIELD_BINARY,
+    SCACHE_FIELD_NULL
+} SCacheFieldClass;
+
+typedef struct SCacheField_s {
+    const char* name;
+    const char* type;           // Backend specific type name
+    SCacheFieldClass typeclass;
+} SCacheField;
+
+typedef struct SCacheBackend_s {
+    int apiver;                 // SCACHE_BACKEND_APIVER
+    const char* name;
+
+    // Called once, when the backend is loaded. Returns 0 on success.
+    int (*init)(void);
+
+    // Opens a connection, returns NULL and fills err on failure. Backends
+    // without network ignore host and port, dbname is then a file name. The
+    // database aborts the queries running longer than query_timeout_ms, if
+    // not 0 and supported.
+    void* (*connect)(const char* host, unsigned int port, const char* user,
+            const char* pass, const char* dbname, unsigned int timeout_ms,
+            unsigned int query_timeout_ms, unsigned int flags, char* err, size_t errlen);
+    // Returns 0 if the connection is alive (eventually reconnecting)
+    int (*ping)(void* conn);
+    // Last error message of the connection
+    const char* (*error)(void* conn);
+    void (*close)(void* conn);
+
+    // Executes a query, returns 0 on success
+    int (*query)(void* conn, const char* query, size_t len);
+    // Fetches the whole resultset of the last query, NULL on error. A
+    // statement without resultset, such as an UPDATE, has an empty one.
+    void* (*store_result)(void* conn);
+    void (*free_result)(void* result);
+
+    // Resultset metadata
+    unsigned int (*num_fields)(void* result);
+    const SCacheField* (*fetch_field)(void* result, unsigned int i);
+
+    // Returns the next row values (NULL pointers for SQL NULL) and sets
+    // lengths, or returns NULL after the last row
+    const char** (*fetch_row)(void* result, unsigned long** lengths);
+
+    // Moves to the next resultset of a multi-statement query, to be stored
+    // with store_result. Returns 0 if there is one, -1 if there is no more
+    // resultset, >0 if its statement failed. NULL if the backend does not
+    // support multi-statement queries.
+    int (*next_result)(void* conn);
+
+    // Aborts the query running on target, a connection busy in another
+    // thread, through conn, an idle connection to the same server. Returns
+    // 0 on success. NULL if the backend cannot cancel queries.
+    int (*cancel)(void* conn, void* target);
+} SCacheBackend;
+
+typedef const SCacheBackend* (*SCacheBackendEntryFunc)(void);
+
+#endif
@@ -0,0 +1,184 @@
+///         @file  scbackend_mysql.c
+///        @brief  SmartCache MySQL backend
+///       @author  François Cerbelle (Fanfan), francois@cerbelle.net
+///    @copyright  Copyright (c) 2017, François Cerbelle
+///
+/// libmysqlclient backend, loaded by the scache module as scbackend_mysql.so.
+/// Connections use the auto-reconnect MySQL feature to stay ready for queries.
+///
+///  This source code is released for free distribution under the terms of the
+///  GNU General Public License as published by the Free Software Foundation.
+///
+
+#include "scbackend.h"
+#include <mysql/mysql.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct MySQLResult_s {
+    MYSQL_RES* res;
+    unsigned int num_fields;
+    SCacheField* fields;
+} MySQLResult;
+
+static int MySQLInit(void) {
+    // Has to be called before any thread uses the library
+    return mysql_library_init(0, NULL, NULL);
+}
+
+static void* MySQLConnect(const char* host, unsigned int port, const char* user,
+        const char* pass, const char* dbname, unsigned int timeout_ms,
+        unsigned int query_timeout_ms, unsigned int flags, char* err, size_t errlen) {
+    // Init MySQL options structure with auto-reconnect in case of lost connection
+    MYSQL* mysql = mysql_init(NULL);
+    if (NULL == mysql) {
+        snprintf(err, errlen, "cannot allocate MySQL handle");
+        return NULL;
+    }
+    my_bool reconnect=1;
+    mysql_options(mysql,MYSQL_OPT_RECONNECT,&reconnect);
+    unsigned int timeout = (timeout_ms+999)/1000;
+    if (timeout) mysql_options(mysql,MYSQL_OPT_CONNECT_TIMEOUT,&timeout);
+    // Network timeouts against a hung server, the query keeps running there
+    unsigned int iotimeout = (query_timeout_ms+999)/1000;
+    if (iotimeout) {
+        mysql_options(mysql,MYSQL_OPT_READ_TIMEOUT,&iotimeout);
+        mysql_options(mysql,MYSQL_OPT_WRITE_TIMEOUT,&iotimeout);
+    }
+
+    // Open the connection to MySQL
+    unsigned long clientflag = (flags & SCACHE_CONNECT_MULTI_STATEMENTS) ? CLIENT_MULTI_STATEMENTS : 0;
+    if (NULL == mysql_real_connect(mysql, host, user, pass, dbname, port, 0, clientflag)) {
+        snprintf(err, errlen, "%s", mysql_error(mysql));
+        mysql_close(mysql);
+        return NULL;
+    }
+
+    // Server side SELECT timeout (MySQL 5.7.8+), ignored by the other servers
+    // and lost on reconnection : the scache fetchers kill the late queries
+    if (query_timeout_ms) {
+        char query[64];
+        int len = snprintf(query, sizeof(query), "SET SESSION max_execution_time=%u", query_timeout_ms);
+        mysql_real_query(mysql, query, len);
+    }
+    return mysql;
+}
+
+static int MySQLPing(void* conn) {
+    return mysql_ping(conn);
+}
+
+static const char* MySQLError(void* conn) {
+    return mysql_error(conn);
+}
+
+static void MySQLClose(void* conn) {
+    mysql_close(conn);
+}
+
+static int MySQLQuery(void* conn, const char* query, size_t len) {
+    return mysql_real_query(conn, query, len);
+}
+
+static const char* MySQLTypeName(enum enum_field_types type, SCacheFieldClass* typeclass) {
+    *typeclass = SCACHE_FIELD_STRING;
+    switch (type) {
+        case MYSQL_TYPE_TINY: *typeclass = SCACHE_FIELD_INTEGER; return "MYSQL_TYPE_TINY";
+        case MYSQL_TYPE_SHORT: *typeclass = SCACHE_FIELD_INTEGER; return "MYSQL_TYPE_SHORT";
+        case MYSQL_TYPE_LONG: *typeclass = SCACHE_FIELD_INTEGER; return "MYSQL_TYPE_LONG";
+        case MYSQL_TYPE_INT24: *typeclass = SCACHE_FIELD_INTEGER; return "MYSQL_TYPE_INT24";
+        case MYSQL_TYPE_LONGLONG: *typeclass = SCACHE_FIELD_INTEGER; return "MYSQL_TYPE_LONGLONG";
+        case MYSQL_TYPE_DECIMAL: *typeclass = SCACHE_FIELD_REAL; return "MYSQL_TYPE_DECIMAL";
+        case MYSQL_TYPE_NEWDECIMAL: *typeclass = SCACHE_FIELD_REAL; return "MYSQL_TYPE_NEWDECIMAL";
+        case MYSQL_TYPE_FLOAT: *typeclass = SCACHE_FIELD_REAL; return "MYSQL_TYPE_FLOAT";
+        case MYSQL_TYPE_DOUBLE: *typeclass = SCACHE_FIELD_REAL; return "MYSQL_TYPE_DOUBLE";
+        case MYSQL_TYPE_BIT: *typeclass = SCACHE_FIELD_BINARY; return "MYSQL_TYPE_BIT";
+        case MYSQL_TYPE_TIMESTAMP: *typeclass = SCACHE_FIELD_TEMPORAL; return "MYSQL_TYPE_TIMESTAMP";
+        case MYSQL_TYPE_DATE: *typeclass = SCACHE_FIELD_TEMPORAL; return "MYSQL_TYPE_DATE";
+        case MYSQL_TYPE_TIME: *typeclass = SCACHE_FIELD_TEMPORAL; return "MYSQL_TYPE_TIME";
+        case MYSQL_TYPE_DATETIME: *typeclass = SCACHE_FIELD_TEMPORAL; return "MYSQL_TYPE_DATETIME";
+        case MYSQL_TYPE_YEAR: *typeclass = SCACHE_FIELD_INTEGER; return "MYSQL_TYPE_YEAR";
+        case MYSQL_TYPE_STRING: return "MYSQL_TYPE_STRING";
+        case MYSQL_TYPE_VAR_STRING: return "MYSQL_TYPE_VAR_STRING";
+        case MYSQL_TYPE_BLOB: *typeclass = SCACHE_FIELD_BINARY; return "MYSQL_TYPE_BLOB";
+        case MYSQL_TYPE_SET: return "MYSQL_TYPE_SET";
+        case MYSQL_TYPE_ENUM: return "MYSQL_TYPE_ENUM";
+        case MYSQL_TYPE_GEOMETRY: *typeclass = SCACHE_FIELD_BINARY; return "MYSQL_TYPE_GEOMETRY";
+        case MYSQL_TYPE_NULL: *typeclass = SCACHE_FIELD_NULL; return "MYSQL_TYPE_NULL";
+        default: return "UNKNOWN";
+    }
+}
+
+static void* MySQLStoreResult(void* conn) {
+    MYSQL_RES* res = mysql_store_result(conn);
+    // A statement without resultset (DML) succeeded if it has no field
+    if ((NULL == res)&&(0 != mysql_field_count(conn))) return NULL;
+
+    MySQLResult* result = malloc(sizeof(MySQLResult));
+    result->res = res;
+    result->num_fields = res ? mysql_num_fields(res) : 0;
+    result->fields = calloc(result->num_fields ? result->num_fields : 1, sizeof(SCacheField));
+    MYSQL_FIELD* fields = res ? mysql_fetch_fields(res) : NULL;
+    for (unsigned int i = 0; i < result->num_fields; i++) {
+        result->fields[i].name = fields[i].name;
+        result->fields[i].type = MySQLTypeName(fields[i].type, &result->fields[i].typeclass);
+    }
+    return result;
+}
+
+static void MySQLFreeResult(void* res) {
+    MySQLResult* result = res;
+    if (result->res) mysql_free_result(result->res);
+    free(result->fields);
+    free(result);
+}
+
+static unsigned int MySQLNumFields(void* res) {
+    return ((MySQLResult*)res)->num_fields;
+}
+
+static const SCacheField* MySQLFetchField(void* res, unsigned int i) {
+    return &((MySQLResult*)res)->fields[i];
+}
+
+static const char** MySQLFetchRow(void* res, unsigned long** lengths) {
+    MySQLResult* result = res;
+    if (NULL == result->res) return NULL;
+    MYSQL_ROW row = mysql_fetch_row(result->res);
+    if (NULL == row) return NULL;
+    *lengths = mysql_fetch_lengths(result->res);
+    return (const char**)row;
+}
+
+static int MySQLNextResult(void* conn) {
+    return mysql_next_result(conn);
+}
+
+// The server aborts the statement, the target gets an interrupted error
+static int MySQLCancel(void* conn, void* target) {
+    char query[64];
+    int len = snprintf(query, sizeof(query), "KILL QUERY %lu", mysql_thread_id(target));
+    return mysql_real_query(conn, query, len);
+}
+
+static const SCacheBackend MySQLBackend = {
+    SCACHE_BACKEND_APIVER,
+    "mysql",
+    MySQLInit,
+    MySQLConnect,
+    MySQLPing,
+    MySQLError,
+    MySQLClose,
+    MySQLQuery,
+    MySQLStoreResult,
+    MySQLFreeResult,
+    MySQLNumFields,
+    MySQLFetchField,
+    MySQLFetchRow,
+    MySQLNextResult,
+    MySQLCancel
+};
+
+const SCacheBackend* SCacheBackendEntry(void) {
+    return &MySQLBackend;
+}
@@ -0,0 +1,233 @@
+///         @file  scbackend_sqlite.c
+///        @brief  SmartCache SQLite backend
+///       @author  François Cerbelle (Fanfan), francois@cerbelle.net
+///    @copyright  Copyright (c) 2017, François Cerbelle
+///
+/// In-process SQLite backend, loaded by the scache module as
+/// scbackend_sqlite.so. It has no network latency at all, which makes it
+/// possible to measure the module overhead alone and to test the whole cache
+/// on a single box. The cache dbname is the database file name, host, port,
+/// user and password are ignored. URI file names are accepted, for example
+/// "file:bench?mode=memory&cache=shared" shares an in-memory database between
+/// all the connections of the process.
+///
+///  This source code is released for free distribution under the terms of the
+///  GNU General Public License as published by the Free Software Foundation.
+///
+
+#define _POSIX_C_SOURCE 200809L
+#include "scbackend.h"
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct SQLiteConn_s {
+    sqlite3* db;
+    sqlite3_stmt* stmt;         // Statement of the last query, not yet stored
+    char error[256];
+    unsigned int timeout;       // Query timeout (ms), 0 if none
+    struct timespec start;      // Start of the last query
+} SQLiteConn;
+
+typedef struct SQLiteResult_s {
+    unsigned int num_fields;
+    SCacheField* fields;
+    char** rows;                // num_fields values per row
+    unsigned long* lengths;     // num_fields lengths per row
+    size_t num_rows;
+    size_t next;
+} SQLiteResult;
+
+static int SQLiteInit(void) {
+    return (SQLITE_OK == sqlite3_initialize()) ? 0 : -1;
+}
+
+// Interrupts the queries running longer than the connection timeout
+static int SQLiteProgress(void* c) {
+    SQLiteConn* conn = c;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long elapsed = (now.tv_sec - conn->start.tv_sec)*1000LL + (now.tv_nsec - conn->start.tv_nsec)/1000000;
+    return (elapsed > conn->timeout);
+}
+
+static void* SQLiteConnect(const char* host, unsigned int port, const char* user,
+        const char* pass, const char* dbname, unsigned int timeout_ms,
+        unsigned int query_timeout_ms, unsigned int flags, char* err, size_t errlen) {
+    (void)flags;
+    (void)host;
+    (void)port;
+    (void)user;
+    (void)pass;
+
+    SQLiteConn* conn = calloc(1, sizeof(SQLiteConn));
+    if (SQLITE_OK != sqlite3_open_v2(dbname, &conn->db,
+                SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE|SQLITE_OPEN_URI|SQLITE_OPEN_NOMUTEX, NULL)) {
+        snprintf(err, errlen, "%s", conn->db ? sqlite3_errmsg(conn->db) : "cannot open database");
+        sqlite3_close(conn->db);
+        free(conn);
+        return NULL;
+    }
+    // Wait for concurrent writers instead of failing with SQLITE_BUSY
+    sqlite3_busy_timeout(conn->db, timeout_ms ? timeout_ms : 1000);
+    conn->timeout = query_timeout_ms;
+    if (query_timeout_ms)
+        sqlite3_progress_handler(conn->db, 1000, SQLiteProgress, conn);
+    return conn;
+}
+
+static int SQLitePing(void* conn) {
+    return (NULL == ((SQLiteConn*)conn)->db);
+}
+
+static const char* SQLiteError(void* conn) {
+    return ((SQLiteConn*)conn)->error;
+}
+
+static void SQLiteClose(void* c) {
+    SQLiteConn* conn = c;
+    sqlite3_finalize(conn->stmt);
+    sqlite3_close(conn->db);
+    free(conn);
+}
+
+// Prepares the statement, it is actually evaluated by store_result
+static int SQLiteQuery(void* c, const char* query, size_t len) {
+    SQLiteConn* conn = c;
+    sqlite3_finalize(conn->stmt);
+    conn->stmt = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &conn->start);
+    if (SQLITE_OK != sqlite3_prepare_v2(conn->db, query, len, &conn->stmt, NULL)) {
+        snprintf(conn->error, sizeof(conn->error), "%s", sqlite3_errmsg(conn->db));
+        return -1;
+    }
+    if (NULL == conn->stmt) {
+        snprintf(conn->error, sizeof(conn->error), "empty query");
+        return -1;
+    }
+    return 0;
+}
+
+static const char* SQLiteTypeName(int type, SCacheFieldClass* typeclass) {
+    switch (type) {
+        case SQLITE_INTEGER: *typeclass = SCACHE_FIELD_INTEGER; return "SQLITE_INTEGER";
+        case SQLITE_FLOAT: *typeclass = SCACHE_FIELD_REAL; return "SQLITE_FLOAT";
+        case SQLITE_BLOB: *typeclass = SCACHE_FIELD_BINARY; return "SQLITE_BLOB";
+        case SQLITE_NULL: *typeclass = SCACHE_FIELD_NULL; return "SQLITE_NULL";
+        default: *typeclass = SCACHE_FIELD_STRING; return "SQLITE_TEXT";
+    }
+}
+
+static void SQLiteFreeResult(void* res) {
+    SQLiteResult* result = res;
+    for (size_t i = 0; i < result->num_rows*result->num_fields; i++)
+        free(result->rows[i]);
+    for (unsigned int i = 0; i < result->num_fields; i++)
+        free((char*)result->fields[i].name);
+    free(result->rows);
+    free(result->lengths);
+    free(result->fields);
+    free(result);
+}
+
+// Steps the whole statement and buffers its rows
+static void* SQLiteStoreResult(void* c) {
+    SQLiteConn* conn = c;
+    if (NULL == conn->stmt) {
+        snprintf(conn->error, sizeof(conn->error), "no query to store");
+        return NULL;
+    }
+
+    SQLiteResult* result = calloc(1, sizeof(SQLiteResult));
+    result->num_fields = sqlite3_column_count(conn->stmt);
+    result->fields = calloc(result->num_fields ? result->num_fields : 1, sizeof(SCacheField));
+    for (unsigned int i = 0; i < result->num_fields; i++) {
+        result->fields[i].name = strdup(sqlite3_column_name(conn->stmt, i));
+        // Typed from the first row, SQLite has no static column type
+        result->fields[i].type = SQLiteTypeName(SQLITE_NULL, &result->fields[i].typeclass);
+    }
+
+    size_t capacity = 0;
+    int rc;
+    while (SQLITE_ROW == (rc = sqlite3_step(conn->stmt))) {
+        if (result->num_rows == capacity) {
+            capacity = capacity ? capacity*2 : 64;
+            result->rows = realloc(result->rows, capacity*result->num_fields*sizeof(char*));
+            result->lengths = realloc(result->lengths, capacity*result->num_fields*sizeof(unsigned long));
+        }
+        size_t base = result->num_rows*result->num_fields;
+        for (unsigned int i = 0; i < result->num_fields; i++) {
+            int type = sqlite3_column_type(conn->stmt, i);
+            if ((0 == result->num_rows)||(SCACHE_FIELD_NULL == result->fields[i].typeclass))
+                result->fields[i].type = SQLiteTypeName(type, &result->fields[i].typeclass);
+            if (SQLITE_NULL == type) {
+                result->rows[base+i] = NULL;
+                result->lengths[base+i] = 0;
+                continue;
+            }
+            const unsigned char* text = sqlite3_column_text(conn->stmt, i);
+            int len = sqlite3_column_bytes(conn->stmt, i);
+            result->rows[base+i] = malloc(len+1);
+            memcpy(result->rows[base+i], text, len);
+            result->rows[base+i][len] = 0;
+            result->lengths[base+i] = len;
+        }
+        result->num_rows++;
+    }
+
+    if (SQLITE_DONE != rc) {
+        snprintf(conn->error, sizeof(conn->error), "%s", sqlite3_errmsg(conn->db));
+        SQLiteFreeResult(result);
+        result = NULL;
+    }
+    sqlite3_finalize(conn->stmt);
+    conn->stmt = NULL;
+    return result;
+}
+
+static unsigned int SQLiteNumFields(void* res) {
+    return ((SQLiteResult*)res)->num_fields;
+}
+
+static const SCacheField* SQLiteFetchField(void* res, unsigned int i) {
+    return &((SQLiteResult*)res)->fields[i];
+}
+
+static const char** SQLiteFetchRow(void* res, unsigned long** lengths) {
+    SQLiteResult* result = res;
+    if (result->next >= result->num_rows) return NULL;
+    size_t base = (result->next++)*result->num_fields;
+    *lengths = &result->lengths[base];
+    return (const char**)&result->rows[base];
+}
+
+// In process, the running step is interrupted directly
+static int SQLiteCancel(void* conn, void* target) {
+    (void)conn;
+    sqlite3_interrupt(((SQLiteConn*)target)->db);
+    return 0;
+}
+
+static const SCacheBackend SQLiteBackend = {
+    SCACHE_BACKEND_APIVER,
+    "sqlite",
+    SQLiteInit,
+    SQLiteConnect,
+    SQLitePing,
+    SQLiteError,
+    SQLiteClose,
+    SQLiteQuery,
+    SQLiteStoreResult,
+    SQLiteFreeResult,
+    SQLiteNumFields,
+    SQLiteFetchField,
+    SQLiteFetchRow,
+    NULL,                       // No multi-statement queries
+    SQLiteCancel
+};
+
+const SCacheBackend* SCacheBackendEntry(void) {
+    return &SQLiteBackend;
+}